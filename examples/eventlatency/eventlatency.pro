@@ -0,0 +1,10 @@
+TEMPLATE = app
+QT += vulkan
+CONFIG += console
+
+SOURCES = main.cpp
+
+target.path = $$[QT_INSTALL_EXAMPLES]/eventlatency
+INSTALLS += target
+
+INCLUDEPATH += $$VULKAN_INCLUDE_PATH
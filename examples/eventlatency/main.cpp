@@ -0,0 +1,229 @@
+/****************************************************************************
+**
+** Copyright (C) 2016 The Qt Company Ltd.
+** Contact: http://www.qt.io/licensing/
+**
+** This file is part of the examples of the QtVulkan module
+**
+** $QT_BEGIN_LICENSE:BSD$
+** You may use this file under the terms of the BSD license as follows:
+**
+** "Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are
+** met:
+**   * Redistributions of source code must retain the above copyright
+**     notice, this list of conditions and the following disclaimer.
+**   * Redistributions in binary form must reproduce the above copyright
+**     notice, this list of conditions and the following disclaimer in
+**     the documentation and/or other materials provided with the
+**     distribution.
+**   * Neither the name of The Qt Company Ltd nor the names of its
+**     contributors may be used to endorse or promote products derived
+**     from this software without specific prior written permission.
+**
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+** "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+** LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+** A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+** OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+** SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+** LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+** DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+** THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+** (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE."
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+#include <QGuiApplication>
+#include <QThread>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QAtomicInt>
+#include <QVector>
+#include <QScopedPointer>
+#include <QVulkanRenderLoop>
+#include <algorithm>
+
+// Measures how long it takes for frameQueued(), posted from another thread,
+// to get dispatched on the render thread while a number of producer threads
+// keep hammering update() and frameQueued().
+//
+//   eventlatency [--producers N] [--seconds S] [-platform offscreen]
+
+static QElapsedTimer benchClock;
+
+class LatencyWorker : public QVulkanFrameWorker
+{
+public:
+    LatencyWorker(QVulkanRenderLoop *rl) : m_renderLoop(rl) { }
+
+    void init() override { }
+    void resize(const QSize &) override { }
+    void cleanup() override { }
+    void queueFrame(int frame, VkQueue queue, VkSemaphore waitSem, VkSemaphore signalSem) override;
+
+    // Called by the producers, only one of them wins each frame.
+    bool tryEndFrame();
+    void stop();
+
+    QVector<qint64> latencies; // ns, render thread only until the render loop is gone
+
+private:
+    QVulkanRenderLoop *m_renderLoop;
+    quint64 m_queuedCount = 0;
+    qint64 m_queueFrameEnd = 0;
+    qint64 m_handOffTime = 0; // from the end of queueFrame() to the frameQueued() call
+    QAtomicInt m_frameOpen;
+    QAtomicInt m_stopping;
+};
+
+void LatencyWorker::queueFrame(int frame, VkQueue queue, VkSemaphore waitSem, VkSemaphore signalSem)
+{
+    Q_UNUSED(frame);
+    Q_UNUSED(queue);
+    Q_UNUSED(waitSem);
+    Q_UNUSED(signalSem);
+
+    // The previous frame has been presented by now. Its frameQueuedWaitTime
+    // runs from the return of queueFrame() to the dispatch of frameQueued(),
+    // so what remains after taking out the hand-off is the post-to-dispatch
+    // latency. m_handOffTime was published by the frameQueued() event itself.
+    if (m_queuedCount) {
+        QVulkanFrameTimings timings;
+        if (m_renderLoop->frameTimings(&timings, 1) == 1 && timings.frameNumber == m_queuedCount - 1)
+            latencies.append(timings.frameQueuedWaitTime - m_handOffTime);
+    }
+    ++m_queuedCount;
+
+    // Nothing to record, the frame is left for a producer to end.
+    m_queueFrameEnd = benchClock.nsecsElapsed();
+    m_frameOpen.fetchAndStoreOrdered(1);
+    if (m_stopping.loadAcquire())
+        tryEndFrame();
+}
+
+bool LatencyWorker::tryEndFrame()
+{
+    if (!m_frameOpen.testAndSetOrdered(1, 0))
+        return false;
+    m_handOffTime = benchClock.nsecsElapsed() - m_queueFrameEnd;
+    m_renderLoop->frameQueued();
+    return true;
+}
+
+// Once the producers are gone, whichever of us and queueFrame() comes last
+// ends the open frame.
+void LatencyWorker::stop()
+{
+    m_stopping.fetchAndStoreOrdered(1);
+    tryEndFrame();
+}
+
+class Producer : public QThread
+{
+public:
+    Producer(QVulkanRenderLoop *rl, LatencyWorker *worker, QAtomicInt *stop)
+        : m_renderLoop(rl), m_worker(worker), m_stop(stop) { }
+
+    QVector<qint64> updateTimes; // ns, of every 64th update() call
+    quint64 updateCount = 0;
+
+protected:
+    void run() override;
+
+private:
+    QVulkanRenderLoop *m_renderLoop;
+    LatencyWorker *m_worker;
+    QAtomicInt *m_stop;
+};
+
+void Producer::run()
+{
+    while (!m_stop->loadAcquire()) {
+        if (updateCount++ % 64 == 0) {
+            const qint64 t = benchClock.nsecsElapsed();
+            m_renderLoop->update();
+            updateTimes.append(benchClock.nsecsElapsed() - t);
+        } else {
+            m_renderLoop->update();
+        }
+        m_worker->tryEndFrame();
+    }
+}
+
+static void printPercentiles(const char *what, QVector<qint64> samples)
+{
+    if (samples.isEmpty()) {
+        qDebug("%s: no samples", what);
+        return;
+    }
+    std::sort(samples.begin(), samples.end());
+    auto at = [&samples](int percentile) {
+        return samples[(samples.count() - 1) * percentile / 100] / 1000.0;
+    };
+    qDebug("%s: %d samples, median %.2f us, 90th %.2f us, 99th %.2f us, max %.2f us",
+           what, samples.count(), at(50), at(90), at(99), at(100));
+}
+
+int main(int argc, char **argv)
+{
+    QGuiApplication app(argc, argv);
+
+    const QStringList args = app.arguments();
+    int producerCount = qMax(1, QThread::idealThreadCount() - 1);
+    int seconds = 5;
+    int idx = args.indexOf(QStringLiteral("--producers"));
+    if (idx >= 0 && idx + 1 < args.count())
+        producerCount = qMax(1, args.at(idx + 1).toInt());
+    idx = args.indexOf(QStringLiteral("--seconds"));
+    if (idx >= 0 && idx + 1 < args.count())
+        seconds = qMax(1, args.at(idx + 1).toInt());
+
+    benchClock.start();
+
+    // No window and no throttling, so frames are only limited by how fast
+    // frameQueued() gets to the render thread. NonBlockingEvents makes
+    // update() and frameQueued() plain posts instead of round trips.
+    QScopedPointer<QVulkanRenderLoop> rl(new QVulkanRenderLoop(QSize(64, 64)));
+    rl->setFlags(QVulkanRenderLoop::SingleSubmit | QVulkanRenderLoop::NonBlockingEvents);
+
+    LatencyWorker worker(rl.data());
+    rl->setWorker(&worker);
+
+    QAtomicInt stop;
+    QVector<Producer *> producers;
+    for (int i = 0; i < producerCount; ++i) {
+        producers.append(new Producer(rl.data(), &worker, &stop));
+        producers.last()->start();
+    }
+    qDebug("%d producer threads, running for %d seconds", producerCount, seconds);
+
+    QTimer::singleShot(seconds * 1000, [&]() {
+        stop.storeRelease(1);
+        for (Producer *p : producers)
+            p->wait();
+        worker.stop();
+        qApp->quit();
+    });
+
+    const int r = app.exec();
+    rl.reset(); // the latencies are only complete once the render thread is gone
+
+    QVector<qint64> updateTimes;
+    quint64 updateCount = 0;
+    for (Producer *p : producers) {
+        updateTimes += p->updateTimes;
+        updateCount += p->updateCount;
+    }
+    qDeleteAll(producers);
+
+    qDebug("%llu update() calls", updateCount);
+    printPercentiles("frameQueued() post to dispatch", worker.latencies);
+    printPercentiles("update() call", updateTimes);
+
+    return r;
+}
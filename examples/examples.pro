@@ -1,3 +1,3 @@
 TEMPLATE = subdirs
-SUBDIRS += hellovulkanwindow
+SUBDIRS += hellovulkanwindow eventlatency
 qtHaveModule(widgets): SUBDIRS += hellovulkanwidget
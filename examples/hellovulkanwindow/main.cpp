@@ -40,6 +40,8 @@
 
 #include <QGuiApplication>
 #include <QWindow>
+#include <QTimer>
+#include <QScopedPointer>
 #include "worker.h"
 
 int main(int argc, char **argv)
@@ -49,24 +51,56 @@ int main(int argc, char **argv)
 
     QGuiApplication app(argc, argv);
 
-    qDebug("Opening window. Main/gui thread is %p", QThread::currentThread());
+    // With --offscreen there is no window at all: render as fast as possible
+    // for a few seconds, print the frame times, and exit. Combine with
+    // -platform offscreen on machines without a display.
+    const bool offscreen = app.arguments().contains(QStringLiteral("--offscreen"));
+    // With --low-latency frames start as late as possible before the vsync.
+    const bool lowLatency = app.arguments().contains(QStringLiteral("--low-latency"));
 
     QWindow window;
     window.setSurfaceType(QSurface::OpenGLSurface);
 
-    // Attach a Vulkan renderer to our window.
-    QVulkanRenderLoop rl(&window);
+    // Attach a Vulkan renderer to our window, or render into images of the given size.
+    QScopedPointer<QVulkanRenderLoop> rl(offscreen ? new QVulkanRenderLoop(QSize(1024, 768))
+                                                   : new QVulkanRenderLoop(&window));
 
     // Default is FIFO mode (vsync, throttle the thread), validation off, no continuous update requests, 1 frame in flight.
     // Change this a bit:
-    rl.setFlags(QVulkanRenderLoop::UpdateContinuously | QVulkanRenderLoop::EnableValidation /* | QVulkanRenderLoop::Unthrottled */);
-    rl.setFramesInFlight(FRAMES_IN_FLIGHT);
+    rl->setFlags(QVulkanRenderLoop::UpdateContinuously | QVulkanRenderLoop::EnableValidation
+                 | QVulkanRenderLoop::SingleSubmit /* | QVulkanRenderLoop::Unthrottled */);
+    rl->setFramesInFlight(FRAMES_IN_FLIGHT);
+    if (lowLatency) {
+        rl->setTargetLatency(1);
+        if (offscreen)
+            rl->setOffscreenRefreshRate(60);
+    }
 
     // Attach our worker to the Vulkan renderer. Note that while the worker
     // object lives on the main/gui thread, its functions will get invoked on
     // the renderer's dedicated thread.
-    Worker worker(&rl);
-    rl.setWorker(&worker);
+    Worker worker(rl.data());
+    rl->setWorker(&worker);
+
+    if (offscreen) {
+        rl->update();
+        QTimer::singleShot(5000, [&rl]() {
+            QVulkanFrameTimings median = rl->frameTimingsPercentile(50);
+            QVulkanFrameTimings p99 = rl->frameTimingsPercentile(99);
+            qDebug("frame interval: median %lld us, 99th percentile %lld us",
+                   median.frameInterval / 1000, p99.frameInterval / 1000);
+            QVulkanShaderStats shaders = rl->shaderStats();
+            qDebug("shaders: %d files, %lld us loading, %lld us creating modules",
+                   shaders.fileCount, shaders.loadTime / 1000, shaders.createTime / 1000);
+            qDebug("latency: %lld us", rl->achievedLatency() / 1000);
+            qApp->quit();
+        });
+        const int r = app.exec();
+        rl.reset(); // stop rendering while the worker is still around
+        return r;
+    }
+
+    qDebug("Opening window. Main/gui thread is %p", QThread::currentThread());
 
     window.resize(1024, 768);
 
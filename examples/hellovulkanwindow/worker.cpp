@@ -40,7 +40,7 @@
 
 #include "worker.h"
 #include <QVulkanFunctions>
-#include <QFile>
+#include <QThread>
 
 // Y is negated when compared to OpenGL
 static float vertexData[] = {
@@ -51,65 +51,36 @@ static float vertexData[] = {
 
 static const int UNIFORM_DATA_SIZE = 16 * sizeof(float);
 
-static inline VkDeviceSize aligned(VkDeviceSize v, VkDeviceSize byteAlign)
+void Worker::updateDescriptorSet()
 {
-    return (v + byteAlign - 1) & ~(byteAlign - 1);
-}
-
-VkShaderModule Worker::createShader(const QString &name)
-{
-    QFile file(name);
-    if (!file.open(QIODevice::ReadOnly)) {
-        qWarning("Failed to read shader %s", qPrintable(name));
-        return VK_NULL_HANDLE;
-    }
-    QByteArray blob = file.readAll();
-    file.close();
-
-    QVulkanFunctions *f = m_renderLoop->functions();
-    VkDevice dev = m_renderLoop->device();
-
-    VkShaderModuleCreateInfo shaderInfo;
-    memset(&shaderInfo, 0, sizeof(shaderInfo));
-    shaderInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-    shaderInfo.codeSize = blob.size();
-    shaderInfo.pCode = reinterpret_cast<const uint32_t *>(blob.constData());
-    VkShaderModule shaderModule;
-    VkResult err = f->vkCreateShaderModule(dev, &shaderInfo, nullptr, &shaderModule);
-    if (err != VK_SUCCESS) {
-        qWarning("Failed to create shader module: %d", err);
-        return VK_NULL_HANDLE;
-    }
-
-    return shaderModule;
+    m_uniformBuf = m_renderLoop->dynamicBuffer();
+    VkDescriptorBufferInfo uniformBufInfo = { m_uniformBuf, 0, UNIFORM_DATA_SIZE };
+    VkWriteDescriptorSet descWrite;
+    memset(&descWrite, 0, sizeof(descWrite));
+    descWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descWrite.dstSet = m_descSet;
+    descWrite.descriptorCount = 1;
+    descWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    descWrite.pBufferInfo = &uniformBufInfo;
+    m_renderLoop->functions()->vkUpdateDescriptorSets(m_renderLoop->device(), 1, &descWrite, 0, nullptr);
 }
 
 void Worker::init()
 {
-    for (int i = 0; i < FRAMES_IN_FLIGHT; ++i)
-        m_cb[i] = VK_NULL_HANDLE;
-
     QVulkanFunctions *f = m_renderLoop->functions();
     VkDevice dev = m_renderLoop->device();
 
-    // Prepare the vertex and uniform buffers. The vertex data will never
-    // change so one buffer is sufficient regardless of the value of
-    // FRAMES_IN_FLIGHT. Uniform data is changing per frame however so active
-    // frames have to have a dedicated copy.
-
-    // Use just one memory allocation and one buffer. We will then specify the
-    // appropriate offsets for uniform buffers in the VkDescriptorBufferInfo.
-    // Have to watch out for VkPhysicalDeviceLimits::minUniformBufferOffsetAlignment, though.
+    // Prepare the vertex buffer. The vertex data will never change so one
+    // buffer is sufficient regardless of the value of FRAMES_IN_FLIGHT.
+    // Uniform data is changing per frame however, that goes to the render
+    // loop's dynamic buffer instead, which has a separate region for each
+    // frame in flight.
 
-    const VkDeviceSize uniAlign = m_renderLoop->physicalDeviceLimits()->minUniformBufferOffsetAlignment; // 256 bytes usually
     VkBufferCreateInfo bufInfo;
     memset(&bufInfo, 0, sizeof(bufInfo));
     bufInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    // Our internal layout is vertex, uniform, uniform, ... with each uniform buffer start offset aligned to uniAlign.
-    const VkDeviceSize vertexAllocSize = aligned(sizeof(vertexData), uniAlign);
-    const VkDeviceSize uniformAllocSize = aligned(UNIFORM_DATA_SIZE, uniAlign);
-    bufInfo.size = vertexAllocSize + FRAMES_IN_FLIGHT * uniformAllocSize;
-    bufInfo.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
+    bufInfo.size = sizeof(vertexData);
+    bufInfo.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
 
     VkResult err = f->vkCreateBuffer(dev, &bufInfo, nullptr, &m_buf);
     if (err != VK_SUCCESS)
@@ -118,36 +89,18 @@ void Worker::init()
     VkMemoryRequirements memReq;
     f->vkGetBufferMemoryRequirements(dev, m_buf, &memReq);
 
-    VkMemoryAllocateInfo memAllocInfo = {
-        VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-        nullptr,
-        memReq.size,
-        m_renderLoop->hostVisibleMemoryIndex()
-    };
+    // Device local memory, filled by the render loop's upload thread. The
+    // triangle is not drawn until the upload is ready.
+    m_bufAlloc = m_renderLoop->allocateMemory(memReq, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    if (m_bufAlloc.memory == VK_NULL_HANDLE)
+        qFatal("Failed to allocate memory");
 
-    err = f->vkAllocateMemory(dev, &memAllocInfo, nullptr, &m_bufMem);
-    if (err != VK_SUCCESS)
-        qFatal("Failed to allocate memory: %d", err);
-
-    err = f->vkBindBufferMemory(dev, m_buf, m_bufMem, 0);
+    err = f->vkBindBufferMemory(dev, m_buf, m_bufAlloc.memory, m_bufAlloc.offset);
     if (err != VK_SUCCESS)
         qFatal("Failed to bind buffer memory: %d", err);
 
-    quint8 *p;
-    err = f->vkMapMemory(dev, m_bufMem, 0, memReq.size, 0, reinterpret_cast<void **>(&p));
-    if (err != VK_SUCCESS)
-        qFatal("Failed to map memory: %d", err);
-    memcpy(p, vertexData, sizeof(vertexData));
-    QMatrix4x4 ident;
-    memset(m_uniformBufInfo, 0, sizeof(m_uniformBufInfo));
-    for (int i = 0; i < FRAMES_IN_FLIGHT; ++i) {
-        const VkDeviceSize offset = vertexAllocSize + i * uniformAllocSize;
-        memcpy(p + offset, ident.constData(), 16 * sizeof(float));
-        m_uniformBufInfo[i].buffer = m_buf;
-        m_uniformBufInfo[i].offset = offset;
-        m_uniformBufInfo[i].range = uniformAllocSize;
-    }
-    f->vkUnmapMemory(dev, m_bufMem);
+    m_bufUpload = m_renderLoop->uploadBuffer(m_buf, 0, QByteArray::fromRawData(reinterpret_cast<const char *>(vertexData),
+                                                                              sizeof(vertexData)));
 
     VkVertexInputBindingDescription vertexBindingDesc = {
         0, // binding
@@ -178,7 +131,12 @@ void Worker::init()
     vertexInputInfo.vertexAttributeDescriptionCount = 2;
     vertexInputInfo.pVertexAttributeDescriptions = vertexAttrDesc;
 
-    // Create render pass.
+    // Create render pass. With SingleSubmit the render pass takes care of
+    // the swapchain image's layout transitions, otherwise the render loop
+    // hands over and expects the image in COLOR_ATTACHMENT_OPTIMAL.
+    m_singleSubmit = m_renderLoop->flags().testFlag(QVulkanRenderLoop::SingleSubmit);
+    // Offscreen the render loop takes care of the final transition.
+    m_presentLayout = m_renderLoop->isOffscreen() ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
     VkAttachmentDescription attDesc[2];
     memset(attDesc, 0, sizeof(attDesc));
     attDesc[0].format = m_renderLoop->swapChainFormat();
@@ -187,8 +145,8 @@ void Worker::init()
     attDesc[0].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
     attDesc[0].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
     attDesc[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
-    attDesc[0].initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-    attDesc[0].finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    attDesc[0].initialLayout = m_singleSubmit ? VK_IMAGE_LAYOUT_UNDEFINED : VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    attDesc[0].finalLayout = m_singleSubmit ? m_presentLayout : VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
     attDesc[1].format = m_renderLoop->depthStencilFormat();
     attDesc[1].samples = VK_SAMPLE_COUNT_1_BIT;
     attDesc[1].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
@@ -208,6 +166,29 @@ void Worker::init()
     subPassDesc.pColorAttachments = &colorRef;
     subPassDesc.pDepthStencilAttachment = &dsRef;
 
+    // The initial layout transition must not happen before the acquire
+    // semaphore wait, which is at COLOR_ATTACHMENT_OUTPUT. Nothing else
+    // chains the frames in flight, so the depth writes of the previous
+    // frame have to be waited for here as well.
+    VkSubpassDependency subPassDeps[2];
+    memset(subPassDeps, 0, sizeof(subPassDeps));
+    subPassDeps[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+    subPassDeps[0].dstSubpass = 0;
+    subPassDeps[0].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
+            | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    subPassDeps[0].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
+            | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    subPassDeps[0].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    subPassDeps[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT
+            | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    // The final layout transition has to happen before the render loop's
+    // barrier that starts from the state reported with setImageState().
+    subPassDeps[1].srcSubpass = 0;
+    subPassDeps[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+    subPassDeps[1].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    subPassDeps[1].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    subPassDeps[1].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+
     VkRenderPassCreateInfo rpInfo;
     memset(&rpInfo, 0, sizeof(rpInfo));
     rpInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
@@ -215,6 +196,10 @@ void Worker::init()
     rpInfo.pAttachments = attDesc;
     rpInfo.subpassCount = 1;
     rpInfo.pSubpasses = &subPassDesc;
+    if (m_singleSubmit) {
+        rpInfo.dependencyCount = 2;
+        rpInfo.pDependencies = subPassDeps;
+    }
     err = f->vkCreateRenderPass(dev, &rpInfo, nullptr, &m_renderPass);
     if (err != VK_SUCCESS)
         qFatal("Failed to create renderpass: %d", err);
@@ -223,15 +208,16 @@ void Worker::init()
     for (size_t i = 0; i < sizeof(m_fb) / sizeof(VkFramebuffer); ++i)
         m_fb[i] = VK_NULL_HANDLE;
 
-    // Set up descriptor set and its layout.
+    // Set up descriptor set and its layout. The uniform buffer is dynamic so
+    // a single set is enough, the offset is provided when binding.
     VkDescriptorPoolSize descPoolSizes = {
-        VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-        2
+        VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+        1
     };
     VkDescriptorPoolCreateInfo descPoolInfo;
     memset(&descPoolInfo, 0, sizeof(descPoolInfo));
     descPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-    descPoolInfo.maxSets = 2;
+    descPoolInfo.maxSets = 1;
     descPoolInfo.poolSizeCount = 1;
     descPoolInfo.pPoolSizes = &descPoolSizes;
     err = f->vkCreateDescriptorPool(dev, &descPoolInfo, nullptr, &m_descPool);
@@ -240,7 +226,7 @@ void Worker::init()
 
     VkDescriptorSetLayoutBinding layoutBinding = {
         0, // binding
-        VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+        VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
         1,
         VK_SHADER_STAGE_VERTEX_BIT,
         nullptr
@@ -256,36 +242,20 @@ void Worker::init()
     if (err != VK_SUCCESS)
         qFatal("Failed to create descriptor set layout: %d", err);
 
-    for (int i = 0; i < FRAMES_IN_FLIGHT; ++i) {
-        VkDescriptorSetAllocateInfo descSetAllocInfo = {
-            VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
-            nullptr,
-            m_descPool,
-            1,
-            &m_descSetLayout
-        };
-        err = f->vkAllocateDescriptorSets(dev, &descSetAllocInfo, &m_descSet[i]);
-        if (err != VK_SUCCESS)
-            qFatal("Failed to allocate descriptor set: %d", err);
-
-        VkWriteDescriptorSet descWrite;
-        memset(&descWrite, 0, sizeof(descWrite));
-        descWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        descWrite.dstSet = m_descSet[i];
-        descWrite.descriptorCount = 1;
-        descWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-        descWrite.pBufferInfo = &m_uniformBufInfo[i];
-        f->vkUpdateDescriptorSets(dev, 1, &descWrite, 0, nullptr);
-    }
-
-    // Pipeline.
-    VkPipelineCacheCreateInfo pipelineCacheInfo;
-    memset(&pipelineCacheInfo, 0, sizeof(pipelineCacheInfo));
-    pipelineCacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
-    err = f->vkCreatePipelineCache(dev, &pipelineCacheInfo, nullptr, &m_pipelineCache);
+    VkDescriptorSetAllocateInfo descSetAllocInfo = {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        nullptr,
+        m_descPool,
+        1,
+        &m_descSetLayout
+    };
+    err = f->vkAllocateDescriptorSets(dev, &descSetAllocInfo, &m_descSet);
     if (err != VK_SUCCESS)
-        qFatal("Failed to create pipeline cache: %d", err);
+        qFatal("Failed to allocate descriptor set: %d", err);
 
+    updateDescriptorSet();
+
+    // Pipeline. The render loop's pipeline cache persists across runs.
     VkPipelineLayoutCreateInfo pipelineLayoutInfo;
     memset(&pipelineLayoutInfo, 0, sizeof(pipelineLayoutInfo));
     pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
@@ -299,8 +269,9 @@ void Worker::init()
     memset(&pipelineInfo, 0, sizeof(pipelineInfo));
     pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
 
-    VkShaderModule vertShaderModule = createShader(":/shaders/color_vert.spv");
-    VkShaderModule fragShaderModule = createShader(":/shaders/color_frag.spv");
+    // Owned by the render loop, mapped and created only once.
+    VkShaderModule vertShaderModule = m_renderLoop->shaderModule(QStringLiteral(":/shaders/color_vert.spv"));
+    VkShaderModule fragShaderModule = m_renderLoop->shaderModule(QStringLiteral(":/shaders/color_frag.spv"));
     VkPipelineShaderStageCreateInfo shaderStages[2] = {
         {
             VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
@@ -385,14 +356,9 @@ void Worker::init()
     pipelineInfo.layout = m_pipelineLayout;
     pipelineInfo.renderPass = m_renderPass;
 
-    err = f->vkCreateGraphicsPipelines(dev, m_pipelineCache, 1, &pipelineInfo, nullptr, &m_pipeline);
-    if (err != VK_SUCCESS)
-        qFatal("Failed to create graphics pipeline: %d", err);
-
-    if (vertShaderModule != VK_NULL_HANDLE)
-        f->vkDestroyShaderModule(dev, vertShaderModule, nullptr);
-    if (fragShaderModule != VK_NULL_HANDLE)
-        f->vkDestroyShaderModule(dev, fragShaderModule, nullptr);
+    // Built in the background. Frames only clear until it is ready.
+    m_pipelineFuture = m_renderLoop->buildGraphicsPipeline(pipelineInfo);
+    m_pipeline = VK_NULL_HANDLE;
 
     m_rotation = 0.0f;
 }
@@ -405,9 +371,17 @@ void Worker::resize(const QSize &size)
     QVulkanFunctions *f = m_renderLoop->functions();
     VkDevice dev = m_renderLoop->device();
 
+    // A different buffer means frames in flight were increased, which
+    // happens with all frames finished, so the set can be updated in place.
+    if (m_renderLoop->dynamicBuffer() != m_uniformBuf)
+        updateDescriptorSet();
+
+    // Previous frames may still be using the old framebuffers.
     for (size_t i = 0; i < sizeof(m_fb) / sizeof(VkFramebuffer); ++i) {
-        if (m_fb[i] != VK_NULL_HANDLE)
-            f->vkDestroyFramebuffer(dev, m_fb[i], nullptr);
+        if (m_fb[i] != VK_NULL_HANDLE) {
+            m_renderLoop->releaseFramebufferLater(m_fb[i]);
+            m_fb[i] = VK_NULL_HANDLE;
+        }
     }
 
     const int count = m_renderLoop->swapChainImageCount();
@@ -443,64 +417,76 @@ void Worker::cleanup()
     QVulkanFunctions *f = m_renderLoop->functions();
     VkDevice dev = m_renderLoop->device();
 
-    f->vkDestroyPipeline(dev, m_pipeline, nullptr);
+    // The render loop has waited for the build already.
+    if (m_pipeline == VK_NULL_HANDLE)
+        m_pipeline = m_pipelineFuture.result();
+    if (m_pipeline != VK_NULL_HANDLE)
+        f->vkDestroyPipeline(dev, m_pipeline, nullptr);
     f->vkDestroyPipelineLayout(dev, m_pipelineLayout, nullptr);
-    f->vkDestroyPipelineCache(dev, m_pipelineCache, nullptr);
 
     f->vkDestroyDescriptorSetLayout(dev, m_descSetLayout, nullptr);
     f->vkDestroyDescriptorPool(dev, m_descPool, nullptr);
 
-    for (int i = 0; i < m_renderLoop->swapChainImageCount(); ++i)
-        f->vkDestroyFramebuffer(dev, m_fb[i], nullptr);
+    // The image count may have shrunk since the framebuffers were created.
+    for (size_t i = 0; i < sizeof(m_fb) / sizeof(VkFramebuffer); ++i) {
+        if (m_fb[i] != VK_NULL_HANDLE) {
+            f->vkDestroyFramebuffer(dev, m_fb[i], nullptr);
+            m_fb[i] = VK_NULL_HANDLE;
+        }
+    }
 
     f->vkDestroyRenderPass(dev, m_renderPass, nullptr);
 
     f->vkDestroyBuffer(dev, m_buf, nullptr);
-    f->vkFreeMemory(dev, m_bufMem, nullptr);
-
-    for (int i = 0; i < FRAMES_IN_FLIGHT; ++i) {
-        if (m_cb[i] != VK_NULL_HANDLE) {
-            f->vkFreeCommandBuffers(dev, m_renderLoop->commandPool(), 1, &m_cb[i]);
-            m_cb[i] = VK_NULL_HANDLE;
-        }
-    }
+    m_renderLoop->freeMemory(m_bufAlloc);
 }
 
-void Worker::queueFrame(int frame, VkQueue queue, VkSemaphore waitSem, VkSemaphore signalSem)
+// Called before the swapchain image is acquired, so anything not needing it
+// is best done here, while the acquire may block.
+void Worker::prepareFrame(int frame)
 {
-    qDebug("worker queueFrame %d on thread %p", frame, QThread::currentThread()); // frame = 0 .. frames_in_flight - 1
+    Q_UNUSED(frame);
 
-    QVulkanFunctions *f = m_renderLoop->functions();
-    VkDevice dev = m_renderLoop->device();
-
-    // Free the command buffer used in frame no. current - frames_in_flight,
-    // we know for sure that that frame has already finished.
-    if (m_cb[frame] != VK_NULL_HANDLE)
-        f->vkFreeCommandBuffers(dev, m_renderLoop->commandPool(), 1, &m_cb[frame]);
+    if (m_pipeline == VK_NULL_HANDLE && m_pipelineFuture.isFinished()) {
+        m_pipeline = m_pipelineFuture.result();
+        if (m_pipeline == VK_NULL_HANDLE)
+            qFatal("Failed to create graphics pipeline");
+    }
 
-    quint8 *p;
-    VkResult err = f->vkMapMemory(dev, m_bufMem, m_uniformBufInfo[frame].offset, UNIFORM_DATA_SIZE, 0, reinterpret_cast<void **>(&p));
-    if (err != VK_SUCCESS)
-        qFatal("Failed to map memory: %d", err);
+    // Writing the uniform data is just a memcpy to the current frame's
+    // region of the dynamic buffer.
+    QVulkanDynamicAllocation uniformData = m_renderLoop->allocateDynamic(UNIFORM_DATA_SIZE);
     QMatrix4x4 m = m_proj;
     m.rotate(m_rotation, 0, 1, 0);
-    memcpy(p, m.constData(), 16 * sizeof(float));
-    f->vkUnmapMemory(dev, m_bufMem);
+    memcpy(uniformData.data, m.constData(), 16 * sizeof(float));
+    m_uniformOffset = uint32_t(uniformData.offset);
 
     // Not exactly a real animation system, just advance on every frame for now.
     m_rotation += 1.0f;
+}
 
-    VkCommandBufferAllocateInfo cmdBufInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, nullptr, m_renderLoop->commandPool(), VK_COMMAND_BUFFER_LEVEL_PRIMARY, 1 };
-    err = f->vkAllocateCommandBuffers(dev, &cmdBufInfo, &m_cb[frame]);
-    if (err != VK_SUCCESS)
-        qFatal("Failed to allocate command buffer: %d", err);
+void Worker::queueFrame(int frame, VkQueue queue, VkSemaphore waitSem, VkSemaphore signalSem)
+{
+    qDebug("worker queueFrame %d on thread %p", frame, QThread::currentThread()); // frame = 0 .. frames_in_flight - 1
 
-    VkCommandBuffer cb = m_cb[frame];
+    QVulkanFunctions *f = m_renderLoop->functions();
+    VkDevice dev = m_renderLoop->device();
 
-    VkCommandBufferBeginInfo cmdBufBeginInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, nullptr, 0, nullptr };
-    err = f->vkBeginCommandBuffer(cb, &cmdBufBeginInfo);
-    if (err != VK_SUCCESS)
-        qFatal("Failed to begin command buffer: %d", err);
+    // With SingleSubmit we record into the render loop's command buffer,
+    // which is already recording and gets submitted after frameQueued().
+    VkCommandBuffer cb = m_renderLoop->currentCommandBuffer();
+    VkResult err;
+    if (!m_singleSubmit) {
+        VkCommandBufferAllocateInfo cmdBufInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, nullptr, m_renderLoop->commandPool(), VK_COMMAND_BUFFER_LEVEL_PRIMARY, 1 };
+        err = f->vkAllocateCommandBuffers(dev, &cmdBufInfo, &cb);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to allocate command buffer: %d", err);
+
+        VkCommandBufferBeginInfo cmdBufBeginInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, nullptr, 0, nullptr };
+        err = f->vkBeginCommandBuffer(cb, &cmdBufBeginInfo);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to begin command buffer: %d", err);
+    }
 
     VkClearColorValue clearColor = { 0.0f, 0.0f, 1.0f, 1.0f };
     VkClearDepthStencilValue clearDS = { 1.0f, 0 };
@@ -519,49 +505,68 @@ void Worker::queueFrame(int frame, VkQueue queue, VkSemaphore waitSem, VkSemapho
     rpBeginInfo.clearValueCount = 2;
     rpBeginInfo.pClearValues = clearValues;
 
+    // Shows up in gpuRangeTimes() when GpuTimestamps is set.
+    const int range = m_renderLoop->beginGpuRange(cb, "main pass");
     f->vkCmdBeginRenderPass(cb, &rpBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
 
-    f->vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipeline);
-    f->vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout, 0, 1, &m_descSet[frame], 0, nullptr);
-    VkDeviceSize vbOffset = 0;
-    f->vkCmdBindVertexBuffers(cb, 0, 1, &m_buf, &vbOffset);
-
-    VkViewport viewport;
-    viewport.x = viewport.y = 0;
-    viewport.width = m_size.width();
-    viewport.height = m_size.height();
-    viewport.minDepth = 0;
-    viewport.maxDepth = 1;
-    f->vkCmdSetViewport(cb, 0, 1, &viewport);
-
-    VkRect2D scissor;
-    scissor.offset.x = scissor.offset.y = 0;
-    scissor.extent.width = viewport.width;
-    scissor.extent.height = viewport.height;
-    f->vkCmdSetScissor(cb, 0, 1, &scissor);
-
-    f->vkCmdDraw(cb, 3, 1, 0, 0);
+    if (m_pipeline != VK_NULL_HANDLE && m_renderLoop->isUploadReady(m_bufUpload)) {
+        f->vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipeline);
+        f->vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout, 0, 1, &m_descSet, 1, &m_uniformOffset);
+        VkDeviceSize vbOffset = 0;
+        f->vkCmdBindVertexBuffers(cb, 0, 1, &m_buf, &vbOffset);
+
+        VkViewport viewport;
+        viewport.x = viewport.y = 0;
+        viewport.width = m_size.width();
+        viewport.height = m_size.height();
+        viewport.minDepth = 0;
+        viewport.maxDepth = 1;
+        f->vkCmdSetViewport(cb, 0, 1, &viewport);
+
+        VkRect2D scissor;
+        scissor.offset.x = scissor.offset.y = 0;
+        scissor.extent.width = viewport.width;
+        scissor.extent.height = viewport.height;
+        f->vkCmdSetScissor(cb, 0, 1, &scissor);
+
+        f->vkCmdDraw(cb, 3, 1, 0, 0);
+    }
 
     f->vkCmdEndRenderPass(cb);
+    m_renderLoop->endGpuRange(cb, range);
+
+    m_renderLoop->flushDynamicData();
+
+    if (m_singleSubmit) {
+        // Let the render loop know that the image is ready to be presented.
+        QVulkanImageState state = { m_presentLayout,
+                                    VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+                                    VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
+        m_renderLoop->setImageState(QVulkanRenderLoop::SwapChainImage, state);
+    } else {
+        err = f->vkEndCommandBuffer(cb);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to end command buffer: %d", err);
+
+        VkSubmitInfo submitInfo;
+        memset(&submitInfo, 0, sizeof(submitInfo));
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &cb;
+        submitInfo.waitSemaphoreCount = 1;
+        submitInfo.pWaitSemaphores = &waitSem;
+        submitInfo.signalSemaphoreCount = 1;
+        submitInfo.pSignalSemaphores = &signalSem;
+        // Wait where the render pass first touches the attachments.
+        VkPipelineStageFlags psf = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+        submitInfo.pWaitDstStageMask = &psf;
+        err = f->vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to submit to command queue: %d", err);
 
-    err = f->vkEndCommandBuffer(cb);
-    if (err != VK_SUCCESS)
-        qFatal("Failed to end command buffer: %d", err);
-
-    VkSubmitInfo submitInfo;
-    memset(&submitInfo, 0, sizeof(submitInfo));
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &cb;
-    submitInfo.waitSemaphoreCount = 1;
-    submitInfo.pWaitSemaphores = &waitSem;
-    submitInfo.signalSemaphoreCount = 1;
-    submitInfo.pSignalSemaphores = &signalSem;
-    VkPipelineStageFlags psf = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
-    submitInfo.pWaitDstStageMask = &psf;
-    err = f->vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE);
-    if (err != VK_SUCCESS)
-        qFatal("Failed to submit to command queue: %d", err);
+        // The render loop frees the command buffer once the frame has finished.
+        m_renderLoop->releaseCommandBufferLater(m_renderLoop->commandPool(), cb);
+    }
 
 #ifndef TEST_ASYNC
     // All command buffer have been submitted with correct wait/signal
@@ -573,9 +578,11 @@ void Worker::queueFrame(int frame, VkQueue queue, VkSemaphore waitSem, VkSemapho
     // Note that one thing we cannot do on this thread is to use timers or
     // other stuff relying on the Qt event loop. This is because while the the
     // thread spins the Qt loop between frames, it will now go to sleep until
-    // frameQueued() is called. However, nothing prevents us from spawning as
-    // many threads as we want.
-    QThreadPool::globalInstance()->start(new AsyncFrameTest(this));
+    // frameQueued() is called. Frame jobs run on the render loop's job
+    // threads, and once all of them have finished, frameQueued() gets called
+    // automatically.
+    const QVulkanJob sleepJob = m_renderLoop->addFrameJob([](int) { QThread::msleep(10); });
+    m_renderLoop->addFrameJob([](int) { QThread::msleep(10); }, QVector<QVulkanJob>() << sleepJob);
 #endif
 
     // Could schedule updates manually if we did not have UpdateContinuously set:
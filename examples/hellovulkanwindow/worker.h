@@ -42,8 +42,8 @@
 #define WORKER_H
 
 #include <QVulkanRenderLoop>
-#include <QThreadPool>
 #include <QMatrix4x4>
+#include <QFuture>
 
 const int FRAMES_IN_FLIGHT = 2;
 
@@ -55,48 +55,39 @@ public:
     void init() override;
     void resize(const QSize &size) override;
     void cleanup() override;
+    void prepareFrame(int frame) override;
     void queueFrame(int frame, VkQueue queue, VkSemaphore waitSem, VkSemaphore signalSem) override;
 
 private:
-    VkShaderModule createShader(const QString &name);
+    void updateDescriptorSet();
 
     QVulkanRenderLoop *m_renderLoop;
 
     QSize m_size;
+    bool m_singleSubmit;
+    VkImageLayout m_presentLayout;
 
-    VkCommandBuffer m_cb[FRAMES_IN_FLIGHT];
-
-    VkDeviceMemory m_bufMem;
+    QVulkanMemoryAllocation m_bufAlloc;
     VkBuffer m_buf;
-    VkDescriptorBufferInfo m_uniformBufInfo[FRAMES_IN_FLIGHT];
+    QVulkanUploadToken m_bufUpload;
 
     VkRenderPass m_renderPass;
     VkFramebuffer m_fb[3];
 
     VkDescriptorPool m_descPool;
     VkDescriptorSetLayout m_descSetLayout;
-    VkDescriptorSet m_descSet[FRAMES_IN_FLIGHT];
+    VkDescriptorSet m_descSet;
+    VkBuffer m_uniformBuf;
+    uint32_t m_uniformOffset;
 
-    VkPipelineCache m_pipelineCache;
     VkPipelineLayout m_pipelineLayout;
+    QFuture<VkPipeline> m_pipelineFuture;
     VkPipeline m_pipeline;
 
     QMatrix4x4 m_proj;
     float m_rotation;
-
-    friend class AsyncFrameTest;
 };
 
 //#define TEST_ASYNC
 
-#ifdef TEST_ASYNC
-class AsyncFrameTest : public QRunnable
-{
-public:
-    AsyncFrameTest(Worker *w) : m_w(w) { }
-    void run() override { QThread::msleep(20); m_w->m_renderLoop->frameQueued(); }
-    Worker *m_w;
-};
-#endif
-
 #endif
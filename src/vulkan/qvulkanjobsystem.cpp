@@ -0,0 +1,290 @@
+/****************************************************************************
+**
+** Copyright (C) 2016 The Qt Company Ltd.
+** Contact: http://www.qt.io/licensing/
+**
+** This file is part of the QtVulkan module
+**
+** $QT_BEGIN_LICENSE:LGPL3$
+** Commercial License Usage
+** Licensees holding valid commercial Qt licenses may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement between you and The Qt Company. For licensing terms
+** and conditions see http://www.qt.io/terms-conditions. For further
+** information use the contact form at http://www.qt.io/contact-us.
+**
+** GNU Lesser General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU Lesser
+** General Public License version 3 as published by the Free Software
+** Foundation and appearing in the file LICENSE.LGPLv3 included in the
+** packaging of this file. Please review the following information to
+** ensure the GNU Lesser General Public License version 3 requirements
+** will be met: https://www.gnu.org/licenses/lgpl.html.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 2.0 or later as published by the Free
+** Software Foundation and appearing in the file LICENSE.GPL included in
+** the packaging of this file. Please review the following information to
+** ensure the GNU General Public License version 2.0 requirements will be
+** met: http://www.gnu.org/licenses/gpl-2.0.html.
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+#include "qvulkanjobsystem_p.h"
+#include "qvulkantracer_p.h"
+#include <QThread>
+#include <qalgorithms.h>
+#include <QVarLengthArray>
+#include <QDebug>
+
+QT_BEGIN_NAMESPACE
+
+class QVulkanJobThread : public QThread
+{
+public:
+    QVulkanJobThread(QVulkanJobSystem *s, int index) : m_s(s), m_index(index) { }
+
+    void run() override
+    {
+        QVulkanJobSystem::Queue *q = m_s->m_queues[m_index];
+        for ( ; ; ) {
+            if (QVulkanJobSystem::Job *job = m_s->take(m_index)) {
+                m_s->run(job, m_index);
+                continue;
+            }
+            QMutexLocker lock(&m_s->m_sleepMutex);
+            if (m_s->m_quit)
+                return;
+            if (!m_s->m_stealable.load() && !q->pinnedCount.load())
+                m_s->m_wake.wait(&m_s->m_sleepMutex);
+        }
+    }
+
+private:
+    QVulkanJobSystem *m_s;
+    int m_index;
+};
+
+QVulkanJobSystem::QVulkanJobSystem()
+    // Leave a core for the render thread.
+    : m_threadCount(qMax(1, QThread::idealThreadCount() - 1))
+{
+}
+
+QVulkanJobSystem::~QVulkanJobSystem()
+{
+    waitForDone();
+
+    m_sleepMutex.lock();
+    m_quit = true;
+    m_wake.wakeAll();
+    m_sleepMutex.unlock();
+
+    for (QVulkanJobThread *t : qAsConst(m_threads)) {
+        t->wait();
+        delete t;
+    }
+    qDeleteAll(m_queues);
+}
+
+void QVulkanJobSystem::beginGraph()
+{
+    QMutexLocker lock(&m_graphMutex);
+    while (m_busy)
+        m_graphDone.wait(&m_graphMutex);
+    m_busy = true;
+    m_pending = 1;
+}
+
+// Returns -1 when there is no graph to add to.
+QVulkanJob QVulkanJobSystem::addJob(const QVulkanJobFunction &func, const QVector<QVulkanJob> &dependencies, int threadIndex)
+{
+    QMutexLocker lock(&m_graphMutex);
+    if (!m_busy || !m_pending) {
+        qWarning("QVulkanJobSystem: No frame to add the job to");
+        return -1;
+    }
+
+    if (m_threads.isEmpty()) {
+        for (int i = 0; i < m_threadCount; ++i)
+            m_queues.append(new Queue);
+        for (int i = 0; i < m_threadCount; ++i) {
+            QVulkanJobThread *t = new QVulkanJobThread(this, i);
+            t->start();
+            m_threads.append(t);
+        }
+    }
+
+    Job *job = new Job;
+    job->func = func;
+    job->threadIndex = threadIndex >= 0 ? threadIndex % m_threadCount : -1;
+    job->waitCount = 0;
+    job->finished = false;
+    for (QVulkanJob dep : dependencies) {
+        if (dep < 0 || dep >= m_jobs.count()) {
+            qWarning("QVulkanJobSystem: Invalid dependency %d", dep);
+            continue;
+        }
+        Job *d = m_jobs[dep];
+        if (!d->finished) {
+            d->dependents.append(job);
+            ++job->waitCount;
+        }
+    }
+
+    const QVulkanJob handle = m_jobs.count();
+    m_jobs.append(job);
+    ++m_pending;
+    const bool ready = !job->waitCount;
+    lock.unlock();
+
+    if (ready)
+        schedule(job);
+
+    return handle;
+}
+
+// Closes the graph. Returns false when it had no jobs, otherwise onFinished
+// is called once all of them have finished, possibly right away.
+bool QVulkanJobSystem::endGraph(const std::function<void()> &onFinished)
+{
+    m_graphMutex.lock();
+    if (m_jobs.isEmpty()) {
+        m_busy = false;
+        m_pending = 0;
+        m_graphDone.wakeAll();
+        m_graphMutex.unlock();
+        return false;
+    }
+    m_onFinished = onFinished;
+    m_graphMutex.unlock();
+
+    release();
+    return true;
+}
+
+void QVulkanJobSystem::waitForDone()
+{
+    QMutexLocker lock(&m_graphMutex);
+    while (m_busy)
+        m_graphDone.wait(&m_graphMutex);
+}
+
+int QVulkanJobSystem::currentThreadIndex() const
+{
+    QThread *t = QThread::currentThread();
+    for (int i = 0; i < m_threads.count(); ++i) {
+        if (m_threads[i] == t)
+            return i;
+    }
+    return -1;
+}
+
+void QVulkanJobSystem::schedule(Job *job)
+{
+    const bool pinned = job->threadIndex >= 0;
+    int index = job->threadIndex;
+    if (!pinned) {
+        index = currentThreadIndex();
+        if (index < 0)
+            index = uint(m_nextQueue.fetchAndAddRelaxed(1)) % uint(m_threadCount);
+    }
+
+    Queue *q = m_queues[index];
+    q->mutex.lock();
+    if (pinned)
+        q->pinned.append(job);
+    else
+        q->jobs.append(job);
+    q->mutex.unlock();
+    if (pinned)
+        q->pinnedCount.ref();
+    else
+        m_stealable.ref();
+
+    m_sleepMutex.lock();
+    m_wake.wakeAll();
+    m_sleepMutex.unlock();
+}
+
+QVulkanJobSystem::Job *QVulkanJobSystem::take(int threadIndex)
+{
+    Job *job = nullptr;
+    Queue *q = m_queues[threadIndex];
+    q->mutex.lock();
+    if (!q->pinned.isEmpty()) {
+        job = q->pinned.first();
+        q->pinned.removeFirst();
+        q->pinnedCount.deref();
+    } else if (!q->jobs.isEmpty()) {
+        job = q->jobs.last();
+        q->jobs.removeLast();
+        m_stealable.deref();
+    }
+    q->mutex.unlock();
+    if (job)
+        return job;
+
+    for (int i = 1; i < m_threadCount; ++i) {
+        Queue *victim = m_queues[(threadIndex + i) % m_threadCount];
+        QMutexLocker lock(&victim->mutex);
+        if (!victim->jobs.isEmpty()) {
+            job = victim->jobs.first();
+            victim->jobs.removeFirst();
+            m_stealable.deref();
+            return job;
+        }
+    }
+    return nullptr;
+}
+
+void QVulkanJobSystem::run(Job *job, int threadIndex)
+{
+    {
+        QVK_TRACE_SCOPE("job");
+        job->func(threadIndex);
+    }
+
+    QVarLengthArray<Job *, 8> ready;
+    m_graphMutex.lock();
+    job->finished = true;
+    for (Job *d : qAsConst(job->dependents)) {
+        if (!--d->waitCount)
+            ready.append(d);
+    }
+    m_graphMutex.unlock();
+
+    for (Job *d : ready)
+        schedule(d);
+
+    release();
+}
+
+// Drops a reference to the graph. The last one calls onFinished, and only
+// then lets the next graph begin.
+void QVulkanJobSystem::release()
+{
+    m_graphMutex.lock();
+    if (--m_pending) {
+        m_graphMutex.unlock();
+        return;
+    }
+    std::function<void()> onFinished = m_onFinished;
+    m_graphMutex.unlock();
+
+    if (onFinished)
+        onFinished();
+
+    QMutexLocker lock(&m_graphMutex);
+    qDeleteAll(m_jobs);
+    m_jobs.clear();
+    m_onFinished = nullptr;
+    m_busy = false;
+    m_graphDone.wakeAll();
+}
+
+QT_END_NAMESPACE
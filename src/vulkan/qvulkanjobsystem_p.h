@@ -0,0 +1,124 @@
+/****************************************************************************
+**
+** Copyright (C) 2016 The Qt Company Ltd.
+** Contact: http://www.qt.io/licensing/
+**
+** This file is part of the QtVulkan module
+**
+** $QT_BEGIN_LICENSE:LGPL3$
+** Commercial License Usage
+** Licensees holding valid commercial Qt licenses may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement between you and The Qt Company. For licensing terms
+** and conditions see http://www.qt.io/terms-conditions. For further
+** information use the contact form at http://www.qt.io/contact-us.
+**
+** GNU Lesser General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU Lesser
+** General Public License version 3 as published by the Free Software
+** Foundation and appearing in the file LICENSE.LGPLv3 included in the
+** packaging of this file. Please review the following information to
+** ensure the GNU Lesser General Public License version 3 requirements
+** will be met: https://www.gnu.org/licenses/lgpl.html.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 2.0 or later as published by the Free
+** Software Foundation and appearing in the file LICENSE.GPL included in
+** the packaging of this file. Please review the following information to
+** ensure the GNU General Public License version 2.0 requirements will be
+** met: http://www.gnu.org/licenses/gpl-2.0.html.
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+#ifndef QVULKANJOBSYSTEM_P_H
+#define QVULKANJOBSYSTEM_P_H
+
+#include "qvulkanrenderloop.h"
+#include <QMutex>
+#include <QWaitCondition>
+#include <QVector>
+#include <QAtomicInt>
+
+//
+//  W A R N I N G
+//  -------------
+//
+// This file is not part of the Qt API.  It exists for the convenience
+// of a number of Qt sources files.  This header file may change from
+// version to version without notice, or even be removed.
+//
+// We mean it.
+//
+
+QT_BEGIN_NAMESPACE
+
+class QVulkanJobThread;
+
+// Runs a graph of jobs with dependencies on a set of threads, started on
+// first use. Every thread has its own queue: it takes its newest job first,
+// and when it runs dry, steals the oldest ones from the others. Jobs with a
+// thread index are pinned to that thread and never stolen. One graph at a
+// time; it is open between beginGraph() and endGraph(), and jobs can add
+// further jobs to it until it finishes.
+class QVulkanJobSystem
+{
+public:
+    QVulkanJobSystem();
+    ~QVulkanJobSystem();
+
+    int threadCount() const { return m_threadCount; }
+
+    void beginGraph();
+    QVulkanJob addJob(const QVulkanJobFunction &func, const QVector<QVulkanJob> &dependencies, int threadIndex);
+    bool endGraph(const std::function<void()> &onFinished);
+    void waitForDone();
+
+private:
+    friend class QVulkanJobThread;
+
+    struct Job {
+        QVulkanJobFunction func;
+        int threadIndex; // -1 when not pinned
+        int waitCount; // unfinished dependencies
+        bool finished;
+        QVector<Job *> dependents;
+    };
+
+    struct Queue {
+        QMutex mutex;
+        QVector<Job *> pinned; // run in order by the owner only
+        QVector<Job *> jobs; // the owner takes from the back, thieves from the front
+        QAtomicInt pinnedCount;
+    };
+
+    int currentThreadIndex() const;
+    void schedule(Job *job);
+    Job *take(int threadIndex);
+    void run(Job *job, int threadIndex);
+    void release();
+
+    int m_threadCount;
+    QVector<QVulkanJobThread *> m_threads;
+    QVector<Queue *> m_queues;
+    QAtomicInt m_stealable;
+    QAtomicInt m_nextQueue; // for jobs scheduled from other threads
+
+    QMutex m_sleepMutex;
+    QWaitCondition m_wake;
+    bool m_quit = false;
+
+    QMutex m_graphMutex;
+    QWaitCondition m_graphDone;
+    bool m_busy = false; // from beginGraph() until the graph has finished
+    int m_pending = 0; // unfinished jobs, plus one while the graph is open
+    QVector<Job *> m_jobs; // indexed by QVulkanJob
+    std::function<void()> m_onFinished;
+};
+
+QT_END_NAMESPACE
+
+#endif // QVULKANJOBSYSTEM_P_H
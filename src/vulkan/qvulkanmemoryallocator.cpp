@@ -0,0 +1,324 @@
+/****************************************************************************
+**
+** Copyright (C) 2016 The Qt Company Ltd.
+** Contact: http://www.qt.io/licensing/
+**
+** This file is part of the QtVulkan module
+**
+** $QT_BEGIN_LICENSE:LGPL3$
+** Commercial License Usage
+** Licensees holding valid commercial Qt licenses may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement between you and The Qt Company. For licensing terms
+** and conditions see http://www.qt.io/terms-conditions. For further
+** information use the contact form at http://www.qt.io/contact-us.
+**
+** GNU Lesser General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU Lesser
+** General Public License version 3 as published by the Free Software
+** Foundation and appearing in the file LICENSE.LGPLv3 included in the
+** packaging of this file. Please review the following information to
+** ensure the GNU Lesser General Public License version 3 requirements
+** will be met: https://www.gnu.org/licenses/lgpl.html.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 2.0 or later as published by the Free
+** Software Foundation and appearing in the file LICENSE.GPL included in
+** the packaging of this file. Please review the following information to
+** ensure the GNU General Public License version 2.0 requirements will be
+** met: http://www.gnu.org/licenses/gpl-2.0.html.
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+#include "qvulkanmemoryallocator_p.h"
+#include <QVulkanFunctions>
+#include <QDebug>
+
+QT_BEGIN_NAMESPACE
+
+#define DECLARE_DEBUG_VAR(variable) \
+    static bool debug_ ## variable() \
+    { static bool value = qgetenv("QVULKAN_DEBUG").contains(QT_STRINGIFY(variable)); return value; }
+
+DECLARE_DEBUG_VAR(memory)
+
+static inline VkDeviceSize nextPowerOfTwo(VkDeviceSize v)
+{
+    VkDeviceSize p = 1;
+    while (p < v)
+        p <<= 1;
+    return p;
+}
+
+QVulkanMemoryAllocator::QVulkanMemoryAllocator(QVulkanFunctions *functions, VkDevice dev,
+                                               const VkPhysicalDeviceMemoryProperties &memProps,
+                                               const VkPhysicalDeviceLimits &limits)
+    : f(functions),
+      m_dev(dev),
+      m_memProps(memProps),
+      m_separateTiling(limits.bufferImageGranularity > 1)
+{
+}
+
+QVulkanMemoryAllocator::~QVulkanMemoryAllocator()
+{
+    if (m_allocationCount)
+        qWarning("QVulkanMemoryAllocator: %d allocations leaked", m_allocationCount);
+
+    for (Block *block : qAsConst(m_blocks))
+        destroyBlock(block);
+}
+
+int QVulkanMemoryAllocator::findMemoryType(uint32_t memoryTypeBits, VkMemoryPropertyFlags required,
+                                           VkMemoryPropertyFlags preferred) const
+{
+    int result = -1;
+    for (uint32_t i = 0; i < m_memProps.memoryTypeCount; ++i) {
+        if (!(memoryTypeBits & (1 << i)))
+            continue;
+        const VkMemoryPropertyFlags flags = m_memProps.memoryTypes[i].propertyFlags;
+        if ((flags & required) != required)
+            continue;
+        if ((flags & preferred) == preferred)
+            return i;
+        if (result < 0)
+            result = i;
+    }
+    return result;
+}
+
+VkDeviceSize QVulkanMemoryAllocator::blockSize(uint32_t memoryTypeIndex) const
+{
+    // Small heaps (like the host visible window into VRAM on some cards)
+    // should not get eaten up by a single block.
+    const uint32_t heapIndex = m_memProps.memoryTypes[memoryTypeIndex].heapIndex;
+    const VkDeviceSize heapSize = m_memProps.memoryHeaps[heapIndex].size;
+    VkDeviceSize size = MAX_BLOCK_SIZE;
+    while (size > heapSize / 8 && size > 1024 * 1024)
+        size >>= 1;
+    return size;
+}
+
+int QVulkanMemoryAllocator::maxOrder(const Block *block) const
+{
+    return qCountTrailingZeroBits(quint64(block->size / MIN_NODE_SIZE));
+}
+
+QVulkanMemoryAllocator::Block *QVulkanMemoryAllocator::createBlock(uint32_t memoryTypeIndex, VkDeviceSize size,
+                                                                   bool linear, bool dedicated)
+{
+    VkMemoryAllocateInfo memInfo;
+    memset(&memInfo, 0, sizeof(memInfo));
+    memInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    memInfo.allocationSize = size;
+    memInfo.memoryTypeIndex = memoryTypeIndex;
+
+    VkDeviceMemory memory;
+    VkResult err = f->vkAllocateMemory(m_dev, &memInfo, nullptr, &memory);
+    if (err != VK_SUCCESS) {
+        qWarning("QVulkanMemoryAllocator: Failed to allocate %llu bytes of memory type %u: %d",
+                 (unsigned long long) size, memoryTypeIndex, err);
+        return nullptr;
+    }
+
+    quint8 *mapped = nullptr;
+    if (m_memProps.memoryTypes[memoryTypeIndex].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        err = f->vkMapMemory(m_dev, memory, 0, VK_WHOLE_SIZE, 0, reinterpret_cast<void **>(&mapped));
+        if (err != VK_SUCCESS) {
+            qWarning("QVulkanMemoryAllocator: Failed to map memory: %d", err);
+            f->vkFreeMemory(m_dev, memory, nullptr);
+            return nullptr;
+        }
+    }
+
+    Block *block = new Block;
+    block->memory = memory;
+    block->size = size;
+    block->memoryTypeIndex = memoryTypeIndex;
+    block->linear = linear;
+    block->dedicated = dedicated;
+    block->mapped = mapped;
+    if (!dedicated) {
+        block->freeLists.resize(maxOrder(block) + 1);
+        block->freeLists.last().append(0);
+    }
+
+    m_blocks.append(block);
+    m_bytesReserved += size;
+
+    if (Q_UNLIKELY(debug_memory()))
+        qDebug("new %s block of %llu bytes for memtype %u (%d blocks)", dedicated ? "dedicated" : "shared",
+               (unsigned long long) size, memoryTypeIndex, m_blocks.count());
+
+    return block;
+}
+
+void QVulkanMemoryAllocator::destroyBlock(Block *block)
+{
+    if (block->mapped)
+        f->vkUnmapMemory(m_dev, block->memory);
+    f->vkFreeMemory(m_dev, block->memory, nullptr);
+    m_bytesReserved -= block->size;
+    delete block;
+}
+
+bool QVulkanMemoryAllocator::allocateNode(Block *block, int order, VkDeviceSize *offset)
+{
+    int k = order;
+    while (k < block->freeLists.count() && block->freeLists[k].isEmpty())
+        ++k;
+    if (k == block->freeLists.count())
+        return false;
+
+    VkDeviceSize off = block->freeLists[k].takeLast();
+    // Split until the node has the requested size, the upper halves become free buddies.
+    while (k > order) {
+        --k;
+        block->freeLists[k].append(off + (MIN_NODE_SIZE << k));
+    }
+
+    *offset = off;
+    return true;
+}
+
+QVulkanMemoryAllocation QVulkanMemoryAllocator::allocate(const VkMemoryRequirements &req,
+                                                         VkMemoryPropertyFlags required,
+                                                         VkMemoryPropertyFlags preferred,
+                                                         VkImageTiling tiling)
+{
+    QVulkanMemoryAllocation alloc;
+    memset(&alloc, 0, sizeof(alloc));
+
+    const int memTypeIndex = findMemoryType(req.memoryTypeBits, required, preferred | required);
+    if (memTypeIndex < 0) {
+        qWarning("QVulkanMemoryAllocator: No suitable memory type for bits 0x%x and flags 0x%x",
+                 req.memoryTypeBits, required);
+        return alloc;
+    }
+
+    const bool linear = m_separateTiling ? tiling == VK_IMAGE_TILING_LINEAR : true;
+    const VkDeviceSize blkSize = blockSize(memTypeIndex);
+    // Nodes are aligned to their size within the block, and blocks are
+    // suitably aligned for anything.
+    const VkDeviceSize nodeSize = nextPowerOfTwo(qMax(qMax(req.size, req.alignment), MIN_NODE_SIZE));
+
+    QMutexLocker lock(&m_mutex);
+
+    Block *block = nullptr;
+    Node node;
+    node.size = req.size;
+
+    if (nodeSize > blkSize / 2) {
+        block = createBlock(memTypeIndex, req.size, linear, true);
+        if (!block)
+            return alloc;
+        node.order = -1;
+        alloc.offset = 0;
+    } else {
+        node.order = qCountTrailingZeroBits(quint64(nodeSize / MIN_NODE_SIZE));
+        for (Block *b : qAsConst(m_blocks)) {
+            if (!b->dedicated && b->memoryTypeIndex == uint32_t(memTypeIndex) && b->linear == linear
+                    && allocateNode(b, node.order, &alloc.offset)) {
+                block = b;
+                break;
+            }
+        }
+        if (!block) {
+            block = createBlock(memTypeIndex, blkSize, linear, false);
+            if (!block)
+                return alloc;
+            allocateNode(block, node.order, &alloc.offset);
+        }
+        m_bytesWasted += nodeSize - req.size;
+    }
+
+    block->nodes.insert(alloc.offset, node);
+    ++m_allocationCount;
+    m_bytesAllocated += req.size;
+
+    alloc.memory = block->memory;
+    alloc.size = req.size;
+    alloc.mapped = block->mapped ? block->mapped + alloc.offset : nullptr;
+    alloc.memoryTypeIndex = memTypeIndex;
+    alloc.handle = block;
+    return alloc;
+}
+
+void QVulkanMemoryAllocator::free(const QVulkanMemoryAllocation &alloc)
+{
+    if (!alloc.handle)
+        return;
+
+    QMutexLocker lock(&m_mutex);
+
+    Block *block = static_cast<Block *>(alloc.handle);
+    auto it = block->nodes.find(alloc.offset);
+    if (it == block->nodes.end()) {
+        qWarning("QVulkanMemoryAllocator: Attempted to free unknown allocation at offset %llu",
+                 (unsigned long long) alloc.offset);
+        return;
+    }
+    const Node node = *it;
+    block->nodes.erase(it);
+    --m_allocationCount;
+    m_bytesAllocated -= node.size;
+
+    if (block->dedicated) {
+        m_blocks.removeOne(block);
+        destroyBlock(block);
+        return;
+    }
+
+    m_bytesWasted -= (MIN_NODE_SIZE << node.order) - node.size;
+
+    // Merge with the buddy for as long as it is free.
+    VkDeviceSize off = alloc.offset;
+    int k = node.order;
+    const int topOrder = maxOrder(block);
+    while (k < topOrder) {
+        const VkDeviceSize buddy = off ^ (MIN_NODE_SIZE << k);
+        const int idx = block->freeLists[k].indexOf(buddy);
+        if (idx < 0)
+            break;
+        block->freeLists[k].removeAt(idx);
+        off = qMin(off, buddy);
+        ++k;
+    }
+    block->freeLists[k].append(off);
+
+    // Release empty blocks, unless it is the last one for its memory type,
+    // to avoid thrashing.
+    if (block->nodes.isEmpty()) {
+        bool hasOther = false;
+        for (const Block *b : qAsConst(m_blocks)) {
+            if (b != block && !b->dedicated && b->memoryTypeIndex == block->memoryTypeIndex
+                    && b->linear == block->linear) {
+                hasOther = true;
+                break;
+            }
+        }
+        if (hasOther) {
+            m_blocks.removeOne(block);
+            destroyBlock(block);
+        }
+    }
+}
+
+QVulkanMemoryStats QVulkanMemoryAllocator::stats() const
+{
+    QMutexLocker lock(&m_mutex);
+
+    QVulkanMemoryStats s;
+    s.blockCount = m_blocks.count();
+    s.allocationCount = m_allocationCount;
+    s.bytesReserved = m_bytesReserved;
+    s.bytesAllocated = m_bytesAllocated;
+    s.bytesWasted = m_bytesWasted;
+    return s;
+}
+
+QT_END_NAMESPACE
@@ -0,0 +1,126 @@
+/****************************************************************************
+**
+** Copyright (C) 2016 The Qt Company Ltd.
+** Contact: http://www.qt.io/licensing/
+**
+** This file is part of the QtVulkan module
+**
+** $QT_BEGIN_LICENSE:LGPL3$
+** Commercial License Usage
+** Licensees holding valid commercial Qt licenses may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement between you and The Qt Company. For licensing terms
+** and conditions see http://www.qt.io/terms-conditions. For further
+** information use the contact form at http://www.qt.io/contact-us.
+**
+** GNU Lesser General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU Lesser
+** General Public License version 3 as published by the Free Software
+** Foundation and appearing in the file LICENSE.LGPLv3 included in the
+** packaging of this file. Please review the following information to
+** ensure the GNU Lesser General Public License version 3 requirements
+** will be met: https://www.gnu.org/licenses/lgpl.html.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 2.0 or later as published by the Free
+** Software Foundation and appearing in the file LICENSE.GPL included in
+** the packaging of this file. Please review the following information to
+** ensure the GNU General Public License version 2.0 requirements will be
+** met: http://www.gnu.org/licenses/gpl-2.0.html.
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+#ifndef QVULKANMEMORYALLOCATOR_P_H
+#define QVULKANMEMORYALLOCATOR_P_H
+
+#include "qvulkanrenderloop.h"
+#include <QMutex>
+#include <QVector>
+#include <QHash>
+
+//
+//  W A R N I N G
+//  -------------
+//
+// This file is not part of the Qt API.  It exists for the convenience
+// of a number of Qt sources files.  This header file may change from
+// version to version without notice, or even be removed.
+//
+// We mean it.
+//
+
+QT_BEGIN_NAMESPACE
+
+class QVulkanFunctions;
+
+// Buddy allocator on top of large VkDeviceMemory blocks, one set of blocks
+// per memory type. Linear (buffers, linear images) and optimal tiling
+// resources never share a block unless bufferImageGranularity is 1, so the
+// granularity needs no further care. Requests larger than half a block get
+// a dedicated allocation. Host visible blocks are mapped for their whole
+// lifetime. Thread-safe.
+class QVulkanMemoryAllocator
+{
+public:
+    QVulkanMemoryAllocator(QVulkanFunctions *f, VkDevice dev,
+                           const VkPhysicalDeviceMemoryProperties &memProps,
+                           const VkPhysicalDeviceLimits &limits);
+    ~QVulkanMemoryAllocator();
+
+    int findMemoryType(uint32_t memoryTypeBits, VkMemoryPropertyFlags required,
+                       VkMemoryPropertyFlags preferred) const;
+
+    QVulkanMemoryAllocation allocate(const VkMemoryRequirements &req,
+                                     VkMemoryPropertyFlags required,
+                                     VkMemoryPropertyFlags preferred,
+                                     VkImageTiling tiling);
+    void free(const QVulkanMemoryAllocation &alloc);
+
+    QVulkanMemoryStats stats() const;
+
+private:
+    static const VkDeviceSize MIN_NODE_SIZE = 256;
+    static const VkDeviceSize MAX_BLOCK_SIZE = 32 * 1024 * 1024;
+
+    struct Node {
+        int order; // -1 for dedicated allocations
+        VkDeviceSize size;
+    };
+
+    struct Block {
+        VkDeviceMemory memory;
+        VkDeviceSize size;
+        uint32_t memoryTypeIndex;
+        bool linear;
+        bool dedicated;
+        quint8 *mapped;
+        QVector<QVector<VkDeviceSize> > freeLists; // offsets, indexed by order
+        QHash<VkDeviceSize, Node> nodes; // live allocations, keyed by offset
+    };
+
+    Block *createBlock(uint32_t memoryTypeIndex, VkDeviceSize size, bool linear, bool dedicated);
+    void destroyBlock(Block *block);
+    bool allocateNode(Block *block, int order, VkDeviceSize *offset);
+    VkDeviceSize blockSize(uint32_t memoryTypeIndex) const;
+    int maxOrder(const Block *block) const;
+
+    QVulkanFunctions *f;
+    VkDevice m_dev;
+    VkPhysicalDeviceMemoryProperties m_memProps;
+    bool m_separateTiling;
+
+    mutable QMutex m_mutex;
+    QVector<Block *> m_blocks;
+    int m_allocationCount = 0;
+    VkDeviceSize m_bytesReserved = 0;
+    VkDeviceSize m_bytesAllocated = 0;
+    VkDeviceSize m_bytesWasted = 0;
+};
+
+QT_END_NAMESPACE
+
+#endif // QVULKANMEMORYALLOCATOR_P_H
@@ -0,0 +1,338 @@
+/****************************************************************************
+**
+** Copyright (C) 2016 The Qt Company Ltd.
+** Contact: http://www.qt.io/licensing/
+**
+** This file is part of the QtVulkan module
+**
+** $QT_BEGIN_LICENSE:LGPL3$
+** Commercial License Usage
+** Licensees holding valid commercial Qt licenses may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement between you and The Qt Company. For licensing terms
+** and conditions see http://www.qt.io/terms-conditions. For further
+** information use the contact form at http://www.qt.io/contact-us.
+**
+** GNU Lesser General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU Lesser
+** General Public License version 3 as published by the Free Software
+** Foundation and appearing in the file LICENSE.LGPLv3 included in the
+** packaging of this file. Please review the following information to
+** ensure the GNU Lesser General Public License version 3 requirements
+** will be met: https://www.gnu.org/licenses/lgpl.html.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 2.0 or later as published by the Free
+** Software Foundation and appearing in the file LICENSE.GPL included in
+** the packaging of this file. Please review the following information to
+** ensure the GNU General Public License version 2.0 requirements will be
+** met: http://www.gnu.org/licenses/gpl-2.0.html.
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+#include "qvulkanpipelinebuilder_p.h"
+#include <QVulkanFunctions>
+#include <QFutureInterface>
+#include <QThread>
+#include <QDebug>
+
+QT_BEGIN_NAMESPACE
+
+// Owns everything a create info points to.
+struct QVulkanPipelineDesc
+{
+    QVulkanPipelineDesc(const VkGraphicsPipelineCreateInfo &info);
+    QVulkanPipelineDesc(const VkComputePipelineCreateInfo &info);
+
+    void copyStage(const VkPipelineShaderStageCreateInfo &stage);
+    void fixupStages();
+
+    bool compute;
+    VkGraphicsPipelineCreateInfo graphicsInfo;
+    VkComputePipelineCreateInfo computeInfo;
+
+    QVector<VkPipelineShaderStageCreateInfo> stages;
+    QVector<QByteArray> entryPoints;
+    QVector<VkSpecializationInfo> specInfos;
+    QVector<QVector<VkSpecializationMapEntry> > specEntries;
+    QVector<QByteArray> specData;
+
+    VkPipelineVertexInputStateCreateInfo vertexInput;
+    QVector<VkVertexInputBindingDescription> vertexBindings;
+    QVector<VkVertexInputAttributeDescription> vertexAttributes;
+    VkPipelineInputAssemblyStateCreateInfo inputAssembly;
+    VkPipelineTessellationStateCreateInfo tessellation;
+    VkPipelineViewportStateCreateInfo viewport;
+    QVector<VkViewport> viewports;
+    QVector<VkRect2D> scissors;
+    VkPipelineRasterizationStateCreateInfo rasterization;
+    VkPipelineMultisampleStateCreateInfo multisample;
+    QVector<VkSampleMask> sampleMask;
+    VkPipelineDepthStencilStateCreateInfo depthStencil;
+    VkPipelineColorBlendStateCreateInfo colorBlend;
+    QVector<VkPipelineColorBlendAttachmentState> blendAttachments;
+    VkPipelineDynamicStateCreateInfo dynamicState;
+    QVector<VkDynamicState> dynamicStates;
+};
+
+template <typename T>
+static QVector<T> copyArray(const T *data, uint32_t count)
+{
+    QVector<T> v(count);
+    if (count)
+        memcpy(v.data(), data, count * sizeof(T));
+    return v;
+}
+
+template <typename T>
+static const T *copyState(const T *src, T *dst)
+{
+    if (!src)
+        return nullptr;
+    *dst = *src;
+    if (dst->pNext) {
+        qWarning("QVulkanPipelineBuilder: pNext chains are not supported");
+        dst->pNext = nullptr;
+    }
+    return dst;
+}
+
+void QVulkanPipelineDesc::copyStage(const VkPipelineShaderStageCreateInfo &stage)
+{
+    stages.append(stage);
+    entryPoints.append(QByteArray(stage.pName));
+    if (stage.pSpecializationInfo) {
+        const VkSpecializationInfo &spec(*stage.pSpecializationInfo);
+        specInfos.append(spec);
+        specEntries.append(copyArray(spec.pMapEntries, spec.mapEntryCount));
+        specData.append(QByteArray(static_cast<const char *>(spec.pData), int(spec.dataSize)));
+    } else {
+        specInfos.append(VkSpecializationInfo());
+        specEntries.append(QVector<VkSpecializationMapEntry>());
+        specData.append(QByteArray());
+    }
+}
+
+// Only once all stages are in, the vectors do not move anymore.
+void QVulkanPipelineDesc::fixupStages()
+{
+    for (int i = 0; i < stages.count(); ++i) {
+        VkPipelineShaderStageCreateInfo &stage(stages[i]);
+        stage.pNext = nullptr;
+        stage.pName = entryPoints[i].constData();
+        if (stage.pSpecializationInfo) {
+            specInfos[i].pMapEntries = specEntries[i].constData();
+            specInfos[i].pData = specData[i].constData();
+            stage.pSpecializationInfo = &specInfos[i];
+        }
+    }
+}
+
+QVulkanPipelineDesc::QVulkanPipelineDesc(const VkGraphicsPipelineCreateInfo &info)
+    : compute(false),
+      graphicsInfo(info)
+{
+    if (info.pNext) {
+        qWarning("QVulkanPipelineBuilder: pNext chains are not supported");
+        graphicsInfo.pNext = nullptr;
+    }
+
+    for (uint32_t i = 0; i < info.stageCount; ++i)
+        copyStage(info.pStages[i]);
+    fixupStages();
+    graphicsInfo.pStages = stages.constData();
+
+    graphicsInfo.pVertexInputState = copyState(info.pVertexInputState, &vertexInput);
+    if (info.pVertexInputState) {
+        vertexBindings = copyArray(vertexInput.pVertexBindingDescriptions, vertexInput.vertexBindingDescriptionCount);
+        vertexAttributes = copyArray(vertexInput.pVertexAttributeDescriptions, vertexInput.vertexAttributeDescriptionCount);
+        vertexInput.pVertexBindingDescriptions = vertexBindings.constData();
+        vertexInput.pVertexAttributeDescriptions = vertexAttributes.constData();
+    }
+
+    graphicsInfo.pInputAssemblyState = copyState(info.pInputAssemblyState, &inputAssembly);
+    graphicsInfo.pTessellationState = copyState(info.pTessellationState, &tessellation);
+
+    graphicsInfo.pViewportState = copyState(info.pViewportState, &viewport);
+    if (info.pViewportState) {
+        // Null with dynamic viewports and scissors.
+        if (viewport.pViewports) {
+            viewports = copyArray(viewport.pViewports, viewport.viewportCount);
+            viewport.pViewports = viewports.constData();
+        }
+        if (viewport.pScissors) {
+            scissors = copyArray(viewport.pScissors, viewport.scissorCount);
+            viewport.pScissors = scissors.constData();
+        }
+    }
+
+    graphicsInfo.pRasterizationState = copyState(info.pRasterizationState, &rasterization);
+
+    graphicsInfo.pMultisampleState = copyState(info.pMultisampleState, &multisample);
+    if (info.pMultisampleState && multisample.pSampleMask) {
+        sampleMask = copyArray(multisample.pSampleMask, (uint32_t(multisample.rasterizationSamples) + 31) / 32);
+        multisample.pSampleMask = sampleMask.constData();
+    }
+
+    graphicsInfo.pDepthStencilState = copyState(info.pDepthStencilState, &depthStencil);
+
+    graphicsInfo.pColorBlendState = copyState(info.pColorBlendState, &colorBlend);
+    if (info.pColorBlendState) {
+        blendAttachments = copyArray(colorBlend.pAttachments, colorBlend.attachmentCount);
+        colorBlend.pAttachments = blendAttachments.constData();
+    }
+
+    graphicsInfo.pDynamicState = copyState(info.pDynamicState, &dynamicState);
+    if (info.pDynamicState) {
+        dynamicStates = copyArray(dynamicState.pDynamicStates, dynamicState.dynamicStateCount);
+        dynamicState.pDynamicStates = dynamicStates.constData();
+    }
+}
+
+QVulkanPipelineDesc::QVulkanPipelineDesc(const VkComputePipelineCreateInfo &info)
+    : compute(true),
+      computeInfo(info)
+{
+    if (info.pNext) {
+        qWarning("QVulkanPipelineBuilder: pNext chains are not supported");
+        computeInfo.pNext = nullptr;
+    }
+    copyStage(info.stage);
+    fixupStages();
+    computeInfo.stage = stages[0];
+}
+
+class QVulkanPipelineBuildTask : public QRunnable
+{
+public:
+    QVulkanPipelineBuildTask(QVulkanPipelineBuilder *builder, QVulkanPipelineDesc *desc)
+        : m_builder(builder), m_desc(desc)
+    {
+        m_fi.reportStarted();
+    }
+    ~QVulkanPipelineBuildTask() { delete m_desc; }
+
+    QFuture<VkPipeline> future() { return m_fi.future(); }
+
+    void run() override
+    {
+        QVulkanFunctions *f = m_builder->f;
+        VkPipelineCache cache = m_builder->takeCache();
+        VkPipeline pipeline = VK_NULL_HANDLE;
+        VkResult err;
+        if (m_desc->compute)
+            err = f->vkCreateComputePipelines(m_builder->m_dev, cache, 1, &m_desc->computeInfo, nullptr, &pipeline);
+        else
+            err = f->vkCreateGraphicsPipelines(m_builder->m_dev, cache, 1, &m_desc->graphicsInfo, nullptr, &pipeline);
+        m_builder->returnCache(cache);
+
+        if (err != VK_SUCCESS) {
+            qWarning("Failed to create %s pipeline: %d", m_desc->compute ? "compute" : "graphics", err);
+            pipeline = VK_NULL_HANDLE;
+        } else {
+            m_builder->m_unmerged.ref();
+        }
+
+        m_fi.reportResult(pipeline);
+        m_fi.reportFinished();
+    }
+
+private:
+    QVulkanPipelineBuilder *m_builder;
+    QVulkanPipelineDesc *m_desc;
+    QFutureInterface<VkPipeline> m_fi;
+};
+
+QVulkanPipelineBuilder::QVulkanPipelineBuilder(QVulkanFunctions *f, VkDevice dev, const QByteArray &initialCacheData)
+    : f(f),
+      m_dev(dev),
+      m_initialCacheData(initialCacheData)
+{
+    // Leave a core for the render thread.
+    m_pool.setMaxThreadCount(qMax(1, QThread::idealThreadCount() - 1));
+}
+
+QVulkanPipelineBuilder::~QVulkanPipelineBuilder()
+{
+    m_pool.waitForDone();
+    for (VkPipelineCache cache : qAsConst(m_caches))
+        f->vkDestroyPipelineCache(m_dev, cache, nullptr);
+}
+
+QFuture<VkPipeline> QVulkanPipelineBuilder::buildGraphicsPipeline(const VkGraphicsPipelineCreateInfo &info)
+{
+    QVulkanPipelineBuildTask *task = new QVulkanPipelineBuildTask(this, new QVulkanPipelineDesc(info));
+    QFuture<VkPipeline> future = task->future();
+    m_pool.start(task);
+    return future;
+}
+
+QFuture<VkPipeline> QVulkanPipelineBuilder::buildComputePipeline(const VkComputePipelineCreateInfo &info)
+{
+    QVulkanPipelineBuildTask *task = new QVulkanPipelineBuildTask(this, new QVulkanPipelineDesc(info));
+    QFuture<VkPipeline> future = task->future();
+    m_pool.start(task);
+    return future;
+}
+
+void QVulkanPipelineBuilder::waitForDone()
+{
+    m_pool.waitForDone();
+}
+
+VkPipelineCache QVulkanPipelineBuilder::takeCache()
+{
+    QMutexLocker lock(&m_mutex);
+    if (!m_freeCaches.isEmpty()) {
+        VkPipelineCache cache = m_freeCaches.last();
+        m_freeCaches.removeLast();
+        return cache;
+    }
+    lock.unlock();
+
+    VkPipelineCacheCreateInfo cacheInfo;
+    memset(&cacheInfo, 0, sizeof(cacheInfo));
+    cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    cacheInfo.initialDataSize = m_initialCacheData.size();
+    cacheInfo.pInitialData = m_initialCacheData.constData();
+    VkPipelineCache cache = VK_NULL_HANDLE;
+    VkResult err = f->vkCreatePipelineCache(m_dev, &cacheInfo, nullptr, &cache);
+    if (err != VK_SUCCESS) {
+        qWarning("Failed to create pipeline cache for the builder: %d", err);
+        return VK_NULL_HANDLE;
+    }
+
+    lock.relock();
+    m_caches.append(cache);
+    return cache;
+}
+
+void QVulkanPipelineBuilder::returnCache(VkPipelineCache cache)
+{
+    if (cache == VK_NULL_HANDLE)
+        return;
+    QMutexLocker lock(&m_mutex);
+    m_freeCaches.append(cache);
+}
+
+// dst must not be in use on other threads. Returns false when there was
+// nothing new to merge.
+bool QVulkanPipelineBuilder::mergeInto(VkPipelineCache dst)
+{
+    if (!m_unmerged.fetchAndStoreAcquire(0))
+        return false;
+
+    QMutexLocker lock(&m_mutex);
+    VkResult err = f->vkMergePipelineCaches(m_dev, dst, m_caches.count(), m_caches.constData());
+    if (err != VK_SUCCESS) {
+        qWarning("Failed to merge pipeline caches: %d", err);
+        return false;
+    }
+    return true;
+}
+
+QT_END_NAMESPACE
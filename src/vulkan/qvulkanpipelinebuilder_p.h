@@ -0,0 +1,97 @@
+/****************************************************************************
+**
+** Copyright (C) 2016 The Qt Company Ltd.
+** Contact: http://www.qt.io/licensing/
+**
+** This file is part of the QtVulkan module
+**
+** $QT_BEGIN_LICENSE:LGPL3$
+** Commercial License Usage
+** Licensees holding valid commercial Qt licenses may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement between you and The Qt Company. For licensing terms
+** and conditions see http://www.qt.io/terms-conditions. For further
+** information use the contact form at http://www.qt.io/contact-us.
+**
+** GNU Lesser General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU Lesser
+** General Public License version 3 as published by the Free Software
+** Foundation and appearing in the file LICENSE.LGPLv3 included in the
+** packaging of this file. Please review the following information to
+** ensure the GNU Lesser General Public License version 3 requirements
+** will be met: https://www.gnu.org/licenses/lgpl.html.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 2.0 or later as published by the Free
+** Software Foundation and appearing in the file LICENSE.GPL included in
+** the packaging of this file. Please review the following information to
+** ensure the GNU General Public License version 2.0 requirements will be
+** met: http://www.gnu.org/licenses/gpl-2.0.html.
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+#ifndef QVULKANPIPELINEBUILDER_P_H
+#define QVULKANPIPELINEBUILDER_P_H
+
+#include "qvulkanrenderloop.h"
+#include <QMutex>
+#include <QVector>
+#include <QThreadPool>
+#include <QAtomicInt>
+#include <QFuture>
+
+//
+//  W A R N I N G
+//  -------------
+//
+// This file is not part of the Qt API.  It exists for the convenience
+// of a number of Qt sources files.  This header file may change from
+// version to version without notice, or even be removed.
+//
+// We mean it.
+//
+
+QT_BEGIN_NAMESPACE
+
+class QVulkanFunctions;
+
+// Creates pipelines on a thread pool. Each build takes a pipeline cache of
+// its own from a free list, so builds never contend on a cache. The caches
+// start out with the data the render loop's cache was created from, and are
+// merged into a destination cache via mergeInto(). Create infos are deep
+// copied, pNext chains are not supported. Shader modules, layouts and render
+// passes must stay valid until the build has finished.
+class QVulkanPipelineBuilder
+{
+public:
+    QVulkanPipelineBuilder(QVulkanFunctions *f, VkDevice dev, const QByteArray &initialCacheData);
+    ~QVulkanPipelineBuilder();
+
+    QFuture<VkPipeline> buildGraphicsPipeline(const VkGraphicsPipelineCreateInfo &info);
+    QFuture<VkPipeline> buildComputePipeline(const VkComputePipelineCreateInfo &info);
+
+    void waitForDone();
+    bool mergeInto(VkPipelineCache dst);
+
+private:
+    friend class QVulkanPipelineBuildTask;
+    VkPipelineCache takeCache();
+    void returnCache(VkPipelineCache cache);
+
+    QVulkanFunctions *f;
+    VkDevice m_dev;
+    QByteArray m_initialCacheData;
+    QThreadPool m_pool;
+    QMutex m_mutex;
+    QVector<VkPipelineCache> m_caches;
+    QVector<VkPipelineCache> m_freeCaches;
+    QAtomicInt m_unmerged; // builds finished since the last merge
+};
+
+QT_END_NAMESPACE
+
+#endif // QVULKANPIPELINEBUILDER_P_H
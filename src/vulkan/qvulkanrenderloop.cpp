@@ -36,12 +36,28 @@
 
 #include "qvulkanrenderloop.h"
 #include "qvulkanrenderloop_p.h"
+#include "qvulkanmemoryallocator_p.h"
+#include "qvulkantracer_p.h"
+#include "qvulkanpipelinebuilder_p.h"
+#include "qvulkanshaderregistry_p.h"
+#include "qvulkanuploader_p.h"
+#include "qvulkanjobsystem_p.h"
 #include <QVulkanFunctions>
 #include <qalgorithms.h>
 #include <QVector>
 #include <QGuiApplication>
 #include <QDebug>
 #include <QElapsedTimer>
+#include <QFutureInterface>
+#include <QSemaphore>
+#include <QFile>
+#include <QSaveFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QStandardPaths>
+#include <QScreen>
+#include <atomic>
+#include <algorithm>
 
 #ifdef Q_OS_LINUX
 #include <qpa/qplatformnativeinterface.h>
@@ -67,11 +83,16 @@ QT_BEGIN_NAMESPACE
 
     With N frames in flight this needs N command buffers, semaphores and fences.
 
+    The command buffers of each frame slot come from a dedicated transient
+    command pool. They are allocated once and the whole pool is reset after the
+    slot's fence has signaled, so a steady-state frame performs no command
+    buffer allocations.
+
     *******************
 
     With a QVulkanFrameWorker set:
 
-    1. CPU wait for fence
+    1. CPU wait for fence, then the worker's prepareFrame(), then acquire
 
     2. Build command buffer A with prologue (transitions)
 
@@ -87,6 +108,24 @@ QT_BEGIN_NAMESPACE
     7. PRESENT with wait for renderDone
 
     Here the prologue and epilogue need an extra command buffer per frame-in-flight since they are submitted separately.
+
+    *******************
+
+    With a QVulkanFrameWorker set and SingleSubmit:
+
+    1. CPU wait for fence
+
+    2. Start command buffer A, let the worker's prepareFrame() record into it,
+       then acquire and add the pending depth-stencil transitions only
+
+    3. ask the worker to record into command buffer A (async, must emit queued() when done)
+       The worker's render pass is expected to handle the swapchain image's layouts.
+
+    4. Add the epilogue to command buffer A, if the image is not in PRESENT_SRC yet
+
+    5. SUBMIT command buffer A with wait for acquire; signal renderDone; signal fence
+
+    6. PRESENT with wait for renderDone
  */
 
 
@@ -101,11 +140,44 @@ QVulkanRenderLoop::QVulkanRenderLoop(QWindow *window)
 {
 }
 
+// Renders into images owned by the render loop instead of a swapchain. No
+// window or surface is involved, rendering starts with the first update().
+QVulkanRenderLoop::QVulkanRenderLoop(const QSize &offscreenSize)
+    : d(new QVulkanRenderLoopPrivate(this, offscreenSize))
+{
+}
+
 QVulkanRenderLoop::~QVulkanRenderLoop()
 {
     delete d;
 }
 
+bool QVulkanRenderLoop::isOffscreen() const
+{
+    return d->m_offscreen;
+}
+
+void QVulkanRenderLoop::setOffscreenSize(const QSize &size)
+{
+    if (!d->m_offscreen) {
+        qWarning("setOffscreenSize() is only applicable to offscreen render loops");
+        return;
+    }
+    d->setWindowSize(size);
+    if (d->m_inited)
+        d->postThreadEvent(QVulkanRenderThreadEvent::Resize);
+}
+
+// 0 means rendering as fast as the frames in flight allow.
+void QVulkanRenderLoop::setOffscreenRefreshRate(qreal hz)
+{
+    if (d->m_inited) {
+        qWarning("Cannot change offscreen refresh rate after rendering has started");
+        return;
+    }
+    d->m_offscreenFrameInterval = hz > 0 ? qint64(1000000000.0 / hz) : 0;
+}
+
 QVulkanFunctions *QVulkanRenderLoop::functions()
 {
     return d->f;
@@ -120,17 +192,137 @@ void QVulkanRenderLoop::setFlags(Flags flags)
     d->m_flags = flags;
 }
 
+QVulkanRenderLoop::Flags QVulkanRenderLoop::flags() const
+{
+    return d->m_flags;
+}
+
+// While rendering, this waits for the frames in flight to finish before the
+// next frame. Growing beyond the count rendering started with recreates the dynamic
+// buffer, so QVulkanFrameWorker::resize(), which follows, must pick up the new
+// dynamicBuffer().
 void QVulkanRenderLoop::setFramesInFlight(int frameCount)
+{
+    if (frameCount < 1 || frameCount > QVulkanRenderLoopPrivate::MAX_FRAMES_IN_FLIGHT) {
+        qWarning("Invalid frames-in-flight count");
+        return;
+    }
+    if (!d->m_inited) {
+        d->m_framesInFlight = frameCount;
+        return;
+    }
+    d->m_configMutex.lock();
+    d->m_requestedFramesInFlight = frameCount;
+    d->m_configMutex.unlock();
+    d->requestReconfigure();
+}
+
+// Overrides Unthrottled. Falls back to FIFO, which is always available, when
+// the mode is not in supportedPresentModes(). Takes effect with the next
+// swapchain, which is recreated right away when rendering. Not applicable
+// offscreen, see setOffscreenRefreshRate().
+void QVulkanRenderLoop::setPresentMode(VkPresentModeKHR mode)
+{
+    d->m_configMutex.lock();
+    d->m_requestedPresentMode = mode;
+    d->m_configMutex.unlock();
+    d->requestReconfigure();
+}
+
+// Overrides TrippleBuffer. The surface's limits still apply, check
+// swapChainImageCount() afterwards. 0 restores the default.
+void QVulkanRenderLoop::setSwapChainImageCount(int count)
+{
+    if (count && (count < 2 || count > QVulkanRenderLoopPrivate::MAX_SWAPCHAIN_BUFFERS)) {
+        qWarning("Invalid swapchain image count");
+        return;
+    }
+    d->m_configMutex.lock();
+    d->m_requestedBufferCount = count;
+    d->m_configMutex.unlock();
+    d->requestReconfigure();
+}
+
+void QVulkanRenderLoop::setResizeDebounce(int msecs)
 {
     if (d->m_inited) {
-        qWarning("Cannot change number of frames in flight after rendering has started");
+        qWarning("Cannot change resize debounce after rendering has started");
         return;
     }
-    if (frameCount < 1 || frameCount > QVulkanRenderLoopPrivate::MAX_FRAMES_IN_FLIGHT) {
-        qWarning("Invalid frames-in-flight count");
+    d->m_resizeDebounce = qMax(0, msecs);
+}
+
+// Delays the start of queueFrame() so that it begins roughly nsecs before the
+// vertical blank the frame is shown at. The delay never goes below the
+// predicted frame cost plus a margin, so a tiny value means as late as
+// possible. 0 (the default) disables pacing. Can be called at any time.
+void QVulkanRenderLoop::setTargetLatency(qint64 nsecs)
+{
+    d->m_targetLatency.store(qMax<qint64>(0, nsecs));
+}
+
+void QVulkanRenderLoop::setDynamicBufferSize(VkDeviceSize perFrameSize)
+{
+    if (d->m_inited) {
+        qWarning("Cannot change dynamic buffer size after rendering has started");
+        return;
+    }
+    d->m_dynamicBufferSize = perFrameSize;
+}
+
+void QVulkanRenderLoop::setUploadStagingSize(VkDeviceSize size)
+{
+    if (d->m_inited) {
+        qWarning("Cannot change upload staging size after rendering has started");
         return;
     }
-    d->m_framesInFlight = frameCount;
+    d->m_uploadStagingSize = size;
+}
+
+void QVulkanRenderLoop::setReadbackDepth(int depth)
+{
+    if (d->m_inited) {
+        qWarning("Cannot change readback depth after rendering has started");
+        return;
+    }
+    if (depth < 1 || depth > QVulkanRenderLoopPrivate::MAX_READBACKS) {
+        qWarning("Invalid readback depth");
+        return;
+    }
+    d->m_readbackDepth = depth;
+}
+
+// By default rows follow each other without padding. Otherwise they are
+// aligned to optimalBufferCopyRowPitchAlignment, which may copy faster.
+void QVulkanRenderLoop::setTightReadbackPacking(bool enable)
+{
+    if (d->m_inited) {
+        qWarning("Cannot change readback packing after rendering has started");
+        return;
+    }
+    d->m_readbackTight = enable;
+}
+
+// Defaults to a file in QStandardPaths::CacheLocation. An empty name keeps
+// the cache in memory only.
+void QVulkanRenderLoop::setPipelineCacheFile(const QString &fileName)
+{
+    if (d->m_inited) {
+        qWarning("Cannot change pipeline cache file after rendering has started");
+        return;
+    }
+    d->m_pipelineCacheFile = fileName;
+    d->m_pipelineCacheFileSet = true;
+}
+
+// 0 saves only on cleanup and when requested via savePipelineCache().
+void QVulkanRenderLoop::setPipelineCacheSaveInterval(int msecs)
+{
+    if (d->m_inited) {
+        qWarning("Cannot change pipeline cache save interval after rendering has started");
+        return;
+    }
+    d->m_pipelineCacheSaveInterval = qMax(0, msecs);
 }
 
 void QVulkanRenderLoop::setWorker(QVulkanFrameWorker *worker)
@@ -146,13 +338,16 @@ void QVulkanRenderLoop::setWorker(QVulkanFrameWorker *worker)
 
 void QVulkanRenderLoop::update()
 {
-    if (!d->m_inited)
+    if (!d->m_inited) {
+        if (d->m_offscreen && !d->m_thread)
+            d->startOffscreen();
         return;
+    }
 
     if (QThread::currentThread() == d->m_thread)
         d->m_thread->setUpdatePending();
     else
-        d->postThreadEvent(new QVulkanRenderThreadUpdateEvent);
+        d->postThreadEvent(QVulkanRenderThreadEvent::Update);
 }
 
 void QVulkanRenderLoop::frameQueued()
@@ -160,10 +355,87 @@ void QVulkanRenderLoop::frameQueued()
     if (!d->m_inited)
         return;
 
+    QVulkanTracer::instant("frameQueued");
+
     if (QThread::currentThread() == d->m_thread)
         d->endFrame();
     else
-        d->postThreadEvent(new QVulkanRenderThreadFrameQueuedEvent);
+        d->postThreadEvent(QVulkanRenderThreadEvent::FrameQueued);
+}
+
+// Adds a job to the current frame, from queueFrame() or from another job of
+// the frame. It runs on one of the job threads once the jobs listed in
+// dependencies have finished; with a threadIndex it always runs on that
+// thread, so that it can use threadCommandPool(threadIndex), for instance.
+// When queueFrame() has added jobs, frameQueued() is called automatically
+// once all of them, including those they added, have finished. The worker
+// must not call it then.
+QVulkanJob QVulkanRenderLoop::addFrameJob(const QVulkanJobFunction &func,
+                                          const QVector<QVulkanJob> &dependencies,
+                                          int threadIndex)
+{
+    return d->m_jobSystem->addJob(func, dependencies, threadIndex);
+}
+
+int QVulkanRenderLoop::jobThreadCount() const
+{
+    return d->m_jobSystem->threadCount();
+}
+
+// The release*Later() functions can be called on any thread while the render
+// loop is initialized. The object is released once all frames that may
+// reference it (the current one, if any, included) have finished executing.
+
+void QVulkanRenderLoop::releaseBufferLater(VkBuffer buffer)
+{
+    QVulkanRenderLoopPrivate::DeferredRelease r(QVulkanRenderLoopPrivate::DeferredRelease::Buffer);
+    r.buffer = buffer;
+    d->releaseLater(r);
+}
+
+void QVulkanRenderLoop::releaseImageLater(VkImage image)
+{
+    QVulkanRenderLoopPrivate::DeferredRelease r(QVulkanRenderLoopPrivate::DeferredRelease::Image);
+    r.image = image;
+    d->releaseLater(r);
+}
+
+void QVulkanRenderLoop::releaseImageViewLater(VkImageView view)
+{
+    QVulkanRenderLoopPrivate::DeferredRelease r(QVulkanRenderLoopPrivate::DeferredRelease::ImageView);
+    r.imageView = view;
+    d->releaseLater(r);
+}
+
+void QVulkanRenderLoop::releaseMemoryLater(VkDeviceMemory memory)
+{
+    QVulkanRenderLoopPrivate::DeferredRelease r(QVulkanRenderLoopPrivate::DeferredRelease::Memory);
+    r.memory = memory;
+    d->releaseLater(r);
+}
+
+void QVulkanRenderLoop::releaseFramebufferLater(VkFramebuffer framebuffer)
+{
+    QVulkanRenderLoopPrivate::DeferredRelease r(QVulkanRenderLoopPrivate::DeferredRelease::Framebuffer);
+    r.framebuffer = framebuffer;
+    d->releaseLater(r);
+}
+
+void QVulkanRenderLoop::releaseCommandBufferLater(VkCommandPool pool, VkCommandBuffer cb)
+{
+    QVulkanRenderLoopPrivate::DeferredRelease r(QVulkanRenderLoopPrivate::DeferredRelease::CommandBuffer);
+    r.commandBuffer.pool = pool;
+    r.commandBuffer.cb = cb;
+    d->releaseLater(r);
+}
+
+// The pool must have been created with VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT.
+void QVulkanRenderLoop::releaseDescriptorSetLater(VkDescriptorPool pool, VkDescriptorSet set)
+{
+    QVulkanRenderLoopPrivate::DeferredRelease r(QVulkanRenderLoopPrivate::DeferredRelease::DescriptorSet);
+    r.descriptorSet.pool = pool;
+    r.descriptorSet.set = set;
+    d->releaseLater(r);
 }
 
 VkInstance QVulkanRenderLoop::instance() const
@@ -186,6 +458,213 @@ uint32_t QVulkanRenderLoop::hostVisibleMemoryIndex() const
     return d->m_hostVisibleMemIndex;
 }
 
+// Sub-allocates from a larger VkDeviceMemory block of the first memory type
+// that has the required and, if possible, the preferred property flags.
+// Buffers are linear, pass the tiling for images. Returns an allocation with
+// a null memory on failure. Can be called on any thread.
+QVulkanMemoryAllocation QVulkanRenderLoop::allocateMemory(const VkMemoryRequirements &req,
+                                                          VkMemoryPropertyFlags required,
+                                                          VkMemoryPropertyFlags preferred,
+                                                          VkImageTiling tiling)
+{
+    if (!d->m_memAllocator) {
+        qWarning("QVulkanRenderLoop: allocateMemory() called without a device");
+        QVulkanMemoryAllocation alloc;
+        memset(&alloc, 0, sizeof(alloc));
+        return alloc;
+    }
+    return d->m_memAllocator->allocate(req, required, preferred, tiling);
+}
+
+void QVulkanRenderLoop::freeMemory(const QVulkanMemoryAllocation &alloc)
+{
+    if (d->m_memAllocator)
+        d->m_memAllocator->free(alloc);
+}
+
+void QVulkanRenderLoop::releaseMemoryLater(const QVulkanMemoryAllocation &alloc)
+{
+    QVulkanRenderLoopPrivate::DeferredRelease r(QVulkanRenderLoopPrivate::DeferredRelease::Allocation);
+    r.allocation = alloc;
+    d->releaseLater(r);
+}
+
+VkBuffer QVulkanRenderLoop::dynamicBuffer() const
+{
+    return d->m_dynamicBuf;
+}
+
+// Returns a range of the render loop's persistently mapped, host visible
+// buffer that is valid for the current frame only. The offset is aligned to
+// minUniformBufferOffsetAlignment at least, so it can be used as a dynamic
+// offset directly. Can be called on any thread while the frame is being
+// prepared. Call flushDynamicData() before submitting command buffers that
+// read the data.
+QVulkanDynamicAllocation QVulkanRenderLoop::allocateDynamic(VkDeviceSize size, VkDeviceSize alignment)
+{
+    QVulkanDynamicAllocation a;
+    VkDeviceSize offset;
+    if (!d->allocateDynamic(size, alignment, &offset)) {
+        qWarning("QVulkanRenderLoop: Out of dynamic buffer space (%llu bytes per frame)",
+                 (unsigned long long) d->m_dynamicFrameSize);
+        a.buffer = VK_NULL_HANDLE;
+        a.offset = 0;
+        a.data = nullptr;
+        return a;
+    }
+    a.buffer = d->m_dynamicBuf;
+    a.offset = offset;
+    a.data = static_cast<quint8 *>(d->m_dynamicAlloc.mapped) + offset;
+    return a;
+}
+
+void QVulkanRenderLoop::flushDynamicData()
+{
+    d->flushDynamicData();
+}
+
+// Copies the timings of up to maxCount most recent frames, newest first, and
+// returns the number of entries copied. Can be called on any thread.
+int QVulkanRenderLoop::frameTimings(QVulkanFrameTimings *timings, int maxCount) const
+{
+    return d->m_frameTimingsRing.read(timings, maxCount);
+}
+
+// Copies the image of the next frame to end (the current one when called from
+// queueFrame()) into a host visible buffer. The callback is invoked on a
+// separate thread once the GPU has finished the frame. When all readback
+// buffers are still in use, a later frame is copied instead; check
+// frameNumber. Can be called from any thread.
+void QVulkanRenderLoop::readbackFrame(const QVulkanReadbackCallback &callback)
+{
+    QMutexLocker lock(&d->m_readbackMutex);
+    d->m_readbackRequests.append(callback);
+}
+
+// Returns the given percentile (0-100) of each field over the recorded
+// frames. frameNumber is the number of the newest frame.
+QVulkanFrameTimings QVulkanRenderLoop::frameTimingsPercentile(int percentile) const
+{
+    QVulkanFrameTimings result;
+    memset(&result, 0, sizeof(result));
+
+    QVulkanFrameTimings frames[QVulkanFrameTimingsRing::SIZE];
+    const int count = d->m_frameTimingsRing.read(frames, QVulkanFrameTimingsRing::SIZE);
+    if (!count)
+        return result;
+
+    result.frameNumber = frames[0].frameNumber;
+
+    static qint64 QVulkanFrameTimings::*const fields[] = {
+        &QVulkanFrameTimings::beginFrameTime,
+        &QVulkanFrameTimings::fenceWaitTime,
+        &QVulkanFrameTimings::prepareFrameTime,
+        &QVulkanFrameTimings::acquireTime,
+        &QVulkanFrameTimings::pacingTime,
+        &QVulkanFrameTimings::queueFrameTime,
+        &QVulkanFrameTimings::frameQueuedWaitTime,
+        &QVulkanFrameTimings::presentTime,
+        &QVulkanFrameTimings::frameInterval,
+        &QVulkanFrameTimings::gpuFrameTime
+    };
+    const int n = qBound(0, (percentile * (count - 1) + 50) / 100, count - 1);
+    qint64 values[QVulkanFrameTimingsRing::SIZE];
+    for (qint64 QVulkanFrameTimings::*field : fields) {
+        for (int i = 0; i < count; ++i)
+            values[i] = frames[i].*field;
+        std::nth_element(values, values + n, values + count);
+        result.*field = values[n];
+    }
+
+    return result;
+}
+
+// Writes a timestamp into cb and starts a named range. Returns the range to
+// pass to endGpuRange(), or -1. Ranges can nest, and can be recorded on any
+// thread building command buffers for the current frame, but must be ended in
+// the same frame. Only does something with GpuTimestamps. The name must stay
+// valid until the frame has finished on the GPU.
+int QVulkanRenderLoop::beginGpuRange(VkCommandBuffer cb, const char *name)
+{
+    if (!d->m_gpuTimestamps)
+        return -1;
+
+    const int frame = d->m_currentFrame;
+    const int range = d->m_gpuRangeCount[frame].fetchAndAddRelaxed(1);
+    if (range >= QVulkanRenderLoopPrivate::MAX_GPU_RANGES) {
+        if (range == QVulkanRenderLoopPrivate::MAX_GPU_RANGES)
+            qWarning("Too many GPU ranges in one frame, max is %d", QVulkanRenderLoopPrivate::MAX_GPU_RANGES);
+        return -1;
+    }
+    d->m_gpuRangeNames[frame][range] = name;
+    d->f->vkCmdWriteTimestamp(cb, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, d->m_queryPool[frame], 2 + 2 * range);
+    return range;
+}
+
+void QVulkanRenderLoop::endGpuRange(VkCommandBuffer cb, int range)
+{
+    if (!d->m_gpuTimestamps || range < 0)
+        return;
+
+    d->f->vkCmdWriteTimestamp(cb, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, d->m_queryPool[d->m_currentFrame], 3 + 2 * range);
+}
+
+// Returns the name and duration, in nanoseconds, of each range of the newest
+// frame the GPU has finished. Can be called on any thread.
+QVector<QPair<QByteArray, qint64> > QVulkanRenderLoop::gpuRangeTimes() const
+{
+    QMutexLocker lock(&d->m_gpuTimingsMutex);
+    return d->m_gpuRangeTimes;
+}
+
+QVulkanImageState QVulkanRenderLoop::imageState(TrackedImage image) const
+{
+    return d->trackedImage(image)->state;
+}
+
+// Reports a state change done by the worker, like a render pass final layout.
+// With SingleSubmit there is no semaphore between the frames, so such a render
+// pass needs an external dependency into subpass 0 that covers the previous
+// frame's use of the images (including the depth writes), and one from its
+// last subpass out to VK_SUBPASS_EXTERNAL at the reported stage, so that the
+// final layout transition is ordered before the render loop's next barrier.
+void QVulkanRenderLoop::setImageState(TrackedImage image, const QVulkanImageState &state)
+{
+    QVulkanImageBarrierBatch::setState(d->trackedImage(image), state);
+}
+
+// Queues a transition for the image, the barrier is recorded by
+// recordImageTransitions(), batched with the other queued transitions.
+void QVulkanRenderLoop::transitionImage(TrackedImage image, const QVulkanImageState &state)
+{
+    d->m_imageBarriers.transition(d->trackedImage(image), state);
+}
+
+void QVulkanRenderLoop::recordImageTransitions(VkCommandBuffer cb)
+{
+    d->m_imageBarriers.record(d->f, cb);
+}
+
+QVulkanMemoryStats QVulkanRenderLoop::memoryStats() const
+{
+    if (!d->m_memAllocator) {
+        QVulkanMemoryStats s;
+        memset(&s, 0, sizeof(s));
+        return s;
+    }
+    return d->m_memAllocator->stats();
+}
+
+QVulkanShaderStats QVulkanRenderLoop::shaderStats() const
+{
+    return d->m_shaderRegistry->stats();
+}
+
+bool QVulkanRenderLoop::writeTrace(const QString &fileName)
+{
+    return QVulkanTracer::dump(fileName);
+}
+
 VkDevice QVulkanRenderLoop::device() const
 {
     return d->m_vkDev;
@@ -196,174 +675,555 @@ VkCommandPool QVulkanRenderLoop::commandPool() const
     return d->m_vkCmdPool;
 }
 
-int QVulkanRenderLoop::swapChainImageCount() const
+// A graphics family pool of the current frame slot, for recording on a thread
+// other than the render thread. Each index must be used by one thread at a
+// time. The pool is reset, together with the command buffers allocated from
+// it, when the slot is reused, so these only need to be allocated once.
+VkCommandPool QVulkanRenderLoop::threadCommandPool(int index)
 {
-    return d->m_swapChainBufferCount;
+    QMutexLocker lock(&d->m_threadCmdPoolMutex);
+    return d->threadCmdPool(&d->m_threadCmdPools[d->m_currentFrame], index)->pool;
 }
 
-int QVulkanRenderLoop::currentSwapChainImageIndex() const
+// Records count secondary command buffers in parallel, calling recorder with
+// each and its index, and executes them in primary, in index order. The
+// render pass must have been begun with
+// VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS and inheritance must describe
+// it. Returns when everything is recorded. The calling thread records index 0.
+void QVulkanRenderLoop::recordParallel(VkCommandBuffer primary, const VkCommandBufferInheritanceInfo &inheritance,
+                                       int count, const QVulkanSecondaryRecorder &recorder)
 {
-    return d->m_currentSwapChainBuffer;
+    d->recordParallel(primary, inheritance, count, recorder);
 }
 
-VkImage QVulkanRenderLoop::swapChainImage(int idx) const
+// A compute queue is dedicated when it comes from a family without graphics,
+// a transfer queue when from a family with neither graphics nor compute.
+// Otherwise queue() and friends return the graphics queue's values.
+bool QVulkanRenderLoop::hasDedicatedQueue(QueueType type) const
 {
-    return d->m_swapChainImages[idx];
+    return d->m_queues[type].dedicated;
 }
 
-VkImageView QVulkanRenderLoop::swapChainImageView(int idx) const
+// Submitting to the compute and transfer queues needs external
+// synchronization just like any VkQueue. The render loop submits only to the
+// graphics queue, from the render thread. Uploads use a queue of their own.
+// When the transfer family has just one queue, they go through the graphics
+// queue, also submitted from the render thread.
+VkQueue QVulkanRenderLoop::queue(QueueType type) const
 {
-    return d->m_swapChainImageViews[idx];
+    return d->m_queues[type].queue;
 }
 
-VkFormat QVulkanRenderLoop::swapChainFormat() const
+// Resources shared with the graphics queue need a queue family ownership
+// transfer when this differs from queueFamilyIndex(GraphicsQueue), unless
+// they use VK_SHARING_MODE_CONCURRENT.
+uint32_t QVulkanRenderLoop::queueFamilyIndex(QueueType type) const
 {
-    return d->m_colorFormat;
+    return d->m_queues[type].familyIndex;
 }
 
-VkImage QVulkanRenderLoop::depthStencilImage() const
+// Like commandPool(), not to be used from multiple threads at once.
+VkCommandPool QVulkanRenderLoop::queueCommandPool(QueueType type) const
 {
-    return d->m_ds;
+    return d->m_queues[type].cmdPool;
 }
 
-VkImageView QVulkanRenderLoop::depthStencilImageView() const
+// Makes the submission that ends the current frame, the one signalling its
+// fence, also wait for sem. With SingleSubmit this is the submission carrying
+// the worker's commands. Otherwise the worker's own submissions come earlier
+// and have to wait themselves. Call before frameQueued(), from any thread.
+void QVulkanRenderLoop::waitSemaphoreInFrame(VkSemaphore sem, VkPipelineStageFlags stage)
 {
-    return d->m_dsView;
+    QMutexLocker lock(&d->m_frameSemMutex);
+    d->m_frameWaitSems.append(sem);
+    d->m_frameWaitStages.append(stage);
 }
 
-VkFormat QVulkanRenderLoop::depthStencilFormat() const
+// Makes the same submission signal sem, for example to have a compute queue
+// wait for the frame's rendering.
+void QVulkanRenderLoop::signalSemaphoreInFrame(VkSemaphore sem)
 {
-    return d->m_dsFormat;
+    QMutexLocker lock(&d->m_frameSemMutex);
+    d->m_frameSignalSems.append(sem);
 }
 
-QVulkanRenderLoopPrivate::QVulkanRenderLoopPrivate(QVulkanRenderLoop *q_ptr, QWindow *window)
-    : q(q_ptr),
-      f(QVulkanFunctions::instance())
+// The render loop merges the builder's caches into this one at the end of
+// frames, which requires external synchronization. So it may only be used in
+// the QVulkanFrameWorker functions, in frame jobs, and on threads working on
+// the current frame before frameQueued() is called. Other threads should use
+// buildGraphicsPipeline() or buildComputePipeline().
+VkPipelineCache QVulkanRenderLoop::pipelineCache() const
 {
-    window->installEventFilter(this);
+    return d->m_pipelineCache;
 }
 
-QVulkanRenderLoopPrivate::~QVulkanRenderLoopPrivate()
+// The returned module is owned by the render loop and stays valid until the
+// device is released, i.e. it can be used in QVulkanFrameWorker::init()
+// without destroying it in cleanup(). The same file, or the same SPIR-V in
+// another file, gives the same module. Thread-safe.
+VkShaderModule QVulkanRenderLoop::shaderModule(const QString &fileName)
 {
-    if (m_thread) {
-        postThreadEvent(new QVulkanRenderThreadDestroyEvent);
-        m_thread->wait();
-        delete m_thread;
-    }
+    return d->m_shaderRegistry->shaderModule(fileName);
 }
 
-bool QVulkanRenderLoopPrivate::eventFilter(QObject *watched, QEvent *event)
+// Saves at the end of the next frame, writing the file in the background.
+void QVulkanRenderLoop::savePipelineCache()
 {
-    QWindow *window = static_cast<QWindow *>(watched);
-    if (event->type() == QEvent::Expose) {
-        if (window->isExposed()) {
-            if (!m_thread) {
-                m_thread = new QVulkanRenderThread(this);
-                m_thread->setActive();
-                m_thread->start();
-            }
-            m_thread->mutex()->lock();
-            m_winId = window->winId();
-#ifdef Q_OS_LINUX
-            m_xcbConnection = static_cast<xcb_connection_t *>(qGuiApp->platformNativeInterface()->nativeResourceForIntegration(QByteArrayLiteral("connection")));
-            m_xcbVisualId = QXcbWindowFunctions::visualId(window);
-#endif
-            m_windowSize = window->size();
-            postThreadEvent(new QVulkanRenderThreadExposeEvent, false);
-        } else if (m_inited) {
-            postThreadEvent(new QVulkanRenderThreadObscureEvent);
-        }
-    } else if (event->type() == QEvent::Resize) {
-        if (m_inited && window->isExposed()) {
-            m_thread->mutex()->lock();
-            m_windowSize = window->size();
-            postThreadEvent(new QVulkanRenderThreadResizeEvent, false);
-        }
-    }
-
-    return false;
+    d->m_pipelineCacheSaveRequested.store(1);
 }
 
-void QVulkanRenderLoopPrivate::postThreadEvent(QEvent *e, bool lock)
+static QFuture<VkPipeline> failedPipelineFuture()
 {
-    if (lock)
-        m_thread->mutex()->lock();
-    m_thread->postEvent(e);
-    m_thread->waitCondition()->wait(m_thread->mutex());
-    m_thread->mutex()->unlock();
+    QFutureInterface<VkPipeline> fi;
+    fi.reportStarted();
+    fi.reportResult(VkPipeline(VK_NULL_HANDLE));
+    fi.reportFinished();
+    return fi.future();
 }
 
-void QVulkanRenderThreadEventQueue::addEvent(QEvent *e)
+// Builds on a thread pool, merging into pipelineCache() afterwards. Valid
+// between QVulkanFrameWorker::init() and cleanup(). The future's result is
+// VK_NULL_HANDLE on failure. Everything the create info references (shader
+// modules, layout, render pass) must stay alive until the future finishes;
+// the structs themselves are copied.
+QFuture<VkPipeline> QVulkanRenderLoop::buildGraphicsPipeline(const VkGraphicsPipelineCreateInfo &info)
 {
-    m_mutex.lock();
-    enqueue(e);
-    if (m_waiting)
-        m_condition.wakeOne();
-    m_mutex.unlock();
+    if (!d->m_pipelineBuilder) {
+        qWarning("QVulkanRenderLoop: buildGraphicsPipeline() called without a device");
+        return failedPipelineFuture();
+    }
+    return d->m_pipelineBuilder->buildGraphicsPipeline(info);
 }
 
-QEvent *QVulkanRenderThreadEventQueue::takeEvent(bool wait)
+QFuture<VkPipeline> QVulkanRenderLoop::buildComputePipeline(const VkComputePipelineCreateInfo &info)
 {
-    m_mutex.lock();
-    if (isEmpty() && wait) {
-        m_waiting = true;
-        m_condition.wait(&m_mutex);
-        m_waiting = false;
+    if (!d->m_pipelineBuilder) {
+        qWarning("QVulkanRenderLoop: buildComputePipeline() called without a device");
+        return failedPipelineFuture();
     }
-    QEvent *e = dequeue();
-    m_mutex.unlock();
-    return e;
+    return d->m_pipelineBuilder->buildComputePipeline(info);
 }
 
-bool QVulkanRenderThreadEventQueue::hasMoreEvents()
+// Copies data on a background thread, on the dedicated transfer queue when
+// there is one. The destination must have TRANSFER_DST usage and EXCLUSIVE
+// sharing; images end up in finalLayout, their previous contents are
+// discarded. The token becomes ready when a frame begins that is ordered
+// after the copy, from then on the frame's commands can use the data.
+// Valid between QVulkanFrameWorker::init() and cleanup().
+QVulkanUploadToken QVulkanRenderLoop::uploadBuffer(VkBuffer dst, VkDeviceSize dstOffset, const QByteArray &data)
 {
-    m_mutex.lock();
-    bool has = !isEmpty();
-    m_mutex.unlock();
-    return has;
+    if (!d->m_uploader) {
+        qWarning("QVulkanRenderLoop: uploadBuffer() called without a device");
+        return 0;
+    }
+    return d->m_uploader->uploadBuffer(dst, dstOffset, data);
 }
 
-void QVulkanRenderThread::postEvent(QEvent *e)
+QVulkanUploadToken QVulkanRenderLoop::uploadImage(VkImage dst, VkImageLayout finalLayout,
+                                                  const VkBufferImageCopy &region, const QByteArray &data)
 {
-    m_eventQueue.addEvent(e);
+    if (!d->m_uploader) {
+        qWarning("QVulkanRenderLoop: uploadImage() called without a device");
+        return 0;
+    }
+    return d->m_uploader->uploadImage(dst, finalLayout, region, data);
 }
 
-void QVulkanRenderThread::processEvents()
+bool QVulkanRenderLoop::isUploadReady(QVulkanUploadToken token) const
 {
-    while (m_eventQueue.hasMoreEvents()) {
-        QEvent *e = m_eventQueue.takeEvent(false);
-        processEvent(e);
-        delete e;
-    }
+    return !token || (d->m_uploader && d->m_uploader->isReady(token));
 }
 
-void QVulkanRenderThread::processEventsAndWaitForMore()
+int QVulkanRenderLoop::commandBufferAllocationCount() const
 {
-    m_stopEventProcessing = false;
-    while (!m_stopEventProcessing) {
-        QEvent *e = m_eventQueue.takeEvent(true);
-        processEvent(e);
-        delete e;
-    }
+    return d->m_cmdBufAllocCount.load();
 }
 
-void QVulkanRenderThread::processEvent(QEvent *e)
+quint64 QVulkanRenderLoop::queueSubmitCount() const
 {
-    switch (int(e->type())) {
-    case QVulkanRenderThreadExposeEvent::Type:
+    return d->m_submitCount.load();
+}
+
+qint64 QVulkanRenderLoop::guiThreadStallTime() const
+{
+    return d->m_guiStallTime.load();
+}
+
+// Median time from the start of queueFrame() to the vertical blank the frame
+// was shown at, over recent frames, in nanoseconds. Only known when
+// acquiring blocks until the vertical blank (FIFO) or offscreen with a
+// refresh rate set, 0 otherwise.
+qint64 QVulkanRenderLoop::achievedLatency() const
+{
+    return d->m_achievedLatency.load();
+}
+
+// The mode of the current swapchain.
+VkPresentModeKHR QVulkanRenderLoop::presentMode() const
+{
+    QMutexLocker lock(&d->m_configMutex);
+    return d->m_presentMode;
+}
+
+// Empty until the first swapchain has been created, and offscreen.
+QVector<VkPresentModeKHR> QVulkanRenderLoop::supportedPresentModes() const
+{
+    QMutexLocker lock(&d->m_configMutex);
+    return d->m_supportedPresentModes;
+}
+
+int QVulkanRenderLoop::swapChainImageCount() const
+{
+    return d->m_swapChainBufferCount;
+}
+
+int QVulkanRenderLoop::currentSwapChainImageIndex() const
+{
+    return d->m_currentSwapChainBuffer;
+}
+
+// With SingleSubmit this is the command buffer the worker records the frame
+// into. It is in recording state and gets submitted after frameQueued().
+VkCommandBuffer QVulkanRenderLoop::currentCommandBuffer() const
+{
+    if (!d->singleSubmit())
+        return VK_NULL_HANDLE;
+    return d->m_frameCmdBuf[d->m_currentFrame][0];
+}
+
+VkImage QVulkanRenderLoop::swapChainImage(int idx) const
+{
+    return d->m_swapChainImages[idx];
+}
+
+VkImageView QVulkanRenderLoop::swapChainImageView(int idx) const
+{
+    return d->m_swapChainImageViews[idx];
+}
+
+VkFormat QVulkanRenderLoop::swapChainFormat() const
+{
+    return d->m_colorFormat;
+}
+
+VkImage QVulkanRenderLoop::depthStencilImage() const
+{
+    return d->m_ds;
+}
+
+VkImageView QVulkanRenderLoop::depthStencilImageView() const
+{
+    return d->m_dsView;
+}
+
+VkFormat QVulkanRenderLoop::depthStencilFormat() const
+{
+    return d->m_dsFormat;
+}
+
+QVulkanRenderLoopPrivate::QVulkanRenderLoopPrivate(QVulkanRenderLoop *q_ptr, QWindow *window)
+    : q(q_ptr),
+      f(QVulkanFunctions::instance()),
+      m_shaderRegistry(new QVulkanShaderRegistry(f))
+{
+    window->installEventFilter(this);
+    m_readbackPool.setMaxThreadCount(1);
+    m_pipelineCachePool.setMaxThreadCount(1);
+    m_jobSystem = new QVulkanJobSystem;
+}
+
+QVulkanRenderLoopPrivate::QVulkanRenderLoopPrivate(QVulkanRenderLoop *q_ptr, const QSize &offscreenSize)
+    : q(q_ptr),
+      f(QVulkanFunctions::instance()),
+      m_offscreen(true),
+      m_shaderRegistry(new QVulkanShaderRegistry(f))
+{
+    setWindowSize(offscreenSize);
+    m_readbackPool.setMaxThreadCount(1);
+    m_pipelineCachePool.setMaxThreadCount(1);
+    m_jobSystem = new QVulkanJobSystem;
+}
+
+// Gets the swapchain recreated before the next frame. Before init() there is
+// nothing to do, the settings are picked up anyway.
+void QVulkanRenderLoopPrivate::requestReconfigure()
+{
+    if (!m_inited)
+        return;
+
+    if (QThread::currentThread() == m_thread)
+        m_thread->setResizePending(true);
+    else
+        postThreadEvent(QVulkanRenderThreadEvent::Reconfigure);
+}
+
+// Offscreen there is no expose, pretend there was one.
+void QVulkanRenderLoopPrivate::startOffscreen()
+{
+    m_thread = new QVulkanRenderThread(this);
+    m_thread->setObjectName(QStringLiteral("QVulkanRenderThread"));
+    m_thread->setActive();
+    m_thread->start();
+    postThreadEvent(QVulkanRenderThreadEvent::Expose);
+}
+
+QVulkanRenderLoopPrivate::~QVulkanRenderLoopPrivate()
+{
+    if (m_thread) {
+        postThreadEvent(QVulkanRenderThreadEvent::Destroy);
+        m_thread->wait();
+        delete m_thread;
+    }
+
+    delete m_shaderRegistry;
+    delete m_jobSystem;
+
+    if (QVulkanTracer::isEnabled())
+        QVulkanTracer::dump(QVulkanTracer::fileName());
+}
+
+bool QVulkanRenderLoopPrivate::eventFilter(QObject *watched, QEvent *event)
+{
+    QWindow *window = static_cast<QWindow *>(watched);
+    if (event->type() == QEvent::Expose) {
+        if (window->isExposed()) {
+            if (!m_thread) {
+                m_thread = new QVulkanRenderThread(this);
+                m_thread->setObjectName(QStringLiteral("QVulkanRenderThread"));
+                m_thread->setActive();
+                m_thread->start();
+            }
+            QElapsedTimer stallTimer;
+            stallTimer.start();
+            m_thread->mutex()->lock();
+            m_winId = window->winId();
+#ifdef Q_OS_LINUX
+            m_xcbConnection = static_cast<xcb_connection_t *>(qGuiApp->platformNativeInterface()->nativeResourceForIntegration(QByteArrayLiteral("connection")));
+            m_xcbVisualId = QXcbWindowFunctions::visualId(window);
+#endif
+            setWindowSize(window->size());
+            const qreal hz = window->screen() ? window->screen()->refreshRate() : 0;
+            m_refreshInterval.store(hz > 0 ? qint64(1000000000.0 / hz) : 0);
+            postThreadEvent(QVulkanRenderThreadEvent::Expose, &stallTimer);
+        } else if (m_inited) {
+            postThreadEvent(QVulkanRenderThreadEvent::Obscure);
+        }
+    } else if (event->type() == QEvent::Resize) {
+        if (m_inited && window->isExposed()) {
+            setWindowSize(window->size());
+            postThreadEvent(QVulkanRenderThreadEvent::Resize);
+        }
+    }
+
+    return false;
+}
+
+static inline bool needsSynchronousDelivery(QVulkanRenderThreadEvent::Type type)
+{
+    // Obscure must be handled before the native window goes away and Expose
+    // before the render thread can touch the (new) native window. Destroy is
+    // followed by a wait() on the thread anyway.
+    return type == QVulkanRenderThreadEvent::Expose
+            || type == QVulkanRenderThreadEvent::Obscure
+            || type == QVulkanRenderThreadEvent::Destroy;
+}
+
+// When lockedSince is set, the caller has already locked the thread's mutex.
+void QVulkanRenderLoopPrivate::postThreadEvent(QVulkanRenderThreadEvent::Type type, QElapsedTimer *lockedSince)
+{
+    if (m_flags.testFlag(QVulkanRenderLoop::NonBlockingEvents) && !needsSynchronousDelivery(type)) {
+        if (lockedSince)
+            m_thread->mutex()->unlock();
+        m_thread->postEvent(type);
+        return;
+    }
+
+    QElapsedTimer stallTimer;
+    if (!lockedSince) {
+        stallTimer.start();
+        lockedSince = &stallTimer;
+        m_thread->mutex()->lock();
+    }
+    m_thread->sendEvent(type);
+    m_thread->mutex()->unlock();
+
+    if (QThread::currentThread() == qGuiApp->thread())
+        m_guiStallTime.fetchAndAddRelaxed(lockedSince->nsecsElapsed());
+}
+
+void QVulkanRenderLoopPrivate::setWindowSize(const QSize &size)
+{
+    m_windowSizeMutex.lock();
+    m_pendingWindowSize = size;
+    m_windowSizeMutex.unlock();
+}
+
+void QVulkanRenderLoopPrivate::updateWindowSize()
+{
+    m_windowSizeMutex.lock();
+    m_windowSize = m_pendingWindowSize;
+    m_windowSizeMutex.unlock();
+}
+
+QVulkanRenderThreadEventQueue::QVulkanRenderThreadEventQueue()
+{
+    for (uint i = 0; i < CAPACITY; ++i)
+        m_cells[i].seq.store(i);
+}
+
+bool QVulkanRenderThreadEventQueue::tryAddEvent(const QVulkanRenderThreadEvent &e)
+{
+    // A cell is free for position pos when its sequence number equals pos,
+    // and holds an event for the consumer when it equals pos + 1.
+    uint pos = m_enqueuePos.load();
+    Cell *cell;
+    for (;;) {
+        cell = &m_cells[pos & (CAPACITY - 1)];
+        const int diff = int(cell->seq.loadAcquire() - pos);
+        if (diff == 0) {
+            if (m_enqueuePos.testAndSetRelaxed(pos, pos + 1, pos))
+                break;
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = m_enqueuePos.load();
+        }
+    }
+    cell->event = e;
+    cell->seq.storeRelease(pos + 1);
+    return true;
+}
+
+bool QVulkanRenderThreadEventQueue::tryTakeEvent(QVulkanRenderThreadEvent *e)
+{
+    Cell *cell = &m_cells[m_dequeuePos & (CAPACITY - 1)];
+    if (int(cell->seq.loadAcquire() - (m_dequeuePos + 1)) < 0)
+        return false;
+    *e = cell->event;
+    cell->seq.storeRelease(m_dequeuePos + CAPACITY);
+    ++m_dequeuePos;
+    return true;
+}
+
+void QVulkanRenderThreadEventQueue::addEvent(const QVulkanRenderThreadEvent &e)
+{
+    // The queue can only fill up when the render thread is stuck in
+    // something long (device wait, swapchain recreation), so just back off.
+    while (!tryAddEvent(e))
+        QThread::yieldCurrentThread();
+
+    // Pairs with the store in takeEvent(): either the consumer sees the new
+    // event when rechecking, or we see it waiting and wake it up.
+    if (m_waiting.fetchAndAddOrdered(0)) {
         m_mutex.lock();
+        m_condition.wakeOne();
+        m_mutex.unlock();
+    }
+}
+
+// Waits at most timeout milliseconds (ULONG_MAX = forever) for an event.
+bool QVulkanRenderThreadEventQueue::takeEvent(QVulkanRenderThreadEvent *e, unsigned long timeout)
+{
+    if (tryTakeEvent(e))
+        return true;
+    if (!timeout)
+        return false;
+
+    m_mutex.lock();
+    m_waiting.fetchAndStoreOrdered(1);
+    bool ok = tryTakeEvent(e);
+    while (!ok) {
+        const bool woken = m_condition.wait(&m_mutex, timeout);
+        ok = tryTakeEvent(e);
+        if (!woken)
+            break;
+    }
+    m_waiting.fetchAndStoreOrdered(0);
+    m_mutex.unlock();
+    return ok;
+}
+
+void QVulkanRenderThread::postEvent(QVulkanRenderThreadEvent::Type type)
+{
+    // Resize and Update carry no data, so one instance in the queue is
+    // enough, no matter how many are posted before the render thread gets
+    // to them.
+    if (type == QVulkanRenderThreadEvent::Resize && m_resizePosted.fetchAndStoreOrdered(1))
+        return;
+    if (type == QVulkanRenderThreadEvent::Update && m_updatePosted.fetchAndStoreOrdered(1))
+        return;
+
+    const QVulkanRenderThreadEvent e = { type, false };
+    m_eventQueue.addEvent(e);
+}
+
+void QVulkanRenderThread::sendEvent(QVulkanRenderThreadEvent::Type type)
+{
+    // m_mutex is locked by the caller. The serial makes sure we do not get
+    // woken up by the completion of somebody else's event.
+    const uint serial = ++m_syncPosted;
+    const QVulkanRenderThreadEvent e = { type, true };
+    m_eventQueue.addEvent(e);
+    while (int(m_syncCompleted - serial) < 0)
+        m_condition.wait(&m_mutex);
+}
+
+void QVulkanRenderThread::processEvents()
+{
+    QVulkanRenderThreadEvent e;
+    while (m_eventQueue.takeEvent(&e, 0))
+        processEvent(e);
+}
+
+void QVulkanRenderThread::processEventsAndWaitForMore(unsigned long timeout)
+{
+    m_stopEventProcessing = false;
+    QVulkanRenderThreadEvent e;
+    while (!m_stopEventProcessing) {
+        if (!m_eventQueue.takeEvent(&e, timeout))
+            break;
+        processEvent(e);
+    }
+}
+
+static const char *traceEventName(QVulkanRenderThreadEvent::Type type)
+{
+    switch (type) {
+    case QVulkanRenderThreadEvent::Expose:
+        return "event: expose";
+    case QVulkanRenderThreadEvent::Obscure:
+        return "event: obscure";
+    case QVulkanRenderThreadEvent::Resize:
+        return "event: resize";
+    case QVulkanRenderThreadEvent::Update:
+        return "event: update";
+    case QVulkanRenderThreadEvent::FrameQueued:
+        return "event: frameQueued";
+    case QVulkanRenderThreadEvent::Destroy:
+        return "event: destroy";
+    case QVulkanRenderThreadEvent::Reconfigure:
+        return "event: reconfigure";
+    default:
+        return "event: unknown";
+    }
+}
+
+void QVulkanRenderThread::processEvent(const QVulkanRenderThreadEvent &e)
+{
+    QVK_TRACE_SCOPE(traceEventName(e.type));
+    m_mutex.lock();
+    switch (e.type) {
+    case QVulkanRenderThreadEvent::Expose:
         if (Q_UNLIKELY(debug_render()))
             qDebug("render thread - expose");
+        d->updateWindowSize();
         if (!d->m_inited)
             d->init();
         m_pendingUpdate = true;
         if (m_sleeping)
             m_stopEventProcessing = true;
-        m_condition.wakeOne();
-        m_mutex.unlock();
         break;
-    case QVulkanRenderThreadObscureEvent::Type:
-        m_mutex.lock();
+    case QVulkanRenderThreadEvent::Obscure:
         if (!d->m_frameActive) {
             if (Q_UNLIKELY(debug_render()))
                 qDebug("render thread - obscure");
@@ -371,39 +1231,29 @@ void QVulkanRenderThread::processEvent(QEvent *e)
         } else {
             m_pendingObscure = true;
         }
-        m_condition.wakeOne();
-        m_mutex.unlock();
         break;
-    case QVulkanRenderThreadResizeEvent::Type:
-        m_mutex.lock();
-        if (!d->m_frameActive) {
-            if (Q_UNLIKELY(debug_render()))
-                qDebug("render thread - resize");
-            resize();
-        } else {
-            m_pendingResize = true;
-        }
-        m_condition.wakeOne();
-        m_mutex.unlock();
+    case QVulkanRenderThreadEvent::Resize:
+        if (Q_UNLIKELY(debug_render()))
+            qDebug("render thread - resize");
+        if (!e.sync)
+            m_resizePosted.store(0);
+        // Only note it, the swapchain is recreated once per loop iteration,
+        // for the latest window size.
+        setResizePending(false);
         break;
-    case QVulkanRenderThreadUpdateEvent::Type:
-        m_mutex.lock();
+    case QVulkanRenderThreadEvent::Update:
+        if (!e.sync)
+            m_updatePosted.store(0);
         setUpdatePending();
-        m_condition.wakeOne();
-        m_mutex.unlock();
         break;
-    case QVulkanRenderThreadFrameQueuedEvent::Type:
-        m_mutex.lock();
+    case QVulkanRenderThreadEvent::FrameQueued:
         if (Q_UNLIKELY(debug_render()))
             qDebug("render thread - worker ready");
         d->endFrame();
         if (m_sleeping)
             m_stopEventProcessing = true;
-        m_condition.wakeOne();
-        m_mutex.unlock();
         break;
-    case QVulkanRenderThreadDestroyEvent::Type:
-        m_mutex.lock();
+    case QVulkanRenderThreadEvent::Destroy:
         if (!d->m_frameActive) {
             if (Q_UNLIKELY(debug_render()))
                 qDebug("render thread - destroy");
@@ -413,13 +1263,21 @@ void QVulkanRenderThread::processEvent(QEvent *e)
         } else {
             m_pendingDestroy = true;
         }
-        m_condition.wakeOne();
-        m_mutex.unlock();
+        break;
+    case QVulkanRenderThreadEvent::Reconfigure:
+        if (Q_UNLIKELY(debug_render()))
+            qDebug("render thread - reconfigure");
+        setResizePending(true);
         break;
     default:
-        qWarning("Unknown render thread event %d", e->type());
+        qWarning("Unknown render thread event %d", e.type);
         break;
     }
+    if (e.sync) {
+        ++m_syncCompleted;
+        m_condition.wakeAll();
+    }
+    m_mutex.unlock();
 }
 
 void QVulkanRenderThread::setUpdatePending()
@@ -429,6 +1287,26 @@ void QVulkanRenderThread::setUpdatePending()
         m_stopEventProcessing = true;
 }
 
+void QVulkanRenderThread::setResizePending(bool immediate)
+{
+    m_pendingResize = true;
+    if (immediate)
+        m_forceResize = true;
+    else
+        m_resizeTimer.start();
+    if (m_sleeping)
+        m_stopEventProcessing = true;
+}
+
+// Returns the time in milliseconds until a pending resize is to be
+// performed, 0 when it is due.
+int QVulkanRenderThread::resizeDelay() const
+{
+    if (m_forceResize || !d->m_resizeDebounce)
+        return 0;
+    return qMax<qint64>(0, d->m_resizeDebounce - m_resizeTimer.elapsed());
+}
+
 void QVulkanRenderThread::obscure()
 {
     if (!d->m_inited)
@@ -437,6 +1315,7 @@ void QVulkanRenderThread::obscure()
     if (!d->m_flags.testFlag(QVulkanRenderLoop::DontReleaseOnObscure)) {
         d->f->vkDeviceWaitIdle(d->m_vkDev);
         d->cleanup();
+        m_pendingResize = false;
     }
 
     m_pendingUpdate = false;
@@ -447,7 +1326,8 @@ void QVulkanRenderThread::resize()
     if (!d->m_inited)
         return;
 
-    d->f->vkDeviceWaitIdle(d->m_vkDev);
+    d->updateWindowSize();
+    d->applyFramesInFlight();
     d->recreateSwapChain();
 
     if (d->m_worker)
@@ -464,6 +1344,7 @@ void QVulkanRenderThread::run()
     m_pendingUpdate = false;
     m_pendingObscure = false;
     m_pendingResize = false;
+    m_forceResize = false;
     m_pendingDestroy = false;
 
     while (m_active) {
@@ -480,14 +1361,18 @@ void QVulkanRenderThread::run()
                 qDebug("render thread - processing pending obscure");
             obscure();
         }
-        if (m_pendingResize && !d->m_frameActive) {
+        if (m_pendingResize && !d->m_frameActive && !resizeDelay()) {
             m_pendingResize = false;
+            m_forceResize = false;
             m_pendingUpdate = true;
             if (Q_UNLIKELY(debug_render()))
                 qDebug("render thread - processing pending resize");
             resize();
         }
-        if (m_pendingUpdate && !d->m_frameActive) {
+        // While a resize is being debounced, either keep presenting with the
+        // old swapchain or hold back rendering until it is recreated.
+        const bool canRender = !m_pendingResize || d->m_flags.testFlag(QVulkanRenderLoop::StretchOnResize);
+        if (m_pendingUpdate && !d->m_frameActive && canRender) {
             m_pendingUpdate = false;
             if (d->beginFrame())
                 d->renderFrame();
@@ -496,16 +1381,24 @@ void QVulkanRenderThread::run()
         processEvents();
         QCoreApplication::processEvents();
 
-        if (!m_pendingUpdate
+        const bool resizeDue = m_pendingResize && !d->m_frameActive && !resizeDelay();
+        const bool updateDue = m_pendingUpdate && (!m_pendingResize || d->m_flags.testFlag(QVulkanRenderLoop::StretchOnResize));
+        if (!updateDue
                 && !m_pendingDestroy
                 && !(m_pendingObscure && !d->m_frameActive)
-                && !(m_pendingResize && !d->m_frameActive)) {
+                && !resizeDue) {
             m_sleeping = true;
-            processEventsAndWaitForMore();
+            processEventsAndWaitForMore(m_pendingResize && !d->m_frameActive ? resizeDelay() : ULONG_MAX);
             m_sleeping = false;
         }
     }
 
+    // Offscreen nothing ever gets obscured, release everything on the way out.
+    if (d->m_offscreen && d->m_inited) {
+        d->f->vkDeviceWaitIdle(d->m_vkDev);
+        d->cleanup();
+    }
+
     if (Q_UNLIKELY(debug_render()))
         qDebug("render thread - exit");
 }
@@ -518,6 +1411,13 @@ void QVulkanRenderLoopPrivate::init()
     createDeviceAndSurface();
     recreateSwapChain();
 
+    if (!m_frameClock.isValid())
+        m_frameClock.start();
+    m_lastFrameStart = -1;
+    m_lastVBlank = -1;
+    m_frameCostCount = 0;
+    m_latencyCount = 0;
+
     m_inited = true;
     if (Q_UNLIKELY(debug_render()))
         qDebug("VK window renderer initialized");
@@ -533,6 +1433,18 @@ void QVulkanRenderLoopPrivate::cleanup()
     if (!m_inited)
         return;
 
+    // The device is idle here. Release everything queued by the worker
+    // while its pools and such are still around.
+    drainDeferredReleases();
+
+    // Builds still running may reference the worker's shader modules, and
+    // uploads its buffers and images.
+    if (m_pipelineBuilder)
+        m_pipelineBuilder->waitForDone();
+    if (m_uploader)
+        m_uploader->cancel();
+    m_jobSystem->waitForDone();
+
     if (m_worker)
         m_worker->cleanup();
 
@@ -562,44 +1474,695 @@ static VKAPI_ATTR VkBool32 VKAPI_CALL debugCallbackFunc(VkDebugReportFlagsEXT fl
     return VK_FALSE;
 }
 
-void QVulkanRenderLoopPrivate::transitionImage(VkCommandBuffer cmdBuf,
-                                               VkImage image,
-                                               VkImageLayout oldLayout, VkImageLayout newLayout,
-                                               VkAccessFlags srcAccessMask, VkAccessFlags dstAccessMask,
-                                               bool ds)
+static inline VkDeviceSize aligned(VkDeviceSize v, VkDeviceSize byteAlign)
 {
-    VkImageMemoryBarrier barrier;
-    memset(&barrier, 0, sizeof(barrier));
-    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-    barrier.srcAccessMask = srcAccessMask;
-    barrier.dstAccessMask = dstAccessMask;
-    barrier.oldLayout = oldLayout;
-    barrier.newLayout = newLayout;
-    barrier.image = image;
-    barrier.subresourceRange.aspectMask = !ds ? VK_IMAGE_ASPECT_COLOR_BIT : (VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT);
-    barrier.subresourceRange.levelCount = barrier.subresourceRange.layerCount = 1;
-
-    f->vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-                            0,
-                            0, nullptr,
-                            0, nullptr,
-                            1, &barrier);
+    return (v + byteAlign - 1) & ~(byteAlign - 1);
 }
 
-void QVulkanRenderLoopPrivate::createDeviceAndSurface()
+void QVulkanRenderLoopPrivate::createDynamicBuffer()
 {
-    VkApplicationInfo appInfo;
-    memset(&appInfo, 0, sizeof(appInfo));
-    appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
-    appInfo.pApplicationName = "qqvk";
-    appInfo.apiVersion = VK_MAKE_VERSION(1, 0, 2);
+    const VkPhysicalDeviceLimits &limits(m_physDevProps.limits);
+    const VkDeviceSize regionAlign = qMax(limits.minUniformBufferOffsetAlignment, limits.nonCoherentAtomSize);
+    m_dynamicFrameSize = aligned(qMax<VkDeviceSize>(m_dynamicBufferSize, 1), regionAlign);
+    m_dynamicBase = 0;
+    m_dynamicUsed.store(0);
+    m_dynamicFlushed = 0;
+
+    VkBufferCreateInfo bufInfo;
+    memset(&bufInfo, 0, sizeof(bufInfo));
+    bufInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    m_dynamicFrameCount = m_framesInFlight;
+    bufInfo.size = m_dynamicFrameCount * m_dynamicFrameSize;
+    bufInfo.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+            | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT
+            | VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+    VkResult err = f->vkCreateBuffer(m_vkDev, &bufInfo, nullptr, &m_dynamicBuf);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create dynamic buffer: %d", err);
+
+    VkMemoryRequirements memReq;
+    f->vkGetBufferMemoryRequirements(m_vkDev, m_dynamicBuf, &memReq);
+    m_dynamicAlloc = m_memAllocator->allocate(memReq, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
+                                              VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, VK_IMAGE_TILING_LINEAR);
+    if (m_dynamicAlloc.memory == VK_NULL_HANDLE)
+        qFatal("Failed to allocate dynamic buffer memory");
+
+    err = f->vkBindBufferMemory(m_vkDev, m_dynamicBuf, m_dynamicAlloc.memory, m_dynamicAlloc.offset);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to bind dynamic buffer memory: %d", err);
+
+    m_dynamicCoherent = m_vkPhysDevMemProps.memoryTypes[m_dynamicAlloc.memoryTypeIndex].propertyFlags
+            & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
 
-    uint32_t layerCount = 0;
-    f->vkEnumerateInstanceLayerProperties(&layerCount, nullptr);
     if (Q_UNLIKELY(debug_render()))
-        qDebug("%d instance layers", layerCount);
-    QVector<char *> enabledLayers;
-    if (layerCount) {
+        qDebug("dynamic buffer: %d x %llu bytes, %s", m_framesInFlight,
+               (unsigned long long) m_dynamicFrameSize, m_dynamicCoherent ? "coherent" : "non-coherent");
+}
+
+void QVulkanRenderLoopPrivate::releaseDynamicBuffer()
+{
+    if (m_dynamicBuf == VK_NULL_HANDLE)
+        return;
+
+    f->vkDestroyBuffer(m_vkDev, m_dynamicBuf, nullptr);
+    m_dynamicBuf = VK_NULL_HANDLE;
+    m_memAllocator->free(m_dynamicAlloc);
+}
+
+// Lock-free bump allocation from the current frame slot's region.
+bool QVulkanRenderLoopPrivate::allocateDynamic(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize *offset)
+{
+    const VkDeviceSize align = qMax(alignment, m_physDevProps.limits.minUniformBufferOffsetAlignment);
+    quint64 used = m_dynamicUsed.load();
+    VkDeviceSize start;
+    do {
+        start = aligned(used, align);
+        if (start + size > m_dynamicFrameSize)
+            return false;
+    } while (!m_dynamicUsed.testAndSetOrdered(used, start + size, used));
+
+    *offset = m_dynamicBase + start;
+    return true;
+}
+
+// Flushes everything written since the previous flush in one go. No-op for
+// coherent memory.
+void QVulkanRenderLoopPrivate::flushDynamicData()
+{
+    if (m_dynamicCoherent)
+        return;
+
+    QMutexLocker lock(&m_dynamicFlushMutex);
+    const VkDeviceSize used = m_dynamicUsed.load();
+    if (used <= m_dynamicFlushed)
+        return;
+
+    // Regions are aligned to nonCoherentAtomSize so rounding never crosses into another frame's region.
+    const VkDeviceSize atom = m_physDevProps.limits.nonCoherentAtomSize;
+    const VkDeviceSize base = m_dynamicAlloc.offset + m_dynamicBase;
+    VkMappedMemoryRange range;
+    memset(&range, 0, sizeof(range));
+    range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+    range.memory = m_dynamicAlloc.memory;
+    range.offset = base + (m_dynamicFlushed & ~(atom - 1));
+    range.size = base + aligned(used, atom) - range.offset;
+    VkResult err = f->vkFlushMappedMemoryRanges(m_vkDev, 1, &range);
+    if (err != VK_SUCCESS)
+        qWarning("Failed to flush dynamic buffer: %d", err);
+
+    m_dynamicFlushed = used;
+}
+
+class QVulkanReadbackTask : public QRunnable
+{
+public:
+    QVulkanReadbackTask(QVulkanRenderLoopPrivate::Readback *rb) : m_rb(rb) { }
+
+    void run() override
+    {
+        for (const QVulkanReadbackCallback &callback : qAsConst(m_rb->callbacks))
+            callback(m_rb->result);
+        m_rb->callbacks.clear();
+        m_rb->busy.storeRelease(0);
+    }
+
+private:
+    QVulkanRenderLoopPrivate::Readback *m_rb;
+};
+
+// The copy below assumes 4 bytes per pixel.
+static bool isReadbackFormat(VkFormat format)
+{
+    switch (format) {
+    case VK_FORMAT_R8G8B8A8_UNORM:
+    case VK_FORMAT_R8G8B8A8_SRGB:
+    case VK_FORMAT_B8G8R8A8_UNORM:
+    case VK_FORMAT_B8G8R8A8_SRGB:
+    case VK_FORMAT_A8B8G8R8_UNORM_PACK32:
+    case VK_FORMAT_A2R10G10B10_UNORM_PACK32:
+    case VK_FORMAT_A2B10G10R10_UNORM_PACK32:
+        return true;
+    default:
+        return false;
+    }
+}
+
+void QVulkanRenderLoopPrivate::recordReadback(VkCommandBuffer cb, QVulkanImageBarrierBatch::Image *img)
+{
+    QMutexLocker lock(&m_readbackMutex);
+    if (m_readbackRequests.isEmpty())
+        return;
+
+    if (!m_readbackSupported || !isReadbackFormat(m_colorFormat)) {
+        qWarning("Readback is not supported (format %d)", m_colorFormat);
+        m_readbackRequests.clear();
+        return;
+    }
+
+    Readback *rb = nullptr;
+    for (int i = 0; i < m_readbackDepth && !rb; ++i) {
+        if (m_readbacks[i].busy.testAndSetAcquire(0, 1))
+            rb = &m_readbacks[i];
+    }
+    if (!rb) {
+        // Never wait, leave the requests to a later frame.
+        if (Q_UNLIKELY(debug_render()))
+            qDebug("all %d readbacks in flight, deferring", m_readbackDepth);
+        return;
+    }
+    rb->callbacks = m_readbackRequests;
+    m_readbackRequests.clear();
+    lock.unlock();
+
+    const VkPhysicalDeviceLimits &limits(m_physDevProps.limits);
+    const VkDeviceSize rowAlign = m_readbackTight ? 4 : qMax<VkDeviceSize>(4, limits.optimalBufferCopyRowPitchAlignment);
+    const int bytesPerLine = int(aligned(m_swapChainExtent.width * 4, rowAlign));
+    const VkDeviceSize size = VkDeviceSize(bytesPerLine) * m_swapChainExtent.height;
+
+    if (rb->buffer == VK_NULL_HANDLE || rb->alloc.size < size) {
+        // Not busy means the GPU is done with it too.
+        if (rb->buffer != VK_NULL_HANDLE) {
+            f->vkDestroyBuffer(m_vkDev, rb->buffer, nullptr);
+            m_memAllocator->free(rb->alloc);
+        }
+
+        VkBufferCreateInfo bufInfo;
+        memset(&bufInfo, 0, sizeof(bufInfo));
+        bufInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        bufInfo.size = size;
+        bufInfo.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+        VkResult err = f->vkCreateBuffer(m_vkDev, &bufInfo, nullptr, &rb->buffer);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to create readback buffer: %d", err);
+
+        // Atom aligned so that invalidating never touches a neighbour.
+        VkMemoryRequirements memReq;
+        f->vkGetBufferMemoryRequirements(m_vkDev, rb->buffer, &memReq);
+        memReq.alignment = qMax(memReq.alignment, limits.nonCoherentAtomSize);
+        memReq.size = aligned(memReq.size, limits.nonCoherentAtomSize);
+        rb->alloc = m_memAllocator->allocate(memReq, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
+                                             VK_MEMORY_PROPERTY_HOST_CACHED_BIT, VK_IMAGE_TILING_LINEAR);
+        if (rb->alloc.memory == VK_NULL_HANDLE)
+            qFatal("Failed to allocate readback buffer memory");
+
+        err = f->vkBindBufferMemory(m_vkDev, rb->buffer, rb->alloc.memory, rb->alloc.offset);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to bind readback buffer memory: %d", err);
+    }
+
+    QVulkanImageState state;
+    state.layout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    state.access = VK_ACCESS_TRANSFER_READ_BIT;
+    state.stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    m_imageBarriers.transition(img, state);
+    m_imageBarriers.record(f, cb);
+
+    VkBufferImageCopy copy;
+    memset(&copy, 0, sizeof(copy));
+    copy.bufferRowLength = bytesPerLine / 4;
+    copy.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    copy.imageSubresource.layerCount = 1;
+    copy.imageExtent.width = m_swapChainExtent.width;
+    copy.imageExtent.height = m_swapChainExtent.height;
+    copy.imageExtent.depth = 1;
+    f->vkCmdCopyImageToBuffer(cb, img->image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, rb->buffer, 1, &copy);
+
+    VkBufferMemoryBarrier barrier;
+    memset(&barrier, 0, sizeof(barrier));
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.buffer = rb->buffer;
+    barrier.size = VK_WHOLE_SIZE;
+    f->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0,
+                            0, nullptr, 1, &barrier, 0, nullptr);
+
+    rb->frame = m_currentFrame;
+    ++m_readbacksPending[m_currentFrame];
+    rb->result.frameNumber = m_frameNumber;
+    rb->result.size = QSize(m_swapChainExtent.width, m_swapChainExtent.height);
+    rb->result.format = m_colorFormat;
+    rb->result.bytesPerLine = bytesPerLine;
+    rb->result.data = rb->alloc.mapped;
+}
+
+// Called once the fence of the given slot has signalled.
+void QVulkanRenderLoopPrivate::deliverReadbacks(int frame)
+{
+    if (!m_readbacksPending[frame])
+        return;
+
+    m_readbacksPending[frame] = 0;
+    for (int i = 0; i < MAX_READBACKS; ++i) {
+        Readback *rb = &m_readbacks[i];
+        if (rb->frame != frame)
+            continue;
+        rb->frame = -1;
+        if (!(m_vkPhysDevMemProps.memoryTypes[rb->alloc.memoryTypeIndex].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) {
+            VkMappedMemoryRange range;
+            memset(&range, 0, sizeof(range));
+            range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+            range.memory = rb->alloc.memory;
+            range.offset = rb->alloc.offset;
+            range.size = rb->alloc.size;
+            VkResult err = f->vkInvalidateMappedMemoryRanges(m_vkDev, 1, &range);
+            if (err != VK_SUCCESS)
+                qWarning("Failed to invalidate readback buffer: %d", err);
+        }
+        m_readbackPool.start(new QVulkanReadbackTask(rb));
+    }
+}
+
+// The device is idle, so whatever is still pending can be delivered right away.
+void QVulkanRenderLoopPrivate::releaseReadbacks()
+{
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i)
+        deliverReadbacks(i);
+    m_readbackPool.waitForDone();
+
+    for (int i = 0; i < MAX_READBACKS; ++i) {
+        Readback *rb = &m_readbacks[i];
+        if (rb->buffer == VK_NULL_HANDLE)
+            continue;
+        f->vkDestroyBuffer(m_vkDev, rb->buffer, nullptr);
+        rb->buffer = VK_NULL_HANDLE;
+        m_memAllocator->free(rb->alloc);
+    }
+}
+
+// Rejects data from another driver or device up front, instead of relying on
+// the implementation to ignore it.
+static bool isPipelineCacheCompatible(const QByteArray &data, const VkPhysicalDeviceProperties &props)
+{
+    const int headerSize = 4 * sizeof(quint32) + VK_UUID_SIZE;
+    if (data.size() < headerSize)
+        return false;
+
+    quint32 header[4]; // length, version, vendorID, deviceID
+    memcpy(header, data.constData(), sizeof(header));
+    return header[0] >= quint32(headerSize)
+            && header[1] == VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+            && header[2] == props.vendorID
+            && header[3] == props.deviceID
+            && !memcmp(data.constData() + sizeof(header), props.pipelineCacheUUID, VK_UUID_SIZE);
+}
+
+static bool writePipelineCacheFile(const QString &fileName, const QByteArray &data)
+{
+    QDir().mkpath(QFileInfo(fileName).absolutePath());
+    QSaveFile f(fileName);
+    if (!f.open(QIODevice::WriteOnly)) {
+        qWarning("Failed to open pipeline cache file %s: %s", qPrintable(fileName), qPrintable(f.errorString()));
+        return false;
+    }
+    f.write(data);
+    if (!f.commit()) {
+        qWarning("Failed to write pipeline cache file %s: %s", qPrintable(fileName), qPrintable(f.errorString()));
+        return false;
+    }
+    return true;
+}
+
+class QVulkanPipelineCacheWriter : public QRunnable
+{
+public:
+    QVulkanPipelineCacheWriter(const QString &fileName, const QByteArray &data)
+        : m_fileName(fileName), m_data(data) { }
+
+    void run() override { writePipelineCacheFile(m_fileName, m_data); }
+
+private:
+    QString m_fileName;
+    QByteArray m_data;
+};
+
+void QVulkanRenderLoopPrivate::createPipelineCache()
+{
+    if (!m_pipelineCacheFileSet) {
+        const QString dir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+        if (!dir.isEmpty())
+            m_pipelineCacheFile = dir + QStringLiteral("/qvulkan.pipelinecache");
+        m_pipelineCacheFileSet = true;
+    }
+
+    // After an obscure the data from before is still around, no need to go to disk.
+    if (m_pipelineCacheData.isEmpty() && !m_pipelineCacheFile.isEmpty()) {
+        QFile file(m_pipelineCacheFile);
+        if (file.open(QIODevice::ReadOnly))
+            m_pipelineCacheData = file.readAll();
+    }
+    if (!m_pipelineCacheData.isEmpty() && !isPipelineCacheCompatible(m_pipelineCacheData, m_physDevProps)) {
+        if (Q_UNLIKELY(debug_render()))
+            qDebug("ignoring incompatible pipeline cache data");
+        m_pipelineCacheData.clear();
+    }
+
+    VkPipelineCacheCreateInfo pipelineCacheInfo;
+    memset(&pipelineCacheInfo, 0, sizeof(pipelineCacheInfo));
+    pipelineCacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    pipelineCacheInfo.initialDataSize = m_pipelineCacheData.size();
+    pipelineCacheInfo.pInitialData = m_pipelineCacheData.constData();
+    VkResult err = f->vkCreatePipelineCache(m_vkDev, &pipelineCacheInfo, nullptr, &m_pipelineCache);
+    if (err != VK_SUCCESS && !m_pipelineCacheData.isEmpty()) {
+        qWarning("Failed to create pipeline cache from %d bytes of data, starting with an empty one: %d",
+                 m_pipelineCacheData.size(), err);
+        m_pipelineCacheData.clear();
+        pipelineCacheInfo.initialDataSize = 0;
+        pipelineCacheInfo.pInitialData = nullptr;
+        err = f->vkCreatePipelineCache(m_vkDev, &pipelineCacheInfo, nullptr, &m_pipelineCache);
+    }
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create pipeline cache: %d", err);
+
+    if (Q_UNLIKELY(debug_render()))
+        qDebug("pipeline cache created with %d bytes of initial data", m_pipelineCacheData.size());
+
+    m_pipelineBuilder = new QVulkanPipelineBuilder(f, m_vkDev, m_pipelineCacheData);
+
+    m_pipelineCacheSaveTimer.start();
+}
+
+// Pipeline caches only ever grow, so an unchanged size means nothing new.
+void QVulkanRenderLoopPrivate::savePipelineCache(bool async)
+{
+    if (m_pipelineCache == VK_NULL_HANDLE)
+        return;
+
+    size_t size = 0;
+    VkResult err = f->vkGetPipelineCacheData(m_vkDev, m_pipelineCache, &size, nullptr);
+    if (err != VK_SUCCESS) {
+        qWarning("Failed to get pipeline cache data size: %d", err);
+        return;
+    }
+    if (!size || size == size_t(m_pipelineCacheData.size()))
+        return;
+
+    QByteArray data(int(size), Qt::Uninitialized);
+    err = f->vkGetPipelineCacheData(m_vkDev, m_pipelineCache, &size, data.data());
+    if (err != VK_SUCCESS && err != VK_INCOMPLETE) {
+        qWarning("Failed to get pipeline cache data: %d", err);
+        return;
+    }
+    data.resize(int(size));
+    m_pipelineCacheData = data;
+
+    if (Q_UNLIKELY(debug_render()))
+        qDebug("saving %d bytes of pipeline cache data to %s", data.size(), qPrintable(m_pipelineCacheFile));
+
+    if (m_pipelineCacheFile.isEmpty())
+        return;
+
+    if (async) {
+        m_pipelineCachePool.start(new QVulkanPipelineCacheWriter(m_pipelineCacheFile, data));
+    } else {
+        m_pipelineCachePool.waitForDone();
+        writePipelineCacheFile(m_pipelineCacheFile, data);
+    }
+}
+
+void QVulkanRenderLoopPrivate::releasePipelineCache()
+{
+    if (m_pipelineBuilder) {
+        m_pipelineBuilder->waitForDone();
+        if (m_pipelineCache != VK_NULL_HANDLE)
+            m_pipelineBuilder->mergeInto(m_pipelineCache);
+        delete m_pipelineBuilder;
+        m_pipelineBuilder = nullptr;
+    }
+    savePipelineCache(false);
+    m_pipelineCachePool.waitForDone();
+    if (m_pipelineCache != VK_NULL_HANDLE) {
+        f->vkDestroyPipelineCache(m_vkDev, m_pipelineCache, nullptr);
+        m_pipelineCache = VK_NULL_HANDLE;
+    }
+}
+
+void QVulkanFrameTimingsRing::publish(const QVulkanFrameTimings &timings)
+{
+    const quint64 count = m_count.load();
+    Slot &slot(m_slots[count % SIZE]);
+    const uint seq = slot.seq.load();
+    slot.seq.store(seq + 1); // odd: update in progress
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.timings = timings;
+    slot.seq.storeRelease(seq + 2);
+    m_count.storeRelease(count + 1);
+}
+
+int QVulkanFrameTimingsRing::read(QVulkanFrameTimings *dst, int maxCount) const
+{
+    const quint64 count = m_count.loadAcquire();
+    const int n = int(qMin<quint64>(qMin<quint64>(count, SIZE), quint64(qMax(0, maxCount))));
+    int copied = 0;
+    for (int i = 0; i < n; ++i) {
+        const quint64 frame = count - 1 - i;
+        const Slot &slot(m_slots[frame % SIZE]);
+        uint seq1, seq2;
+        do {
+            seq1 = slot.seq.loadAcquire();
+            dst[copied] = slot.timings;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            seq2 = slot.seq.load();
+        } while ((seq1 & 1) || seq1 != seq2);
+        // The writer has lapped us, everything older is gone too.
+        if (dst[copied].frameNumber != frame)
+            break;
+        ++copied;
+    }
+    return copied;
+}
+
+void QVulkanRenderLoopPrivate::createQueryPools()
+{
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+        m_queryPool[i] = VK_NULL_HANDLE;
+        m_queriesPending[i] = false;
+        m_gpuRangeCount[i].store(0);
+    }
+    m_gpuFrameTime = 0;
+
+    if (!m_gpuTimestamps)
+        return;
+
+    VkQueryPoolCreateInfo queryPoolInfo;
+    memset(&queryPoolInfo, 0, sizeof(queryPoolInfo));
+    queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    queryPoolInfo.queryCount = 2 + 2 * MAX_GPU_RANGES;
+    // For every slot, so that the frames in flight can grow later.
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+        VkResult err = f->vkCreateQueryPool(m_vkDev, &queryPoolInfo, nullptr, &m_queryPool[i]);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to create query pool: %d", err);
+    }
+}
+
+void QVulkanRenderLoopPrivate::releaseQueryPools()
+{
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+        if (m_queryPool[i] != VK_NULL_HANDLE) {
+            f->vkDestroyQueryPool(m_vkDev, m_queryPool[i], nullptr);
+            m_queryPool[i] = VK_NULL_HANDLE;
+        }
+    }
+}
+
+// Called after the slot's fence has signalled so the results are available
+// without waiting.
+void QVulkanRenderLoopPrivate::readTimestamps(int frame)
+{
+    m_queriesPending[frame] = false;
+
+    const int allocated = m_gpuRangeCount[frame].load();
+    const int rangeCount = allocated < MAX_GPU_RANGES ? allocated : MAX_GPU_RANGES;
+    const uint32_t queryCount = 2 + 2 * rangeCount;
+    // Each result is followed by its availability. A range that was begun but
+    // never submitted only drops that range, not the whole frame.
+    quint64 ts[2 * (2 + 2 * MAX_GPU_RANGES)];
+    VkResult err = f->vkGetQueryPoolResults(m_vkDev, m_queryPool[frame], 0, queryCount,
+                                            queryCount * 2 * sizeof(quint64), ts, 2 * sizeof(quint64),
+                                            VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+    if (err != VK_SUCCESS && err != VK_NOT_READY)
+        return;
+
+    auto available = [&ts](int query) { return ts[2 * query + 1] != 0; };
+    auto value = [&ts](int query) { return ts[2 * query]; };
+    const double period = m_physDevProps.limits.timestampPeriod;
+    auto elapsed = [this, period](quint64 start, quint64 end) {
+        return qint64(((end - start) & m_timestampMask) * period);
+    };
+
+    QMutexLocker lock(&m_gpuTimingsMutex);
+    if (available(0) && available(1))
+        m_gpuFrameTime = elapsed(value(0), value(1));
+    m_gpuRangeTimes.clear();
+    for (int i = 0; i < rangeCount; ++i) {
+        if (!available(2 + 2 * i) || !available(3 + 2 * i))
+            continue;
+        m_gpuRangeTimes.append(qMakePair(QByteArray(m_gpuRangeNames[frame][i]),
+                                         elapsed(value(2 + 2 * i), value(3 + 2 * i))));
+    }
+}
+
+static const VkAccessFlags WRITE_ACCESS_MASK = VK_ACCESS_SHADER_WRITE_BIT
+        | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT
+        | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT
+        | VK_ACCESS_TRANSFER_WRITE_BIT
+        | VK_ACCESS_HOST_WRITE_BIT
+        | VK_ACCESS_MEMORY_WRITE_BIT;
+
+void QVulkanImageBarrierBatch::reset(Image *img, VkImage image, VkImageAspectFlags aspect)
+{
+    img->image = image;
+    img->aspect = aspect;
+    img->state.layout = VK_IMAGE_LAYOUT_UNDEFINED;
+    img->state.access = 0;
+    img->state.stage = 0;
+    img->writeStage = 0;
+    img->writeAccess = 0;
+    img->readStages = 0;
+    img->readAccess = 0;
+}
+
+// For state changes done outside the batch. The given state is all that is
+// known to be ordered.
+void QVulkanImageBarrierBatch::setState(Image *img, const QVulkanImageState &state)
+{
+    img->state = state;
+    if (state.access & WRITE_ACCESS_MASK) {
+        img->writeStage = state.stage;
+        img->writeAccess = state.access & WRITE_ACCESS_MASK;
+        img->readStages = 0;
+        img->readAccess = 0;
+    } else {
+        img->writeStage = 0;
+        img->writeAccess = 0;
+        img->readStages = state.stage;
+        img->readAccess = state.access;
+    }
+}
+
+void QVulkanImageBarrierBatch::transition(Image *img, const QVulkanImageState &state)
+{
+    // An image can only appear once in a barrier. If it is already in the
+    // batch, just retarget that one.
+    VkImageMemoryBarrier *barrier = nullptr;
+    for (int i = 0; i < m_barriers.count(); ++i) {
+        if (m_barriers[i].image == img->image) {
+            barrier = &m_barriers[i];
+            break;
+        }
+    }
+
+    // Reads after reads in the same layout need no barrier when the one that
+    // followed the last write already covers them. Otherwise a pending
+    // barrier is extended, or the new reader gets its own barrier from the
+    // write. The readers of that barrier are included in the source, they
+    // carry the dependency on the layout change.
+    if (img->state.layout == state.layout
+            && !(img->state.access & WRITE_ACCESS_MASK) && !(state.access & WRITE_ACCESS_MASK)) {
+        const bool covered = !(state.stage & ~img->readStages) && !(state.access & ~img->readAccess);
+        const VkPipelineStageFlags srcStages = img->writeStage | img->readStages;
+        if (!covered && (barrier || srcStages)) {
+            if (!barrier) {
+                barrier = addBarrier(img);
+                barrier->srcAccessMask = img->writeAccess;
+                barrier->newLayout = state.layout;
+                m_srcStages |= srcStages;
+            }
+            barrier->dstAccessMask |= state.access;
+            m_dstStages |= state.stage ? state.stage : VkPipelineStageFlags(VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+        }
+        img->readStages |= state.stage;
+        img->readAccess |= state.access;
+        img->state.access |= state.access;
+        img->state.stage |= state.stage;
+        return;
+    }
+
+    if (!barrier) {
+        barrier = addBarrier(img);
+        barrier->srcAccessMask = img->state.access & WRITE_ACCESS_MASK; // only writes need to be made available
+        m_srcStages |= img->state.stage ? img->state.stage : VkPipelineStageFlags(VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT);
+    }
+
+    barrier->newLayout = state.layout;
+    barrier->dstAccessMask = state.access;
+    m_dstStages |= state.stage ? state.stage : VkPipelineStageFlags(VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+
+    if (state.access & WRITE_ACCESS_MASK) {
+        img->writeStage = state.stage;
+        img->writeAccess = state.access & WRITE_ACCESS_MASK;
+        img->readStages = 0;
+        img->readAccess = 0;
+    } else {
+        if (img->state.access & WRITE_ACCESS_MASK) {
+            img->writeStage = img->state.stage;
+            img->writeAccess = img->state.access & WRITE_ACCESS_MASK;
+        }
+        img->readStages = state.stage;
+        img->readAccess = state.access;
+    }
+    img->state = state;
+}
+
+VkImageMemoryBarrier *QVulkanImageBarrierBatch::addBarrier(Image *img)
+{
+    VkImageMemoryBarrier b;
+    memset(&b, 0, sizeof(b));
+    b.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    b.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    b.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    b.image = img->image;
+    b.oldLayout = img->state.layout;
+    b.subresourceRange.aspectMask = img->aspect;
+    b.subresourceRange.levelCount = VK_REMAINING_MIP_LEVELS;
+    b.subresourceRange.layerCount = VK_REMAINING_ARRAY_LAYERS;
+    m_barriers.append(b);
+    return &m_barriers.last();
+}
+
+void QVulkanImageBarrierBatch::record(QVulkanFunctions *f, VkCommandBuffer cb)
+{
+    if (m_barriers.isEmpty())
+        return;
+
+    f->vkCmdPipelineBarrier(cb, m_srcStages, m_dstStages, 0,
+                            0, nullptr,
+                            0, nullptr,
+                            m_barriers.count(), m_barriers.constData());
+    clear();
+}
+
+void QVulkanImageBarrierBatch::clear()
+{
+    m_barriers.clear();
+    m_srcStages = m_dstStages = 0;
+}
+
+QVulkanImageBarrierBatch::Image *QVulkanRenderLoopPrivate::trackedImage(QVulkanRenderLoop::TrackedImage image)
+{
+    if (image == QVulkanRenderLoop::DepthStencilImage)
+        return &m_dsTrack;
+    return &m_swapChainImageTrack[m_currentSwapChainBuffer];
+}
+
+void QVulkanRenderLoopPrivate::createDeviceAndSurface()
+{
+    VkApplicationInfo appInfo;
+    memset(&appInfo, 0, sizeof(appInfo));
+    appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+    appInfo.pApplicationName = "qqvk";
+    appInfo.apiVersion = VK_MAKE_VERSION(1, 0, 2);
+
+    uint32_t layerCount = 0;
+    f->vkEnumerateInstanceLayerProperties(&layerCount, nullptr);
+    if (Q_UNLIKELY(debug_render()))
+        qDebug("%d instance layers", layerCount);
+    QVector<char *> enabledLayers;
+    if (layerCount) {
         QVector<VkLayerProperties> layerProps(layerCount);
         f->vkEnumerateInstanceLayerProperties(&layerCount, layerProps.data());
         for (const VkLayerProperties &p : qAsConst(layerProps)) {
@@ -624,9 +2187,10 @@ void QVulkanRenderLoopPrivate::createDeviceAndSurface()
             if (!strcmp(p.extensionName, "VK_EXT_debug_report")) {
                 enabledExtensions.append(strdup(p.extensionName));
                 m_hasDebug = true;
-            } else if (!strcmp(p.extensionName, "VK_KHR_surface")
-                       || !strcmp(p.extensionName, "VK_KHR_win32_surface")
-                       || !strcmp(p.extensionName, "VK_KHR_xcb_surface"))
+            } else if (!m_offscreen
+                       && (!strcmp(p.extensionName, "VK_KHR_surface")
+                           || !strcmp(p.extensionName, "VK_KHR_win32_surface")
+                           || !strcmp(p.extensionName, "VK_KHR_xcb_surface")))
             {
                 enabledExtensions.append(strdup(p.extensionName));
             }
@@ -673,7 +2237,9 @@ void QVulkanRenderLoopPrivate::createDeviceAndSurface()
         }
     }
 
-    createSurface();
+    if (!m_offscreen)
+        createSurface();
+    resetFrameState();
 
     uint32_t devCount = 0;
     f->vkEnumeratePhysicalDevices(m_vkInst, &devCount, nullptr);
@@ -722,7 +2288,7 @@ void QVulkanRenderLoopPrivate::createDeviceAndSurface()
         QVector<VkExtensionProperties> extProps(extCount);
         f->vkEnumerateDeviceExtensionProperties(m_vkPhysDev, nullptr, &extCount, extProps.data());
         for (const VkExtensionProperties &p : qAsConst(extProps)) {
-            if (!strcmp(p.extensionName, "VK_KHR_swapchain")
+            if ((!m_offscreen && !strcmp(p.extensionName, "VK_KHR_swapchain"))
                 || !strcmp(p.extensionName, "VK_NV_glsl_shader"))
             {
                 enabledExtensions.append(strdup(p.extensionName));
@@ -742,7 +2308,8 @@ void QVulkanRenderLoopPrivate::createDeviceAndSurface()
         if (Q_UNLIKELY(debug_render()))
             qDebug("queue family %d: flags=0x%x count=%d", i, queueFamilyProps[i].queueFlags, queueFamilyProps[i].queueCount);
         bool ok = (queueFamilyProps[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) != 0;
-        ok |= physicalDeviceSupportsPresent(i);
+        if (!m_offscreen)
+            ok |= physicalDeviceSupportsPresent(i);
         if (ok) {
             gfxQueueFamilyIdx = i;
             break;
@@ -751,19 +2318,46 @@ void QVulkanRenderLoopPrivate::createDeviceAndSurface()
     if (gfxQueueFamilyIdx == -1)
         qFatal("No presentable graphics queue family found");
 
-    VkDeviceQueueCreateInfo queueInfo;
-    memset(&queueInfo, 0, sizeof(queueInfo));
-    queueInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-    queueInfo.queueFamilyIndex = gfxQueueFamilyIdx;
-    queueInfo.queueCount = 1;
-    const float prio[] = { 0 };
-    queueInfo.pQueuePriorities = prio;
+    // Dedicated families let compute and transfers overlap with graphics.
+    int computeQueueFamilyIdx = -1;
+    int transferQueueFamilyIdx = -1;
+    for (int i = 0; i < queueFamilyProps.count(); ++i) {
+        const VkQueueFlags flags = queueFamilyProps[i].queueFlags;
+        if (flags & VK_QUEUE_GRAPHICS_BIT)
+            continue;
+        if ((flags & VK_QUEUE_COMPUTE_BIT) && computeQueueFamilyIdx == -1)
+            computeQueueFamilyIdx = i;
+        else if ((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & VK_QUEUE_COMPUTE_BIT) && transferQueueFamilyIdx == -1)
+            transferQueueFamilyIdx = i;
+    }
+    if (Q_UNLIKELY(debug_render()))
+        qDebug("queue families: graphics %d, compute %d, transfer %d",
+               gfxQueueFamilyIdx, computeQueueFamilyIdx, transferQueueFamilyIdx);
+
+    // The upload thread gets a second queue of the transfer family, so that
+    // queue(TransferQueue) is left to the application. With just one queue
+    // there, uploads go through the graphics queue instead.
+    const bool uploadQueue = transferQueueFamilyIdx != -1 && queueFamilyProps[transferQueueFamilyIdx].queueCount >= 2;
+
+    const float prio[] = { 0, 0 };
+    VkDeviceQueueCreateInfo queueInfo[3];
+    memset(queueInfo, 0, sizeof(queueInfo));
+    int queueInfoCount = 0;
+    for (int idx : { gfxQueueFamilyIdx, computeQueueFamilyIdx, transferQueueFamilyIdx }) {
+        if (idx == -1)
+            continue;
+        queueInfo[queueInfoCount].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+        queueInfo[queueInfoCount].queueFamilyIndex = idx;
+        queueInfo[queueInfoCount].queueCount = uploadQueue && idx == transferQueueFamilyIdx ? 2 : 1;
+        queueInfo[queueInfoCount].pQueuePriorities = prio;
+        ++queueInfoCount;
+    }
 
     VkDeviceCreateInfo devInfo;
     memset(&devInfo, 0, sizeof(devInfo));
     devInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-    devInfo.queueCreateInfoCount = 1;
-    devInfo.pQueueCreateInfos = &queueInfo;
+    devInfo.queueCreateInfoCount = queueInfoCount;
+    devInfo.pQueueCreateInfos = queueInfo;
     if (!enabledLayers.isEmpty()) {
         devInfo.enabledLayerCount = enabledLayers.count();
         devInfo.ppEnabledLayerNames = enabledLayers.constData();
@@ -781,6 +2375,7 @@ void QVulkanRenderLoopPrivate::createDeviceAndSurface()
     for (auto s : enabledExtensions) free(s);
 
     f->vkGetDeviceQueue(m_vkDev, gfxQueueFamilyIdx, 0, &m_vkQueue);
+    m_gfxQueueFamilyIdx = gfxQueueFamilyIdx;
 
     VkCommandPoolCreateInfo poolInfo;
     memset(&poolInfo, 0, sizeof(poolInfo));
@@ -790,6 +2385,34 @@ void QVulkanRenderLoopPrivate::createDeviceAndSurface()
     if (err != VK_SUCCESS)
         qFatal("Failed to create command pool: %d", err);
 
+    const Queue gfxQueue = { m_vkQueue, m_gfxQueueFamilyIdx, m_vkCmdPool, true };
+    m_queues[QVulkanRenderLoop::GraphicsQueue] = gfxQueue;
+    const int dedicatedIdx[] = { computeQueueFamilyIdx, transferQueueFamilyIdx };
+    for (int type = QVulkanRenderLoop::ComputeQueue; type <= QVulkanRenderLoop::TransferQueue; ++type) {
+        Queue &q(m_queues[type]);
+        const int idx = dedicatedIdx[type - QVulkanRenderLoop::ComputeQueue];
+        if (idx == -1) {
+            q = gfxQueue;
+            q.dedicated = false;
+            continue;
+        }
+        q.familyIndex = idx;
+        q.dedicated = true;
+        f->vkGetDeviceQueue(m_vkDev, idx, 0, &q.queue);
+        poolInfo.queueFamilyIndex = idx;
+        err = f->vkCreateCommandPool(m_vkDev, &poolInfo, nullptr, &q.cmdPool);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to create command pool for queue family %d: %d", idx, err);
+    }
+
+    if (uploadQueue) {
+        f->vkGetDeviceQueue(m_vkDev, transferQueueFamilyIdx, 1, &m_uploadQueue);
+        m_uploadQueueFamilyIdx = transferQueueFamilyIdx;
+    } else {
+        m_uploadQueue = m_vkQueue;
+        m_uploadQueueFamilyIdx = m_gfxQueueFamilyIdx;
+    }
+
     m_hostVisibleMemIndex = 0;
     bool hostVisibleMemIndexSet = false;
     f->vkGetPhysicalDeviceMemoryProperties(m_vkPhysDev, &m_vkPhysDevMemProps);
@@ -810,6 +2433,27 @@ void QVulkanRenderLoopPrivate::createDeviceAndSurface()
     if (Q_UNLIKELY(debug_render()))
         qDebug("picked memtype %d for host visible memory", m_hostVisibleMemIndex);
 
+    m_memAllocator = new QVulkanMemoryAllocator(f, m_vkDev, m_vkPhysDevMemProps, m_physDevProps.limits);
+    createDynamicBuffer();
+    m_shaderRegistry->setDevice(m_vkDev);
+    createPipelineCache();
+
+    m_uploader = new QVulkanUploader(f, m_vkDev, m_memAllocator, m_physDevProps.limits,
+                                     m_uploadQueue, m_uploadQueueFamilyIdx, m_gfxQueueFamilyIdx,
+                                     m_uploadStagingSize);
+
+    m_gpuTimestamps = false;
+    if (m_flags.testFlag(QVulkanRenderLoop::GpuTimestamps)) {
+        const uint32_t validBits = queueFamilyProps[gfxQueueFamilyIdx].timestampValidBits;
+        if (validBits) {
+            m_gpuTimestamps = true;
+            m_timestampMask = validBits >= 64 ? ~quint64(0) : (quint64(1) << validBits) - 1;
+        } else {
+            qWarning("Timestamps are not supported on the graphics queue");
+        }
+    }
+    createQueryPools();
+
     m_colorFormat = VK_FORMAT_B8G8R8A8_UNORM; // will get changed based when setting up the swapchain
 
     const VkFormat dsFormatCandidates[] = {
@@ -834,6 +2478,18 @@ void QVulkanRenderLoopPrivate::createDeviceAndSurface()
 void QVulkanRenderLoopPrivate::releaseDeviceAndSurface()
 {
     releaseSurface();
+    releasePipelineCache();
+    m_shaderRegistry->setDevice(VK_NULL_HANDLE);
+    releaseQueryPools();
+    releaseDynamicBuffer();
+    delete m_uploader;
+    m_uploader = nullptr;
+    delete m_memAllocator;
+    m_memAllocator = nullptr;
+    for (int type = QVulkanRenderLoop::ComputeQueue; type <= QVulkanRenderLoop::TransferQueue; ++type) {
+        if (m_queues[type].dedicated)
+            f->vkDestroyCommandPool(m_vkDev, m_queues[type].cmdPool, nullptr);
+    }
     f->vkDestroyCommandPool(m_vkDev, m_vkCmdPool, nullptr);
     f->vkDestroyDevice(m_vkDev, nullptr);
 
@@ -876,28 +2532,48 @@ void QVulkanRenderLoopPrivate::createSurface()
     if (err != VK_SUCCESS)
         qFatal("Failed to create xcb surface: %d", err);
 #endif
+}
 
+void QVulkanRenderLoopPrivate::resetFrameState()
+{
     for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+        m_frameCmdPool[i] = VK_NULL_HANDLE;
         m_frameCmdBuf[i][0] = VK_NULL_HANDLE;
         m_frameCmdBuf[i][1] = VK_NULL_HANDLE;
         m_frameCmdBufRecording[i] = false;
         m_frameFence[i] = VK_NULL_HANDLE;
+        m_frameFenceActive[i] = false;
         m_acquireSem[i] = VK_NULL_HANDLE;
         m_renderSem[i] = VK_NULL_HANDLE;
         m_workerWaitSem[i] = VK_NULL_HANDLE;
         m_workerSignalSem[i] = VK_NULL_HANDLE;
+        m_readbacksPending[i] = 0;
     }
+
+    m_frameWaitSems.clear();
+    m_frameWaitStages.clear();
+    m_frameSignalSems.clear();
+
+    m_currentSwapChainBuffer = 0;
+    m_currentFrame = 0;
+    m_acquireWaitStage = m_worker ? VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT : VK_PIPELINE_STAGE_TRANSFER_BIT;
 }
 
 void QVulkanRenderLoopPrivate::releaseSurface()
 {
+    // The device is idle at this point so everything can go.
+    drainDeferredReleases();
+    releaseReadbacks();
+
     for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
-        for (int j = 0; j < 2; ++j) {
-            if (m_frameCmdBuf[i][j] != VK_NULL_HANDLE) {
-                f->vkFreeCommandBuffers(m_vkDev, m_vkCmdPool, 1, &m_frameCmdBuf[i][j]);
-                m_frameCmdBuf[i][j] = VK_NULL_HANDLE;
-            }
+        if (m_frameCmdPool[i] != VK_NULL_HANDLE) {
+            // frees the command buffers as well
+            f->vkDestroyCommandPool(m_vkDev, m_frameCmdPool[i], nullptr);
+            m_frameCmdPool[i] = VK_NULL_HANDLE;
         }
+        releaseThreadCmdPools(i);
+        m_frameCmdBuf[i][0] = VK_NULL_HANDLE;
+        m_frameCmdBuf[i][1] = VK_NULL_HANDLE;
         if (m_frameFence[i] != VK_NULL_HANDLE) {
             f->vkDestroyFence(m_vkDev, m_frameFence[i], nullptr);
             m_frameFence[i] = VK_NULL_HANDLE;
@@ -920,18 +2596,34 @@ void QVulkanRenderLoopPrivate::releaseSurface()
         }
     }
 
-    if (m_swapChain != VK_NULL_HANDLE) {
+    if (m_offscreen) {
+        releaseOffscreenImages();
+    } else if (m_swapChain != VK_NULL_HANDLE) {
         for (uint32_t i = 0; i < m_swapChainBufferCount; ++i)
             f->vkDestroyImageView(m_vkDev, m_swapChainImageViews[i], nullptr);
         vkDestroySwapchainKHR(m_vkDev, m_swapChain, nullptr);
         m_swapChain = VK_NULL_HANDLE;
+    }
+    m_swapChainBufferCount = 0;
+
+    if (m_dsAlloc.memory != VK_NULL_HANDLE) {
         f->vkDestroyImageView(m_vkDev, m_dsView, nullptr);
         f->vkDestroyImage(m_vkDev, m_ds, nullptr);
-        f->vkFreeMemory(m_vkDev, m_dsMem, nullptr);
-        m_dsMem = VK_NULL_HANDLE;
+        m_memAllocator->free(m_dsAlloc);
+        m_dsAlloc.memory = VK_NULL_HANDLE;
     }
 
-    vkDestroySurfaceKHR(m_vkInst, m_surface, nullptr);
+    if (!m_offscreen)
+        vkDestroySurfaceKHR(m_vkInst, m_surface, nullptr);
+}
+
+void QVulkanRenderLoopPrivate::releaseOffscreenImages()
+{
+    for (uint32_t i = 0; i < m_swapChainBufferCount; ++i) {
+        f->vkDestroyImageView(m_vkDev, m_swapChainImageViews[i], nullptr);
+        f->vkDestroyImage(m_vkDev, m_swapChainImages[i], nullptr);
+        m_memAllocator->free(m_offscreenAlloc[i]);
+    }
 }
 
 bool QVulkanRenderLoopPrivate::physicalDeviceSupportsPresent(int queueFamilyIdx)
@@ -953,19 +2645,158 @@ void QVulkanRenderLoopPrivate::recreateSwapChain()
     if (m_windowSize.isEmpty())
         return;
 
-    if (!vkCreateSwapchainKHR) {
-        vkCreateSwapchainKHR = reinterpret_cast<PFN_vkCreateSwapchainKHR>(f->vkGetDeviceProcAddr(m_vkDev, "vkCreateSwapchainKHR"));
-        vkDestroySwapchainKHR = reinterpret_cast<PFN_vkDestroySwapchainKHR>(f->vkGetDeviceProcAddr(m_vkDev, "vkDestroySwapchainKHR"));
-        vkGetSwapchainImagesKHR = reinterpret_cast<PFN_vkGetSwapchainImagesKHR>(f->vkGetDeviceProcAddr(m_vkDev, "vkGetSwapchainImagesKHR"));
-        vkAcquireNextImageKHR = reinterpret_cast<PFN_vkAcquireNextImageKHR>(f->vkGetDeviceProcAddr(m_vkDev, "vkAcquireNextImageKHR"));
-        vkQueuePresentKHR = reinterpret_cast<PFN_vkQueuePresentKHR>(f->vkGetDeviceProcAddr(m_vkDev, "vkQueuePresentKHR"));
+    QVK_TRACE_SCOPE("recreateSwapChain");
+
+    VkExtent2D bufferSize;
+    if (m_offscreen)
+        createOffscreenImages(&bufferSize);
+    else
+        createSwapChain(&bufferSize);
+
+    m_swapChainExtent = bufferSize;
+    m_currentSwapChainBuffer = 0;
+    for (int i = 0; i < MAX_SWAPCHAIN_BUFFERS; ++i)
+        m_nextFrameStart[i] = -1;
+    m_lastPresentedImage = -1;
+
+    m_frameActive = false;
+    if (m_frameCmdBufRecording[m_currentFrame]) {
+        // Drop the transitions recorded for the previous swapchain.
+        f->vkResetCommandBuffer(m_frameCmdBuf[m_currentFrame][0], 0);
+        m_frameCmdBufRecording[m_currentFrame] = false;
     }
+    m_imageBarriers.clear();
+    ensureFrameCmdBuf(m_currentFrame, 0);
 
-    VkColorSpaceKHR colorSpace = VkColorSpaceKHR(0);
-    uint32_t formatCount = 0;
-    vkGetPhysicalDeviceSurfaceFormatsKHR(m_vkPhysDev, m_surface, &formatCount, nullptr);
-    if (formatCount) {
-        QVector<VkSurfaceFormatKHR> formats(formatCount);
+    // The images start out undefined, the first beginFrame() for each
+    // transitions straight to the layout the frame needs.
+    for (uint32_t i = 0; i < m_swapChainBufferCount; ++i)
+        QVulkanImageBarrierBatch::reset(&m_swapChainImageTrack[i], m_swapChainImages[i], VK_IMAGE_ASPECT_COLOR_BIT);
+
+    VkResult err;
+    for (int i = 0; i < m_framesInFlight; ++i) {
+        if (m_frameFence[i] == VK_NULL_HANDLE) {
+            VkFenceCreateInfo fenceInfo = {
+                VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+                nullptr,
+                0
+            };
+            err = f->vkCreateFence(m_vkDev, &fenceInfo, nullptr, &m_frameFence[i]);
+            if (err != VK_SUCCESS)
+                qFatal("Failed to create fence: %d", err);
+        }
+        VkSemaphoreCreateInfo semInfo = {
+            VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+            nullptr,
+            0
+        };
+        // Nothing to acquire or present offscreen.
+        if (!m_offscreen && m_acquireSem[i] == VK_NULL_HANDLE) {
+            err = f->vkCreateSemaphore(m_vkDev, &semInfo, nullptr, &m_acquireSem[i]);
+            if (err != VK_SUCCESS)
+                qFatal("Failed to create acquire semaphore: %d", err);
+        }
+        if (!m_offscreen && m_renderSem[i] == VK_NULL_HANDLE) {
+            err = f->vkCreateSemaphore(m_vkDev, &semInfo, nullptr, &m_renderSem[i]);
+            if (err != VK_SUCCESS)
+                qFatal("Failed to create render semaphore: %d", err);
+        }
+        if (singleSubmit())
+            continue;
+        if (m_workerWaitSem[i] == VK_NULL_HANDLE) {
+            err = f->vkCreateSemaphore(m_vkDev, &semInfo, nullptr, &m_workerWaitSem[i]);
+            if (err != VK_SUCCESS)
+                qFatal("Failed to create worker wait semaphore: %d", err);
+        }
+        if (m_workerSignalSem[i] == VK_NULL_HANDLE) {
+            err = f->vkCreateSemaphore(m_vkDev, &semInfo, nullptr, &m_workerSignalSem[i]);
+            if (err != VK_SUCCESS)
+                qFatal("Failed to create worker signal semaphore: %d", err);
+        }
+    }
+
+    if (m_dsAlloc.memory != VK_NULL_HANDLE) {
+        DeferredRelease r(DeferredRelease::ImageView);
+        r.imageView = m_dsView;
+        releaseLater(r);
+        r.type = DeferredRelease::Image;
+        r.image = m_ds;
+        releaseLater(r);
+        r.type = DeferredRelease::Allocation;
+        r.allocation = m_dsAlloc;
+        releaseLater(r);
+    }
+
+    VkImageCreateInfo imgInfo;
+    memset(&imgInfo, 0, sizeof(imgInfo));
+    imgInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imgInfo.imageType = VK_IMAGE_TYPE_2D;
+    imgInfo.format = m_dsFormat;
+    imgInfo.extent.width = bufferSize.width;
+    imgInfo.extent.height = bufferSize.height;
+    imgInfo.extent.depth = 1;
+    imgInfo.mipLevels = 1;
+    imgInfo.arrayLayers = 1;
+    imgInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imgInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    imgInfo.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+    err = f->vkCreateImage(m_vkDev, &imgInfo, nullptr, &m_ds);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create depth-stencil buffer: %d", err);
+
+    VkMemoryRequirements dsMemReq;
+    f->vkGetImageMemoryRequirements(m_vkDev, m_ds, &dsMemReq);
+    if (Q_UNLIKELY(debug_render()))
+        qDebug("allocating %lu bytes for depth-stencil", dsMemReq.size);
+
+    m_dsAlloc = m_memAllocator->allocate(dsMemReq, 0, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VK_IMAGE_TILING_OPTIMAL);
+    if (m_dsAlloc.memory == VK_NULL_HANDLE)
+        qFatal("Failed to allocate depth-stencil memory");
+
+    err = f->vkBindImageMemory(m_vkDev, m_ds, m_dsAlloc.memory, m_dsAlloc.offset);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to bind image memory for depth-stencil: %d", err);
+
+    // Goes out together with the first frame's swapchain image transition.
+    QVulkanImageBarrierBatch::reset(&m_dsTrack, m_ds, VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT);
+    QVulkanImageState dsState;
+    dsState.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    dsState.access = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    dsState.stage = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    m_imageBarriers.transition(&m_dsTrack, dsState);
+
+    VkImageViewCreateInfo imgViewInfo;
+    memset(&imgViewInfo, 0, sizeof(imgViewInfo));
+    imgViewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    imgViewInfo.image = m_ds;
+    imgViewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    imgViewInfo.format = m_dsFormat;
+    imgViewInfo.components.r = VK_COMPONENT_SWIZZLE_R;
+    imgViewInfo.components.g = VK_COMPONENT_SWIZZLE_G;
+    imgViewInfo.components.b = VK_COMPONENT_SWIZZLE_B;
+    imgViewInfo.components.a = VK_COMPONENT_SWIZZLE_A;
+    imgViewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT;
+    imgViewInfo.subresourceRange.levelCount = imgViewInfo.subresourceRange.layerCount = 1;
+    err = f->vkCreateImageView(m_vkDev, &imgViewInfo, nullptr, &m_dsView);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create depth-stencil view: %d", err);
+}
+
+void QVulkanRenderLoopPrivate::createSwapChain(VkExtent2D *bufferSize)
+{
+    if (!vkCreateSwapchainKHR) {
+        vkCreateSwapchainKHR = reinterpret_cast<PFN_vkCreateSwapchainKHR>(f->vkGetDeviceProcAddr(m_vkDev, "vkCreateSwapchainKHR"));
+        vkDestroySwapchainKHR = reinterpret_cast<PFN_vkDestroySwapchainKHR>(f->vkGetDeviceProcAddr(m_vkDev, "vkDestroySwapchainKHR"));
+        vkGetSwapchainImagesKHR = reinterpret_cast<PFN_vkGetSwapchainImagesKHR>(f->vkGetDeviceProcAddr(m_vkDev, "vkGetSwapchainImagesKHR"));
+        vkAcquireNextImageKHR = reinterpret_cast<PFN_vkAcquireNextImageKHR>(f->vkGetDeviceProcAddr(m_vkDev, "vkAcquireNextImageKHR"));
+        vkQueuePresentKHR = reinterpret_cast<PFN_vkQueuePresentKHR>(f->vkGetDeviceProcAddr(m_vkDev, "vkQueuePresentKHR"));
+    }
+
+    VkColorSpaceKHR colorSpace = VkColorSpaceKHR(0);
+    uint32_t formatCount = 0;
+    vkGetPhysicalDeviceSurfaceFormatsKHR(m_vkPhysDev, m_surface, &formatCount, nullptr);
+    if (formatCount) {
+        QVector<VkSurfaceFormatKHR> formats(formatCount);
         vkGetPhysicalDeviceSurfaceFormatsKHR(m_vkPhysDev, m_surface, &formatCount, formats.data());
         if (formats[0].format != VK_FORMAT_UNDEFINED) {
             m_colorFormat = formats[0].format;
@@ -975,34 +2806,49 @@ void QVulkanRenderLoopPrivate::recreateSwapChain()
 
     VkSurfaceCapabilitiesKHR surfaceCaps;
     vkGetPhysicalDeviceSurfaceCapabilitiesKHR(m_vkPhysDev, m_surface, &surfaceCaps);
-    uint32_t reqBufferCount = !m_flags.testFlag(QVulkanRenderLoop::TrippleBuffer) ? 2 : 3;
+    uint32_t reqBufferCount = requestedBufferCount();
     if (surfaceCaps.maxImageCount)
         reqBufferCount = qBound(surfaceCaps.minImageCount, reqBufferCount, surfaceCaps.maxImageCount);
     Q_ASSERT(surfaceCaps.minImageCount <= MAX_SWAPCHAIN_BUFFERS);
     reqBufferCount = qMin<uint32_t>(reqBufferCount, MAX_SWAPCHAIN_BUFFERS);
 
-    VkExtent2D bufferSize = surfaceCaps.currentExtent;
-    if (bufferSize.width == uint32_t(-1))
-        bufferSize.width = m_windowSize.width();
-    if (bufferSize.height == uint32_t(-1))
-        bufferSize.height = m_windowSize.height();
+    *bufferSize = surfaceCaps.currentExtent;
+    if (bufferSize->width == uint32_t(-1))
+        bufferSize->width = m_windowSize.width();
+    if (bufferSize->height == uint32_t(-1))
+        bufferSize->height = m_windowSize.height();
 
     VkSurfaceTransformFlagBitsKHR preTransform = surfaceCaps.currentTransform;
     VkPresentModeKHR presentMode = VK_PRESENT_MODE_FIFO_KHR;
 
-    if (m_flags.testFlag(QVulkanRenderLoop::Unthrottled)) {
-        uint32_t presModeCount = 0;
-        vkGetPhysicalDeviceSurfacePresentModesKHR(m_vkPhysDev, m_surface, &presModeCount, nullptr);
-        if (presModeCount > 0) {
-            QVector<VkPresentModeKHR> presModes(presModeCount);
-            if (vkGetPhysicalDeviceSurfacePresentModesKHR(m_vkPhysDev, m_surface, &presModeCount, presModes.data()) == VK_SUCCESS) {
-                if (presModes.contains(VK_PRESENT_MODE_MAILBOX_KHR))
-                    presentMode = VK_PRESENT_MODE_MAILBOX_KHR;
-                else if (presModes.contains(VK_PRESENT_MODE_IMMEDIATE_KHR))
-                    presentMode = VK_PRESENT_MODE_IMMEDIATE_KHR;
-            }
-        }
+    uint32_t presModeCount = 0;
+    vkGetPhysicalDeviceSurfacePresentModesKHR(m_vkPhysDev, m_surface, &presModeCount, nullptr);
+    QVector<VkPresentModeKHR> presModes(presModeCount);
+    if (presModeCount > 0
+            && vkGetPhysicalDeviceSurfacePresentModesKHR(m_vkPhysDev, m_surface, &presModeCount, presModes.data()) != VK_SUCCESS)
+        presModes.clear();
+
+    m_configMutex.lock();
+    if (m_requestedPresentMode >= 0) {
+        if (presModes.contains(VkPresentModeKHR(m_requestedPresentMode)))
+            presentMode = VkPresentModeKHR(m_requestedPresentMode);
+        else
+            qWarning("Present mode %d is not supported, using FIFO", m_requestedPresentMode);
+    } else if (m_flags.testFlag(QVulkanRenderLoop::Unthrottled)) {
+        if (presModes.contains(VK_PRESENT_MODE_MAILBOX_KHR))
+            presentMode = VK_PRESENT_MODE_MAILBOX_KHR;
+        else if (presModes.contains(VK_PRESENT_MODE_IMMEDIATE_KHR))
+            presentMode = VK_PRESENT_MODE_IMMEDIATE_KHR;
     }
+    m_presentMode = presentMode;
+    m_supportedPresentModes = presModes;
+    m_configMutex.unlock();
+
+    // Frames using the current swapchain may still be in flight. Instead of
+    // draining the device, wait only for the slot we are about to record the
+    // initial transitions into, and retire everything else via the deferred
+    // release queue that is processed as the other slots' fences signal.
+    waitFrameFence(m_currentFrame);
 
     VkSwapchainKHR oldSwapChain = m_swapChain;
     VkSwapchainCreateInfoKHR swapChainInfo;
@@ -1012,9 +2858,14 @@ void QVulkanRenderLoopPrivate::recreateSwapChain()
     swapChainInfo.minImageCount = reqBufferCount;
     swapChainInfo.imageFormat = m_colorFormat;
     swapChainInfo.imageColorSpace = colorSpace;
-    swapChainInfo.imageExtent = bufferSize;
+    swapChainInfo.imageExtent = *bufferSize;
     swapChainInfo.imageArrayLayers = 1;
     swapChainInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+    if (!m_worker) // for the clear
+        swapChainInfo.imageUsage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    m_readbackSupported = surfaceCaps.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    if (m_readbackSupported)
+        swapChainInfo.imageUsage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
     swapChainInfo.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
     swapChainInfo.preTransform = preTransform;
     swapChainInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
@@ -1023,16 +2874,22 @@ void QVulkanRenderLoopPrivate::recreateSwapChain()
     swapChainInfo.oldSwapchain = oldSwapChain;
 
     if (Q_UNLIKELY(debug_render()))
-        qDebug("creating new swap chain of %d buffers, size %dx%d", reqBufferCount, bufferSize.width, bufferSize.height);
+        qDebug("creating new swap chain of %d buffers, size %dx%d, present mode %d",
+               reqBufferCount, bufferSize->width, bufferSize->height, presentMode);
 
     VkResult err = vkCreateSwapchainKHR(m_vkDev, &swapChainInfo, nullptr, &m_swapChain);
     if (err != VK_SUCCESS)
         qFatal("Failed to create swap chain: %d", err);
 
     if (oldSwapChain != VK_NULL_HANDLE) {
-        for (uint32_t i = 0; i < m_swapChainBufferCount; ++i)
-            f->vkDestroyImageView(m_vkDev, m_swapChainImageViews[i], nullptr);
-        vkDestroySwapchainKHR(m_vkDev, oldSwapChain, nullptr);
+        for (uint32_t i = 0; i < m_swapChainBufferCount; ++i) {
+            DeferredRelease r(DeferredRelease::ImageView);
+            r.imageView = m_swapChainImageViews[i];
+            releaseLater(r);
+        }
+        DeferredRelease r(DeferredRelease::SwapChain);
+        r.swapChain = oldSwapChain;
+        releaseLater(r);
     }
 
     m_swapChainBufferCount = 0;
@@ -1064,144 +2921,158 @@ void QVulkanRenderLoopPrivate::recreateSwapChain()
         if (err != VK_SUCCESS)
             qFatal("Failed to create swapchain image view %d: %d", i, err);
     }
+}
 
-    m_currentSwapChainBuffer = 0;
-    m_currentFrame = 0;
+uint32_t QVulkanRenderLoopPrivate::requestedBufferCount() const
+{
+    QMutexLocker lock(&m_configMutex);
+    if (m_requestedBufferCount)
+        return m_requestedBufferCount;
+    return !m_flags.testFlag(QVulkanRenderLoop::TrippleBuffer) ? 2 : 3;
+}
 
-    m_frameActive = false;
-    m_frameCmdBufRecording[m_currentFrame] = false;
-    ensureFrameCmdBuf(m_currentFrame, 0);
+// Frame slots are picked round-robin, so a different count means nothing
+// may be in flight anymore. Called between frames, before the swapchain is
+// recreated.
+void QVulkanRenderLoopPrivate::applyFramesInFlight()
+{
+    m_configMutex.lock();
+    const int frameCount = m_requestedFramesInFlight;
+    m_requestedFramesInFlight = 0;
+    m_configMutex.unlock();
+    if (!frameCount || frameCount == m_framesInFlight)
+        return;
 
-    for (uint32_t i = 0; i < m_swapChainBufferCount; ++i) {
-        transitionImage(m_frameCmdBuf[m_currentFrame][0], m_swapChainImages[i],
-                        VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
-                        0, 0);
-    }
+    if (Q_UNLIKELY(debug_render()))
+        qDebug("changing frames in flight from %d to %d", m_framesInFlight, frameCount);
 
-    for (int i = 0; i < m_framesInFlight; ++i) {
-        m_frameFenceActive[i] = false;
-        if (m_frameFence[i] == VK_NULL_HANDLE) {
-            VkFenceCreateInfo fenceInfo = {
-                VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-                nullptr,
-                0
-            };
-            err = f->vkCreateFence(m_vkDev, &fenceInfo, nullptr, &m_frameFence[i]);
-            if (err != VK_SUCCESS)
-                qFatal("Failed to create fence: %d", err);
-        } else {
-            f->vkResetFences(m_vkDev, 1, &m_frameFence[i]);
-        }
-        VkSemaphoreCreateInfo semInfo = {
-            VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
-            nullptr,
-            0
-        };
-        if (m_acquireSem[i] == VK_NULL_HANDLE) {
-            err = f->vkCreateSemaphore(m_vkDev, &semInfo, nullptr, &m_acquireSem[i]);
-            if (err != VK_SUCCESS)
-                qFatal("Failed to create acquire semaphore: %d", err);
-        }
-        if (m_renderSem[i] == VK_NULL_HANDLE) {
-            err = f->vkCreateSemaphore(m_vkDev, &semInfo, nullptr, &m_renderSem[i]);
-            if (err != VK_SUCCESS)
-                qFatal("Failed to create render semaphore: %d", err);
-        }
-        if (m_workerWaitSem[i] == VK_NULL_HANDLE) {
-            err = f->vkCreateSemaphore(m_vkDev, &semInfo, nullptr, &m_workerWaitSem[i]);
-            if (err != VK_SUCCESS)
-                qFatal("Failed to create worker wait semaphore: %d", err);
-        }
-        if (m_workerSignalSem[i] == VK_NULL_HANDLE) {
-            err = f->vkCreateSemaphore(m_vkDev, &semInfo, nullptr, &m_workerSignalSem[i]);
-            if (err != VK_SUCCESS)
-                qFatal("Failed to create worker signal semaphore: %d", err);
-        }
+    // The frame fences cover everything submitted on the graphics queue
+    // before them. The other queues are left running.
+    for (int i = 0; i < m_framesInFlight; ++i)
+        waitFrameFence(i);
+    drainDeferredReleases();
+
+    if (m_frameCmdBufRecording[m_currentFrame]) {
+        f->vkResetCommandBuffer(m_frameCmdBuf[m_currentFrame][0], 0);
+        m_frameCmdBufRecording[m_currentFrame] = false;
     }
+    m_currentFrame = 0;
+    m_framesInFlight = frameCount;
 
-    if (m_dsMem != VK_NULL_HANDLE) {
-        f->vkDestroyImageView(m_vkDev, m_dsView, nullptr);
-        f->vkDestroyImage(m_vkDev, m_ds, nullptr);
-        f->vkFreeMemory(m_vkDev, m_dsMem, nullptr);
+    // Fences and semaphores of unused slots stay around, missing ones get
+    // created by recreateSwapChain().
+    if (m_framesInFlight > m_dynamicFrameCount) {
+        releaseDynamicBuffer();
+        createDynamicBuffer();
     }
+}
 
-    VkImageCreateInfo imgInfo;
-    memset(&imgInfo, 0, sizeof(imgInfo));
-    imgInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-    imgInfo.imageType = VK_IMAGE_TYPE_2D;
-    imgInfo.format = m_dsFormat;
-    imgInfo.extent.width = bufferSize.width;
-    imgInfo.extent.height = bufferSize.height;
-    imgInfo.extent.depth = 1;
-    imgInfo.mipLevels = 1;
-    imgInfo.arrayLayers = 1;
-    imgInfo.samples = VK_SAMPLE_COUNT_1_BIT;
-    imgInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
-    imgInfo.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
-    err = f->vkCreateImage(m_vkDev, &imgInfo, nullptr, &m_ds);
-    if (err != VK_SUCCESS)
-        qFatal("Failed to create depth-stencil buffer: %d", err);
+void QVulkanRenderLoopPrivate::createOffscreenImages(VkExtent2D *bufferSize)
+{
+    bufferSize->width = m_windowSize.width();
+    bufferSize->height = m_windowSize.height();
 
-    VkMemoryRequirements dsMemReq;
-    f->vkGetImageMemoryRequirements(m_vkDev, m_ds, &dsMemReq);
-    uint memTypeIndex = 0;
-    if (dsMemReq.memoryTypeBits)
-        memTypeIndex = qCountTrailingZeroBits(dsMemReq.memoryTypeBits);
-
-    VkMemoryAllocateInfo memInfo;
-    memset(&memInfo, 0, sizeof(memInfo));
-    memInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    memInfo.allocationSize = dsMemReq.size;
-    memInfo.memoryTypeIndex = memTypeIndex;
+    // Guaranteed to be supported as a color attachment.
+    m_colorFormat = VK_FORMAT_R8G8B8A8_UNORM;
+    m_readbackSupported = true;
+
+    // Same as for a swapchain, see recreateSwapChain().
+    waitFrameFence(m_currentFrame);
+
+    for (uint32_t i = 0; i < m_swapChainBufferCount; ++i) {
+        DeferredRelease r(DeferredRelease::ImageView);
+        r.imageView = m_swapChainImageViews[i];
+        releaseLater(r);
+        r.type = DeferredRelease::Image;
+        r.image = m_swapChainImages[i];
+        releaseLater(r);
+        r.type = DeferredRelease::Allocation;
+        r.allocation = m_offscreenAlloc[i];
+        releaseLater(r);
+    }
+
+    m_swapChainBufferCount = requestedBufferCount();
     if (Q_UNLIKELY(debug_render()))
-        qDebug("allocating %lu bytes for depth-stencil", memInfo.allocationSize);
+        qDebug("creating %d offscreen images, size %dx%d", m_swapChainBufferCount, bufferSize->width, bufferSize->height);
 
-    err = f->vkAllocateMemory(m_vkDev, &memInfo, nullptr, &m_dsMem);
-    if (err != VK_SUCCESS)
-        qFatal("Failed to allocate depth-stencil memory: %d", err);
+    for (uint32_t i = 0; i < m_swapChainBufferCount; ++i) {
+        VkImageCreateInfo imgInfo;
+        memset(&imgInfo, 0, sizeof(imgInfo));
+        imgInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        imgInfo.imageType = VK_IMAGE_TYPE_2D;
+        imgInfo.format = m_colorFormat;
+        imgInfo.extent.width = bufferSize->width;
+        imgInfo.extent.height = bufferSize->height;
+        imgInfo.extent.depth = 1;
+        imgInfo.mipLevels = 1;
+        imgInfo.arrayLayers = 1;
+        imgInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+        imgInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+        imgInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+        VkResult err = f->vkCreateImage(m_vkDev, &imgInfo, nullptr, &m_swapChainImages[i]);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to create offscreen image %d: %d", i, err);
 
-    err = f->vkBindImageMemory(m_vkDev, m_ds, m_dsMem, 0);
-    if (err != VK_SUCCESS)
-        qFatal("Failed to bind image memory for depth-stencil: %d", err);
+        VkMemoryRequirements memReq;
+        f->vkGetImageMemoryRequirements(m_vkDev, m_swapChainImages[i], &memReq);
+        m_offscreenAlloc[i] = m_memAllocator->allocate(memReq, 0, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VK_IMAGE_TILING_OPTIMAL);
+        if (m_offscreenAlloc[i].memory == VK_NULL_HANDLE)
+            qFatal("Failed to allocate offscreen image memory");
 
-    transitionImage(m_frameCmdBuf[m_currentFrame][0], m_ds,
-                    VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
-                    0, VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, true);
+        err = f->vkBindImageMemory(m_vkDev, m_swapChainImages[i], m_offscreenAlloc[i].memory, m_offscreenAlloc[i].offset);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to bind offscreen image memory: %d", err);
 
-    VkImageViewCreateInfo imgViewInfo;
-    memset(&imgViewInfo, 0, sizeof(imgViewInfo));
-    imgViewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-    imgViewInfo.image = m_ds;
-    imgViewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
-    imgViewInfo.format = m_dsFormat;
-    imgViewInfo.components.r = VK_COMPONENT_SWIZZLE_R;
-    imgViewInfo.components.g = VK_COMPONENT_SWIZZLE_G;
-    imgViewInfo.components.b = VK_COMPONENT_SWIZZLE_B;
-    imgViewInfo.components.a = VK_COMPONENT_SWIZZLE_A;
-    imgViewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT;
-    imgViewInfo.subresourceRange.levelCount = imgViewInfo.subresourceRange.layerCount = 1;
-    err = f->vkCreateImageView(m_vkDev, &imgViewInfo, nullptr, &m_dsView);
-    if (err != VK_SUCCESS)
-        qFatal("Failed to create depth-stencil view: %d", err);
+        VkImageViewCreateInfo imgViewInfo;
+        memset(&imgViewInfo, 0, sizeof(imgViewInfo));
+        imgViewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        imgViewInfo.image = m_swapChainImages[i];
+        imgViewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        imgViewInfo.format = m_colorFormat;
+        imgViewInfo.components.r = VK_COMPONENT_SWIZZLE_R;
+        imgViewInfo.components.g = VK_COMPONENT_SWIZZLE_G;
+        imgViewInfo.components.b = VK_COMPONENT_SWIZZLE_B;
+        imgViewInfo.components.a = VK_COMPONENT_SWIZZLE_A;
+        imgViewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        imgViewInfo.subresourceRange.levelCount = imgViewInfo.subresourceRange.layerCount = 1;
+        err = f->vkCreateImageView(m_vkDev, &imgViewInfo, nullptr, &m_swapChainImageViews[i]);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to create offscreen image view %d: %d", i, err);
+    }
+
+    m_offscreenNextImage = 0;
 }
 
 void QVulkanRenderLoopPrivate::ensureFrameCmdBuf(int frame, int subIndex)
 {
-    if (m_frameCmdBuf[frame][subIndex] != VK_NULL_HANDLE) {
-        if (m_frameCmdBufRecording[frame])
-            return;
-        f->vkFreeCommandBuffers(m_vkDev, m_vkCmdPool, 1, &m_frameCmdBuf[frame][subIndex]);
-    }
+    if (m_frameCmdBufRecording[frame])
+        return;
 
-    VkCommandBufferAllocateInfo cmdBufInfo = {
-        VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, nullptr, m_vkCmdPool, VK_COMMAND_BUFFER_LEVEL_PRIMARY, 1
-    };
-    VkResult err = f->vkAllocateCommandBuffers(m_vkDev, &cmdBufInfo, &m_frameCmdBuf[frame][subIndex]);
-    if (err != VK_SUCCESS)
-        qFatal("Failed to allocate frame command buffer: %d", err);
+    VkResult err;
+    if (m_frameCmdPool[frame] == VK_NULL_HANDLE) {
+        VkCommandPoolCreateInfo poolInfo;
+        memset(&poolInfo, 0, sizeof(poolInfo));
+        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+        poolInfo.queueFamilyIndex = m_gfxQueueFamilyIdx;
+        err = f->vkCreateCommandPool(m_vkDev, &poolInfo, nullptr, &m_frameCmdPool[frame]);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to create frame command pool: %d", err);
+
+        // Allocate both the prologue and the epilogue buffer up front. These
+        // live as long as the pool and get recycled via vkResetCommandPool.
+        VkCommandBufferAllocateInfo cmdBufInfo = {
+            VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, nullptr, m_frameCmdPool[frame], VK_COMMAND_BUFFER_LEVEL_PRIMARY, 2
+        };
+        err = f->vkAllocateCommandBuffers(m_vkDev, &cmdBufInfo, m_frameCmdBuf[frame]);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to allocate frame command buffers: %d", err);
+
+        m_cmdBufAllocCount.fetchAndAddRelaxed(2);
+    }
 
     VkCommandBufferBeginInfo cmdBufBeginInfo = {
-        VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, nullptr, 0, nullptr };
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, nullptr, VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT, nullptr };
     err = f->vkBeginCommandBuffer(m_frameCmdBuf[frame][subIndex], &cmdBufBeginInfo);
     if (err != VK_SUCCESS)
         qFatal("Failed to begin frame command buffer: %d", err);
@@ -1209,72 +3080,410 @@ void QVulkanRenderLoopPrivate::ensureFrameCmdBuf(int frame, int subIndex)
     m_frameCmdBufRecording[frame] = true;
 }
 
-QElapsedTimer t;
+QVulkanRenderLoopPrivate::ThreadCmdPool *QVulkanRenderLoopPrivate::threadCmdPool(QVector<ThreadCmdPool> *pools, int index)
+{
+    while (pools->count() <= index) {
+        VkCommandPoolCreateInfo poolInfo;
+        memset(&poolInfo, 0, sizeof(poolInfo));
+        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+        poolInfo.queueFamilyIndex = m_gfxQueueFamilyIdx;
+        ThreadCmdPool p;
+        VkResult err = f->vkCreateCommandPool(m_vkDev, &poolInfo, nullptr, &p.pool);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to create thread command pool: %d", err);
+        p.secondariesUsed = 0;
+        pools->append(p);
+    }
+    return &(*pools)[index];
+}
+
+void QVulkanRenderLoopPrivate::resetThreadCmdPools(int frame)
+{
+    QMutexLocker lock(&m_threadCmdPoolMutex);
+    for (const ThreadCmdPool &p : qAsConst(m_threadCmdPools[frame]))
+        f->vkResetCommandPool(m_vkDev, p.pool, 0);
+    for (ThreadCmdPool &p : m_parallelCmdPools[frame]) {
+        f->vkResetCommandPool(m_vkDev, p.pool, 0);
+        p.secondariesUsed = 0;
+    }
+}
+
+void QVulkanRenderLoopPrivate::releaseThreadCmdPools(int frame)
+{
+    QMutexLocker lock(&m_threadCmdPoolMutex);
+    for (const ThreadCmdPool &p : qAsConst(m_threadCmdPools[frame]))
+        f->vkDestroyCommandPool(m_vkDev, p.pool, nullptr);
+    for (const ThreadCmdPool &p : qAsConst(m_parallelCmdPools[frame]))
+        f->vkDestroyCommandPool(m_vkDev, p.pool, nullptr);
+    m_threadCmdPools[frame].clear();
+    m_parallelCmdPools[frame].clear();
+}
+
+class QVulkanRecordTask : public QRunnable
+{
+public:
+    QVulkanRecordTask(QVulkanFunctions *f, VkCommandBuffer cb, const VkCommandBufferInheritanceInfo &inheritance,
+                      int index, const QVulkanSecondaryRecorder &recorder, QSemaphore *done)
+        : f(f), m_cb(cb), m_inheritance(inheritance), m_index(index), m_recorder(recorder), m_done(done) { }
+
+    void run() override
+    {
+        QVK_TRACE_SCOPE("record secondary");
+        VkCommandBufferBeginInfo cmdBufBeginInfo = {
+            VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, nullptr,
+            VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT,
+            &m_inheritance };
+        VkResult err = f->vkBeginCommandBuffer(m_cb, &cmdBufBeginInfo);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to begin secondary command buffer: %d", err);
+        m_recorder(m_cb, m_index);
+        err = f->vkEndCommandBuffer(m_cb);
+        if (err != VK_SUCCESS)
+            qWarning("Failed to end secondary command buffer: %d", err);
+        if (m_done)
+            m_done->release();
+    }
+
+private:
+    QVulkanFunctions *f;
+    VkCommandBuffer m_cb;
+    VkCommandBufferInheritanceInfo m_inheritance;
+    int m_index;
+    const QVulkanSecondaryRecorder &m_recorder; // the caller waits for all tasks
+    QSemaphore *m_done;
+};
+
+// Each chunk gets a pool of its own, so the threads never share one. Not to
+// be called from more than one thread at a time.
+void QVulkanRenderLoopPrivate::recordParallel(VkCommandBuffer primary, const VkCommandBufferInheritanceInfo &inheritance,
+                                              int count, const QVulkanSecondaryRecorder &recorder)
+{
+    if (count <= 0)
+        return;
+
+    QVK_TRACE_SCOPE("recordParallel");
+    QVarLengthArray<VkCommandBuffer, 16> cbs;
+    m_threadCmdPoolMutex.lock();
+    for (int i = 0; i < count; ++i) {
+        ThreadCmdPool *p = threadCmdPool(&m_parallelCmdPools[m_currentFrame], i);
+        if (p->secondariesUsed == p->secondaries.count()) {
+            VkCommandBufferAllocateInfo cmdBufInfo = {
+                VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, nullptr, p->pool, VK_COMMAND_BUFFER_LEVEL_SECONDARY, 1
+            };
+            VkCommandBuffer cb;
+            VkResult err = f->vkAllocateCommandBuffers(m_vkDev, &cmdBufInfo, &cb);
+            if (err != VK_SUCCESS)
+                qFatal("Failed to allocate secondary command buffer: %d", err);
+            m_cmdBufAllocCount.fetchAndAddRelaxed(1);
+            p->secondaries.append(cb);
+        }
+        cbs.append(p->secondaries[p->secondariesUsed++]);
+    }
+    m_threadCmdPoolMutex.unlock();
+
+    QSemaphore done;
+    for (int i = 1; i < count; ++i)
+        m_recordPool.start(new QVulkanRecordTask(f, cbs[i], inheritance, i, recorder, &done));
+    QVulkanRecordTask(f, cbs[0], inheritance, 0, recorder, nullptr).run();
+    done.acquire(count - 1);
+
+    f->vkCmdExecuteCommands(primary, count, cbs.constData());
+}
+
+void QVulkanRenderLoopPrivate::waitFrameFence(int frame)
+{
+    if (m_frameFenceActive[frame]) {
+        if (Q_UNLIKELY(debug_render()))
+            qDebug("wait fence %p", m_frameFence[frame]);
+        QVulkanTracer::begin("fence wait");
+        f->vkWaitForFences(m_vkDev, 1, &m_frameFence[frame], true, UINT64_MAX);
+        QVulkanTracer::end("fence wait");
+        f->vkResetFences(m_vkDev, 1, &m_frameFence[frame]);
+        m_frameFenceActive[frame] = false;
+
+        if (m_queriesPending[frame])
+            readTimestamps(frame);
+
+        deliverReadbacks(frame);
+
+        // All command buffers of this slot have completed, recycle them in one go.
+        if (!m_frameCmdBufRecording[frame])
+            f->vkResetCommandPool(m_vkDev, m_frameCmdPool[frame], 0);
+        resetThreadCmdPools(frame);
+    }
+
+    // Nothing submitted for this slot is pending anymore. Release whatever
+    // was only waiting for it.
+    const uint bit = 1 << frame;
+    m_deferredReleaseMutex.lock();
+    for (int i = 0; i < m_deferredReleaseQueue.count(); ) {
+        DeferredRelease &r(m_deferredReleaseQueue[i]);
+        r.frameMask &= ~bit;
+        if (!r.frameMask) {
+            releaseNow(r);
+            m_deferredReleaseQueue.removeAt(i);
+        } else {
+            ++i;
+        }
+    }
+    m_deferredReleaseMutex.unlock();
+}
+
+void QVulkanRenderLoopPrivate::releaseLater(DeferredRelease r)
+{
+    // The object may be referenced by the current frame and by any other
+    // frame that is still in flight, so wait for a full round of fences.
+    r.frameMask = (1 << m_framesInFlight) - 1;
+    m_deferredReleaseMutex.lock();
+    m_deferredReleaseQueue.append(r);
+    m_deferredReleaseMutex.unlock();
+}
+
+void QVulkanRenderLoopPrivate::drainDeferredReleases()
+{
+    m_deferredReleaseMutex.lock();
+    for (const DeferredRelease &r : qAsConst(m_deferredReleaseQueue))
+        releaseNow(r);
+    m_deferredReleaseQueue.clear();
+    m_deferredReleaseMutex.unlock();
+}
+
+void QVulkanRenderLoopPrivate::releaseNow(const DeferredRelease &r)
+{
+    switch (r.type) {
+    case DeferredRelease::SwapChain:
+        vkDestroySwapchainKHR(m_vkDev, r.swapChain, nullptr);
+        break;
+    case DeferredRelease::ImageView:
+        f->vkDestroyImageView(m_vkDev, r.imageView, nullptr);
+        break;
+    case DeferredRelease::Image:
+        f->vkDestroyImage(m_vkDev, r.image, nullptr);
+        break;
+    case DeferredRelease::Memory:
+        f->vkFreeMemory(m_vkDev, r.memory, nullptr);
+        break;
+    case DeferredRelease::Buffer:
+        f->vkDestroyBuffer(m_vkDev, r.buffer, nullptr);
+        break;
+    case DeferredRelease::Framebuffer:
+        f->vkDestroyFramebuffer(m_vkDev, r.framebuffer, nullptr);
+        break;
+    case DeferredRelease::CommandBuffer:
+        f->vkFreeCommandBuffers(m_vkDev, r.commandBuffer.pool, 1, &r.commandBuffer.cb);
+        break;
+    case DeferredRelease::DescriptorSet:
+        f->vkFreeDescriptorSets(m_vkDev, r.descriptorSet.pool, 1, &r.descriptorSet.set);
+        break;
+    case DeferredRelease::Allocation:
+        m_memAllocator->free(r.allocation);
+        break;
+    }
+}
+
 
 bool QVulkanRenderLoopPrivate::beginFrame()
 {
     Q_ASSERT(!m_frameActive);
     m_frameActive = true;
+    QVK_TRACE_SCOPE("beginFrame");
+
+    const qint64 frameStart = m_frameClock.nsecsElapsed();
+    memset(&m_frameTimings, 0, sizeof(m_frameTimings));
+    m_frameTimings.frameNumber = m_frameNumber;
+    m_frameTimings.frameInterval = m_lastFrameStart >= 0 ? frameStart - m_lastFrameStart : 0;
+    m_lastFrameStart = frameStart;
+
+    waitFrameFence(m_currentFrame);
+    m_frameTimings.gpuFrameTime = m_gpuFrameTime;
+
+    // Hand out the readbacks of newer slots that happen to be done already,
+    // oldest first to keep them in order.
+    for (int i = 1; i < m_framesInFlight; ++i) {
+        const int frame = (m_currentFrame + i) % m_framesInFlight;
+        if (!m_readbacksPending[frame])
+            continue;
+        if (f->vkGetFenceStatus(m_vkDev, m_frameFence[frame]) != VK_SUCCESS)
+            break;
+        deliverReadbacks(frame);
+    }
 
-    if (m_frameFenceActive[m_currentFrame]) {
-        if (Q_UNLIKELY(debug_render()))
-            qDebug("wait fence %p", m_frameFence[m_currentFrame]);
-        f->vkWaitForFences(m_vkDev, 1, &m_frameFence[m_currentFrame], true, UINT64_MAX);
-        f->vkResetFences(m_vkDev, 1, &m_frameFence[m_currentFrame]);
+    const qint64 prepareStart = m_frameClock.nsecsElapsed();
+    m_frameTimings.fenceWaitTime = prepareStart - frameStart;
+
+    // This slot's part of the dynamic buffer is not read by the GPU anymore.
+    m_dynamicBase = m_currentFrame * m_dynamicFrameSize;
+    m_dynamicUsed.store(0);
+    m_dynamicFlushed = 0;
+
+    ensureFrameCmdBuf(m_currentFrame, 0);
+
+    if (m_gpuTimestamps) {
+        VkCommandBuffer cb = m_frameCmdBuf[m_currentFrame][0];
+        f->vkCmdResetQueryPool(cb, m_queryPool[m_currentFrame], 0, 2 + 2 * MAX_GPU_RANGES);
+        f->vkCmdWriteTimestamp(cb, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, m_queryPool[m_currentFrame], 0);
+        m_gpuRangeCount[m_currentFrame].store(0);
+        m_queriesPending[m_currentFrame] = true;
+    }
+
+    // Everything but the swapchain image is available, so the worker can
+    // get going while the acquire below blocks.
+    if (m_worker) {
+        QVulkanTracer::begin("prepareFrame");
+        m_worker->prepareFrame(m_currentFrame);
+        QVulkanTracer::end("prepareFrame");
     }
 
-    VkResult err = vkAcquireNextImageKHR(m_vkDev, m_swapChain, UINT64_MAX,
-                                         m_acquireSem[m_currentFrame], VK_NULL_HANDLE,
-                                         &m_currentSwapChainBuffer);
+    const qint64 acquireStart = m_frameClock.nsecsElapsed();
+    m_frameTimings.prepareFrameTime = acquireStart - prepareStart;
+
+    QVulkanTracer::begin("acquire");
+    VkResult err = VK_SUCCESS;
+    if (m_offscreen) {
+        m_currentSwapChainBuffer = m_offscreenNextImage;
+        m_offscreenNextImage = (m_offscreenNextImage + 1) % m_swapChainBufferCount;
+    } else {
+        err = vkAcquireNextImageKHR(m_vkDev, m_swapChain, UINT64_MAX,
+                                    m_acquireSem[m_currentFrame], VK_NULL_HANDLE,
+                                    &m_currentSwapChainBuffer);
+    }
+    QVulkanTracer::end("acquire");
+    const qint64 acquireEnd = m_frameClock.nsecsElapsed();
+    m_frameTimings.acquireTime = acquireEnd - acquireStart;
+    // Blocking here means waiting for the vertical blank that hands the
+    // image back, which is when the frame presented after it got shown.
+    if (!m_offscreen) {
+        qint64 shownFrameStart = -1;
+        if (err == VK_SUCCESS || err == VK_SUBOPTIMAL_KHR) {
+            shownFrameStart = m_nextFrameStart[m_currentSwapChainBuffer];
+            m_nextFrameStart[m_currentSwapChainBuffer] = -1;
+        }
+        if (m_frameTimings.acquireTime > VBLANK_WAIT_THRESHOLD)
+            vblankObserved(acquireEnd, shownFrameStart);
+    }
     if (err != VK_SUCCESS) {
+        // Suboptimal is fine, this is what we get when presenting the old
+        // swapchain while a resize is pending.
         if (err == VK_ERROR_OUT_OF_DATE_KHR) {
             qWarning("out of date in acquire");
-            f->vkDeviceWaitIdle(m_vkDev);
-            recreateSwapChain();
+            m_thread->setResizePending(true);
+            abandonFrame();
             return false;
         } else if (err != VK_SUBOPTIMAL_KHR) {
             qWarning("Failed to acquire next swapchain image: %d", err);
+            abandonFrame();
             return false;
         }
     }
 
     if (Q_UNLIKELY(debug_render()))
         qDebug("current swapchain buffer is %d, current frame is %d, elapsed since last %lld ms",
-               m_currentSwapChainBuffer, m_currentFrame, t.restart());
+               m_currentSwapChainBuffer, m_currentFrame, m_frameTimings.frameInterval / 1000000);
 
     m_frameFenceActive[m_currentFrame] = true;
-    ensureFrameCmdBuf(m_currentFrame, 0);
 
-    transitionImage(m_frameCmdBuf[m_currentFrame][0], m_swapChainImages[m_currentSwapChainBuffer],
-                    VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-                    0, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT);
+    // Not before the acquire, the barriers must not get dropped with an
+    // abandoned frame.
+    m_uploader->recordAcquire(m_frameCmdBuf[m_currentFrame][0]);
+
+    // The acquire semaphore is waited for at m_acquireWaitStage, so that is
+    // where the transition can start. Without a worker the image is cleared
+    // with a transfer, otherwise it is used as a color attachment. Offscreen
+    // images have no semaphore, their tracked state from the previous use
+    // orders the transition after it.
+    QVulkanImageBarrierBatch::Image *img = &m_swapChainImageTrack[m_currentSwapChainBuffer];
+    if (!m_offscreen) {
+        QVulkanImageState acquired;
+        acquired.layout = img->state.layout;
+        acquired.access = 0;
+        acquired.stage = m_acquireWaitStage;
+        QVulkanImageBarrierBatch::setState(img, acquired);
+    }
 
-    if (m_worker)
-        submitFrameCmdBuf(m_acquireSem[m_currentFrame], m_workerWaitSem[m_currentFrame], 0, false);
+    // With SingleSubmit the worker's render pass takes it from here. Except
+    // offscreen, where its external dependency would not cover the previous
+    // frame's transfer stage use of the image.
+    if (singleSubmit() && !m_offscreen) {
+        m_imageBarriers.record(f, m_frameCmdBuf[m_currentFrame][0]);
+        return true;
+    }
+
+    QVulkanImageState state;
+    if (m_worker) {
+        state.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+        state.access = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+        state.stage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    } else {
+        state.layout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        state.access = VK_ACCESS_TRANSFER_WRITE_BIT;
+        state.stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    }
+    m_imageBarriers.transition(img, state);
+    m_imageBarriers.record(f, m_frameCmdBuf[m_currentFrame][0]);
+
+    if (m_worker && !singleSubmit())
+        submitFrameCmdBuf(m_acquireSem[m_currentFrame], m_acquireWaitStage, m_workerWaitSem[m_currentFrame], 0, false);
 
     return true;
 }
 
-void QVulkanRenderLoopPrivate::submitFrameCmdBuf(VkSemaphore waitSem, VkSemaphore signalSem, int subIndex, bool fence)
+// Drops what was recorded for the current slot without an image. The next
+// attempt calls prepareFrame() again.
+void QVulkanRenderLoopPrivate::abandonFrame()
 {
+    m_frameActive = false;
+    f->vkResetCommandBuffer(m_frameCmdBuf[m_currentFrame][0], 0);
+    m_frameCmdBufRecording[m_currentFrame] = false;
+    m_queriesPending[m_currentFrame] = false;
+    resetThreadCmdPools(m_currentFrame);
+}
+
+void QVulkanRenderLoopPrivate::submitFrameCmdBuf(VkSemaphore waitSem, VkPipelineStageFlags waitStage, VkSemaphore signalSem,
+                                                 int subIndex, bool fence)
+{
+    QVK_TRACE_SCOPE("submit");
     VkResult err = f->vkEndCommandBuffer(m_frameCmdBuf[m_currentFrame][subIndex]);
     if (err != VK_SUCCESS)
         qFatal("Failed to end frame command buffer: %d", err);
 
     m_frameCmdBufRecording[m_currentFrame] = false;
 
+    // Either can be null in offscreen mode.
+    QVarLengthArray<VkSemaphore, 4> waitSems;
+    QVarLengthArray<VkPipelineStageFlags, 4> waitStages;
+    QVarLengthArray<VkSemaphore, 4> signalSems;
+    if (waitSem != VK_NULL_HANDLE) {
+        waitSems.append(waitSem);
+        waitStages.append(waitStage);
+    }
+    if (signalSem != VK_NULL_HANDLE)
+        signalSems.append(signalSem);
+
+    // The fenced submission ends the frame, that is where the ones added via
+    // waitSemaphoreInFrame() and signalSemaphoreInFrame() go.
+    if (fence) {
+        QMutexLocker lock(&m_frameSemMutex);
+        waitSems.append(m_frameWaitSems.constData(), m_frameWaitSems.count());
+        waitStages.append(m_frameWaitStages.constData(), m_frameWaitStages.count());
+        signalSems.append(m_frameSignalSems.constData(), m_frameSignalSems.count());
+        m_frameWaitSems.clear();
+        m_frameWaitStages.clear();
+        m_frameSignalSems.clear();
+    }
+
     VkSubmitInfo submitInfo;
     memset(&submitInfo, 0, sizeof(submitInfo));
     submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
     submitInfo.commandBufferCount = 1;
     submitInfo.pCommandBuffers = &m_frameCmdBuf[m_currentFrame][subIndex];
-    submitInfo.waitSemaphoreCount = 1;
-    submitInfo.pWaitSemaphores = &waitSem;
-    submitInfo.signalSemaphoreCount = 1;
-    submitInfo.pSignalSemaphores = &signalSem;
-    VkPipelineStageFlags psf = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
-    submitInfo.pWaitDstStageMask = &psf;
+    submitInfo.waitSemaphoreCount = waitSems.count();
+    submitInfo.pWaitSemaphores = waitSems.constData();
+    submitInfo.pWaitDstStageMask = waitStages.constData();
+    submitInfo.signalSemaphoreCount = signalSems.count();
+    submitInfo.pSignalSemaphores = signalSems.constData();
     err = f->vkQueueSubmit(m_vkQueue, 1, &submitInfo, fence ? m_frameFence[m_currentFrame] : VK_NULL_HANDLE);
+    m_submitCount.fetchAndAddRelaxed(1);
     if (err != VK_SUCCESS) {
         qWarning("Failed to submit to command queue: %d", err);
         return;
@@ -1285,35 +3494,86 @@ void QVulkanRenderLoopPrivate::endFrame()
 {
     Q_ASSERT(m_frameActive);
     m_frameActive = false;
+    QVK_TRACE_SCOPE("endFrame");
+
+    // frameQueued() may have been called from within queueFrame().
+    const qint64 endStart = m_frameClock.nsecsElapsed();
+    if (m_inQueueFrame || !m_worker) {
+        m_frameTimings.queueFrameTime = endStart - m_queueFrameStart;
+    } else {
+        m_frameTimings.queueFrameTime = m_queueFrameEnd - m_queueFrameStart;
+        m_frameTimings.frameQueuedWaitTime = endStart - m_queueFrameEnd;
+    }
 
     int subIndex = 0;
-    if (m_worker) {
+    if (m_worker && !singleSubmit()) {
         subIndex = 1;
         ensureFrameCmdBuf(m_currentFrame, subIndex);
     }
 
-    transitionImage(m_frameCmdBuf[m_currentFrame][subIndex], m_swapChainImages[m_currentSwapChainBuffer],
-                    VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
-                    VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, 0);
-
-    submitFrameCmdBuf(m_worker ? m_workerSignalSem[m_currentFrame] : m_acquireSem[m_currentFrame], m_renderSem[m_currentFrame], subIndex, true);
-
-    VkPresentInfoKHR presInfo;
-    memset(&presInfo, 0, sizeof(presInfo));
-    presInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
-    presInfo.swapchainCount = 1;
-    presInfo.pSwapchains = &m_swapChain;
-    presInfo.pImageIndices = &m_currentSwapChainBuffer;
-    presInfo.waitSemaphoreCount = 1;
-    presInfo.pWaitSemaphores = &m_renderSem[m_currentFrame];
-
-    VkResult err = vkQueuePresentKHR(m_vkQueue, &presInfo);
+    // Presentation needs no access mask, the semaphore takes care of
+    // visibility. Offscreen images end up ready to be copied from.
+    QVulkanImageBarrierBatch::Image *img = &m_swapChainImageTrack[m_currentSwapChainBuffer];
+    QVulkanImageState state;
+    if (m_offscreen) {
+        state.layout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        state.access = VK_ACCESS_TRANSFER_READ_BIT;
+        state.stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    } else {
+        state.layout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+        state.access = 0;
+        state.stage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+    }
+    const VkPipelineStageFlags srcStage = img->state.stage;
+    recordReadback(m_frameCmdBuf[m_currentFrame][subIndex], img);
+    if (img->state.layout != state.layout)
+        m_imageBarriers.transition(img, state);
+    m_imageBarriers.record(f, m_frameCmdBuf[m_currentFrame][subIndex]);
+
+    if (m_gpuTimestamps)
+        f->vkCmdWriteTimestamp(m_frameCmdBuf[m_currentFrame][subIndex], VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                               m_queryPool[m_currentFrame], 1);
+
+    flushDynamicData();
+
+    // The worker's submission is waited for at the stage where its last
+    // access to the image happened.
+    if (m_worker && !singleSubmit())
+        submitFrameCmdBuf(m_workerSignalSem[m_currentFrame], srcStage ? srcStage : VkPipelineStageFlags(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT),
+                          m_renderSem[m_currentFrame], subIndex, true);
+    else
+        submitFrameCmdBuf(m_acquireSem[m_currentFrame], m_acquireWaitStage, m_renderSem[m_currentFrame], subIndex, true);
+
+    recordFrameCost(m_frameTimings.queueFrameTime + m_frameTimings.frameQueuedWaitTime + m_gpuFrameTime);
+    if (m_lastPresentedImage >= 0)
+        m_nextFrameStart[m_lastPresentedImage] = m_queueFrameStart;
+    m_lastPresentedImage = m_currentSwapChainBuffer;
+
+    const qint64 presentStart = m_frameClock.nsecsElapsed();
+    VkResult err = VK_SUCCESS;
+    if (m_offscreen) {
+        waitOffscreenVSync();
+    } else {
+        VkPresentInfoKHR presInfo;
+        memset(&presInfo, 0, sizeof(presInfo));
+        presInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+        presInfo.swapchainCount = 1;
+        presInfo.pSwapchains = &m_swapChain;
+        presInfo.pImageIndices = &m_currentSwapChainBuffer;
+        presInfo.waitSemaphoreCount = 1;
+        presInfo.pWaitSemaphores = &m_renderSem[m_currentFrame];
+
+        QVulkanTracer::begin("present");
+        err = vkQueuePresentKHR(m_vkQueue, &presInfo);
+        QVulkanTracer::end("present");
+    }
+    m_frameTimings.presentTime = m_frameClock.nsecsElapsed() - presentStart;
+    m_frameTimingsRing.publish(m_frameTimings);
+    ++m_frameNumber;
     if (err != VK_SUCCESS) {
         if (err == VK_ERROR_OUT_OF_DATE_KHR) {
             qWarning("out of date in present");
-            f->vkDeviceWaitIdle(m_vkDev);
-            recreateSwapChain();
-            return;
+            m_thread->setResizePending(true);
         } else if (err != VK_SUBOPTIMAL_KHR) {
             qWarning("Failed to present: %d", err);
         }
@@ -1321,17 +3581,121 @@ void QVulkanRenderLoopPrivate::endFrame()
 
     m_currentFrame = (m_currentFrame + 1) % m_framesInFlight;
 
+    if (m_pipelineBuilder->mergeInto(m_pipelineCache) && Q_UNLIKELY(debug_render()))
+        qDebug("merged newly built pipelines into the pipeline cache");
+
+    if (m_pipelineCacheSaveRequested.testAndSetRelaxed(1, 0)
+            || (m_pipelineCacheSaveInterval && m_pipelineCacheSaveTimer.hasExpired(m_pipelineCacheSaveInterval))) {
+        savePipelineCache(true);
+        m_pipelineCacheSaveTimer.restart();
+    }
+
     if (m_flags.testFlag(QVulkanRenderLoop::UpdateContinuously))
         q->update();
 }
 
+// Stands in for a FIFO present: blocks until the next simulated vertical
+// blank, or returns immediately when no refresh rate is set.
+void QVulkanRenderLoopPrivate::waitOffscreenVSync()
+{
+    if (!m_offscreenFrameInterval)
+        return;
+
+    QVK_TRACE_SCOPE("present");
+    const qint64 now = m_frameClock.nsecsElapsed();
+    if (m_offscreenNextVSync <= now) {
+        // Missed one (or this is the first frame), align to the next.
+        m_offscreenNextVSync = now + m_offscreenFrameInterval;
+    }
+    const qint64 wait = m_offscreenNextVSync - now;
+    QThread::usleep(wait / 1000);
+    vblankObserved(m_frameClock.nsecsElapsed(), m_queueFrameStart);
+    m_offscreenNextVSync += m_offscreenFrameInterval;
+}
+
+static qint64 median(const qint64 *samples, int count)
+{
+    qint64 values[QVulkanRenderLoopPrivate::PACING_HISTORY];
+    memcpy(values, samples, count * sizeof(qint64));
+    std::nth_element(values, values + count / 2, values + count);
+    return values[count / 2];
+}
+
+// frameStart is the queueFrame() start of the frame shown at t, or -1 when
+// that is not known.
+void QVulkanRenderLoopPrivate::vblankObserved(qint64 t, qint64 frameStart)
+{
+    m_lastVBlank = t;
+    if (frameStart < 0)
+        return;
+
+    m_latencies[m_latencyCount++ % PACING_HISTORY] = t - frameStart;
+    const int count = m_latencyCount < PACING_HISTORY ? m_latencyCount : int(PACING_HISTORY);
+    m_achievedLatency.store(median(m_latencies, count));
+}
+
+void QVulkanRenderLoopPrivate::recordFrameCost(qint64 cost)
+{
+    m_frameCosts[m_frameCostCount++ % PACING_HISTORY] = cost;
+}
+
+// 90th percentile of the recent frames' CPU time plus the GPU time, when
+// GpuTimestamps provides that.
+qint64 QVulkanRenderLoopPrivate::predictedFrameCost() const
+{
+    const int count = m_frameCostCount < PACING_HISTORY ? m_frameCostCount : int(PACING_HISTORY);
+    if (!count)
+        return 0;
+    qint64 values[PACING_HISTORY];
+    memcpy(values, m_frameCosts, count * sizeof(qint64));
+    const int n = (count * 9) / 10;
+    std::nth_element(values, values + n, values + count);
+    return values[n];
+}
+
+// Sleeps until the predicted frame cost plus the target latency before the
+// next vertical blank, so queueFrame() samples its input as late as possible.
+void QVulkanRenderLoopPrivate::paceFrame()
+{
+    const qint64 target = m_targetLatency.load();
+    const qint64 interval = m_offscreen ? m_offscreenFrameInterval : m_refreshInterval.load();
+    if (!target || !interval || m_lastVBlank < 0)
+        return;
+
+    const qint64 lead = qMax(target, predictedFrameCost() + interval / 8);
+    if (lead >= interval)
+        return;
+
+    const qint64 now = m_frameClock.nsecsElapsed();
+    const qint64 nextVBlank = m_lastVBlank + ((now - m_lastVBlank) / interval + 1) * interval;
+    const qint64 wakeup = nextVBlank - lead;
+    if (wakeup <= now)
+        return;
+
+    QVK_TRACE_SCOPE("pacing");
+    QThread::usleep((wakeup - now) / 1000);
+    m_frameTimings.pacingTime = m_frameClock.nsecsElapsed() - now;
+}
+
 void QVulkanRenderLoopPrivate::renderFrame()
 {
     Q_ASSERT(m_frameActive);
 
+    paceFrame();
+
+    m_queueFrameStart = m_frameClock.nsecsElapsed();
+    m_frameTimings.beginFrameTime = m_queueFrameStart - m_lastFrameStart;
+
     if (m_worker) {
-        Q_ASSERT(!m_frameCmdBufRecording[m_currentFrame]);
+        Q_ASSERT(m_frameCmdBufRecording[m_currentFrame] == singleSubmit());
+        m_inQueueFrame = true;
+        m_jobSystem->beginGraph();
+        QVulkanTracer::begin("queueFrame");
         m_worker->queueFrame(m_currentFrame, m_vkQueue, m_workerWaitSem[m_currentFrame], m_workerSignalSem[m_currentFrame]);
+        QVulkanTracer::end("queueFrame");
+        m_jobSystem->endGraph([this] { q->frameQueued(); });
+        m_inQueueFrame = false;
+        m_queueFrameEnd = m_frameClock.nsecsElapsed();
         return;
     }
 
@@ -1342,9 +3706,10 @@ void QVulkanRenderLoopPrivate::renderFrame()
     VkCommandBuffer &cb = m_frameCmdBuf[m_currentFrame][0];
     VkImage &img = m_swapChainImages[m_currentSwapChainBuffer];
 
+    // beginFrame() has transitioned to TRANSFER_DST_OPTIMAL.
     VkClearColorValue clearColor = { 0.0f, 1.0f, 0.0f, 1.0f };
     VkImageSubresourceRange subResRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
-    f->vkCmdClearColorImage(cb, img, VK_IMAGE_LAYOUT_GENERAL, &clearColor, 1, &subResRange);
+    f->vkCmdClearColorImage(cb, img, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &clearColor, 1, &subResRange);
 
     endFrame();
 }
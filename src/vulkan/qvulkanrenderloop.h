@@ -40,12 +40,98 @@
 #include <QtVulkan/qtvulkanglobal.h>
 #include <QtVulkan/qvulkan.h>
 #include <QWindow>
+#include <QVector>
+#include <QPair>
+#include <QByteArray>
+#include <QFuture>
+#include <functional>
 
 QT_BEGIN_NAMESPACE
 
 class QVulkanRenderLoopPrivate;
 class QVulkanFunctions;
 
+struct QVulkanMemoryAllocation
+{
+    VkDeviceMemory memory;
+    VkDeviceSize offset;
+    VkDeviceSize size;
+    void *mapped; // persistently mapped pointer for host visible memory, null otherwise
+    uint32_t memoryTypeIndex;
+    void *handle;
+};
+
+struct QVulkanMemoryStats
+{
+    int blockCount;
+    int allocationCount;
+    VkDeviceSize bytesReserved; // total size of the VkDeviceMemory blocks
+    VkDeviceSize bytesAllocated; // sum of the requested sizes
+    VkDeviceSize bytesWasted; // lost to alignment and rounding
+};
+
+// Times are in nanoseconds.
+struct QVulkanShaderStats
+{
+    int requestCount; // shaderModule() calls
+    int fileCount; // files loaded
+    int duplicateCount; // files whose SPIR-V was already loaded under another name
+    int moduleCount; // alive
+    int createCount; // total, including recreations after device loss
+    qint64 bytesMapped;
+    qint64 bytesCopied; // for compressed or unaligned resources
+    qint64 loadTime;
+    qint64 createTime;
+};
+
+struct QVulkanDynamicAllocation
+{
+    VkBuffer buffer;
+    VkDeviceSize offset;
+    void *data;
+};
+
+// All times are in nanoseconds.
+struct QVulkanFrameTimings
+{
+    quint64 frameNumber;
+    qint64 beginFrameTime; // total, including the fence and acquire waits, prepareFrame() and pacing
+    qint64 fenceWaitTime;
+    qint64 prepareFrameTime; // in QVulkanFrameWorker::prepareFrame(), before acquiring
+    qint64 acquireTime;
+    qint64 pacingTime; // delay before queueFrame() with a target latency set
+    qint64 queueFrameTime; // in QVulkanFrameWorker::queueFrame()
+    qint64 frameQueuedWaitTime; // after queueFrame() returned, until frameQueued()
+    qint64 presentTime;
+    qint64 frameInterval; // since the start of the previous frame
+    qint64 gpuFrameTime; // of the newest frame the GPU has finished, 0 if not known
+};
+
+struct QVulkanReadbackResult
+{
+    quint64 frameNumber;
+    QSize size;
+    VkFormat format;
+    int bytesPerLine;
+    const void *data; // only valid during the callback
+};
+
+typedef std::function<void(const QVulkanReadbackResult &)> QVulkanReadbackCallback;
+
+typedef quint64 QVulkanUploadToken;
+
+typedef std::function<void(VkCommandBuffer cb, int index)> QVulkanSecondaryRecorder;
+
+typedef int QVulkanJob;
+typedef std::function<void(int threadIndex)> QVulkanJobFunction;
+
+struct QVulkanImageState
+{
+    VkImageLayout layout;
+    VkAccessFlags access;
+    VkPipelineStageFlags stage;
+};
+
 class Q_VULKAN_EXPORT QVulkanFrameWorker
 {
 public:
@@ -53,6 +139,7 @@ public:
     virtual void init() = 0;
     virtual void resize(const QSize &size) = 0;
     virtual void cleanup() = 0;
+    virtual void prepareFrame(int frame) { Q_UNUSED(frame); }
     virtual void queueFrame(int frame, VkQueue queue, VkSemaphore waitSem, VkSemaphore signalSem) = 0;
 };
 
@@ -64,15 +151,46 @@ public:
         Unthrottled = 0x02,
         UpdateContinuously = 0x04,
         DontReleaseOnObscure = 0x08,
-        TrippleBuffer = 0x10
+        TrippleBuffer = 0x10,
+        NonBlockingEvents = 0x20,
+        StretchOnResize = 0x40,
+        SingleSubmit = 0x80,
+        GpuTimestamps = 0x100
     };
     Q_DECLARE_FLAGS(Flags, Flag)
 
+    enum TrackedImage {
+        SwapChainImage, // the current one
+        DepthStencilImage
+    };
+
+    enum QueueType {
+        GraphicsQueue,
+        ComputeQueue,
+        TransferQueue
+    };
+
     QVulkanRenderLoop(QWindow *window);
+    QVulkanRenderLoop(const QSize &offscreenSize);
     ~QVulkanRenderLoop();
 
+    bool isOffscreen() const;
+    void setOffscreenSize(const QSize &size);
+    void setOffscreenRefreshRate(qreal hz);
+
     void setFlags(Flags flags);
+    Flags flags() const;
     void setFramesInFlight(int frameCount);
+    void setPresentMode(VkPresentModeKHR mode);
+    void setSwapChainImageCount(int count);
+    void setResizeDebounce(int msecs);
+    void setTargetLatency(qint64 nsecs);
+    void setDynamicBufferSize(VkDeviceSize perFrameSize);
+    void setUploadStagingSize(VkDeviceSize size);
+    void setReadbackDepth(int depth);
+    void setTightReadbackPacking(bool enable);
+    void setPipelineCacheFile(const QString &fileName);
+    void setPipelineCacheSaveInterval(int msecs);
     void setWorker(QVulkanFrameWorker *worker);
 
     void update();
@@ -80,6 +198,36 @@ public:
     // for QVulkanFrameWorker
     void frameQueued();
     QVulkanFunctions *functions();
+    QVulkanJob addFrameJob(const QVulkanJobFunction &func,
+                           const QVector<QVulkanJob> &dependencies = QVector<QVulkanJob>(),
+                           int threadIndex = -1);
+    int jobThreadCount() const;
+
+    void releaseBufferLater(VkBuffer buffer);
+    void releaseImageLater(VkImage image);
+    void releaseImageViewLater(VkImageView view);
+    void releaseMemoryLater(VkDeviceMemory memory);
+    void releaseFramebufferLater(VkFramebuffer framebuffer);
+    void releaseCommandBufferLater(VkCommandPool pool, VkCommandBuffer cb);
+    void releaseDescriptorSetLater(VkDescriptorPool pool, VkDescriptorSet set);
+
+    QVulkanMemoryAllocation allocateMemory(const VkMemoryRequirements &req,
+                                           VkMemoryPropertyFlags required,
+                                           VkMemoryPropertyFlags preferred = 0,
+                                           VkImageTiling tiling = VK_IMAGE_TILING_LINEAR);
+    void freeMemory(const QVulkanMemoryAllocation &alloc);
+    void releaseMemoryLater(const QVulkanMemoryAllocation &alloc);
+
+    VkBuffer dynamicBuffer() const;
+    QVulkanDynamicAllocation allocateDynamic(VkDeviceSize size, VkDeviceSize alignment = 0);
+    void flushDynamicData();
+
+    void readbackFrame(const QVulkanReadbackCallback &callback);
+
+    QVulkanImageState imageState(TrackedImage image) const;
+    void setImageState(TrackedImage image, const QVulkanImageState &state);
+    void transitionImage(TrackedImage image, const QVulkanImageState &state);
+    void recordImageTransitions(VkCommandBuffer cb);
 
     VkInstance instance() const;
     VkPhysicalDevice physicalDevice() const;
@@ -87,9 +235,43 @@ public:
     uint32_t hostVisibleMemoryIndex() const;
     VkDevice device() const;
     VkCommandPool commandPool() const;
+    VkCommandPool threadCommandPool(int index);
+    void recordParallel(VkCommandBuffer primary, const VkCommandBufferInheritanceInfo &inheritance,
+                        int count, const QVulkanSecondaryRecorder &recorder);
+    bool hasDedicatedQueue(QueueType type) const;
+    VkQueue queue(QueueType type) const;
+    uint32_t queueFamilyIndex(QueueType type) const;
+    VkCommandPool queueCommandPool(QueueType type) const;
+    void waitSemaphoreInFrame(VkSemaphore sem, VkPipelineStageFlags stage);
+    void signalSemaphoreInFrame(VkSemaphore sem);
+    VkPipelineCache pipelineCache() const;
+    VkShaderModule shaderModule(const QString &fileName);
+    void savePipelineCache();
+    QFuture<VkPipeline> buildGraphicsPipeline(const VkGraphicsPipelineCreateInfo &info);
+    QFuture<VkPipeline> buildComputePipeline(const VkComputePipelineCreateInfo &info);
+    QVulkanUploadToken uploadBuffer(VkBuffer dst, VkDeviceSize dstOffset, const QByteArray &data);
+    QVulkanUploadToken uploadImage(VkImage dst, VkImageLayout finalLayout,
+                                   const VkBufferImageCopy &region, const QByteArray &data);
+    bool isUploadReady(QVulkanUploadToken token) const;
+    int commandBufferAllocationCount() const;
+    quint64 queueSubmitCount() const;
+    int frameTimings(QVulkanFrameTimings *timings, int maxCount) const;
+    QVulkanFrameTimings frameTimingsPercentile(int percentile) const;
 
+    int beginGpuRange(VkCommandBuffer cb, const char *name);
+    void endGpuRange(VkCommandBuffer cb, int range);
+    QVector<QPair<QByteArray, qint64> > gpuRangeTimes() const;
+    qint64 guiThreadStallTime() const;
+    qint64 achievedLatency() const;
+    QVulkanMemoryStats memoryStats() const;
+    QVulkanShaderStats shaderStats() const;
+    static bool writeTrace(const QString &fileName);
+
+    VkPresentModeKHR presentMode() const;
+    QVector<VkPresentModeKHR> supportedPresentModes() const;
     int swapChainImageCount() const;
     int currentSwapChainImageIndex() const;
+    VkCommandBuffer currentCommandBuffer() const;
     VkImage swapChainImage(int idx) const;
     VkImageView swapChainImageView(int idx) const;
     VkFormat swapChainFormat() const;
@@ -101,6 +283,20 @@ private:
     QVulkanRenderLoopPrivate *d;
 };
 
+class QVulkanGpuRangeScope
+{
+public:
+    QVulkanGpuRangeScope(QVulkanRenderLoop *rl, VkCommandBuffer cb, const char *name)
+        : m_rl(rl), m_cb(cb), m_range(rl->beginGpuRange(cb, name)) { }
+    ~QVulkanGpuRangeScope() { m_rl->endGpuRange(m_cb, m_range); }
+
+private:
+    Q_DISABLE_COPY(QVulkanGpuRangeScope)
+    QVulkanRenderLoop *m_rl;
+    VkCommandBuffer m_cb;
+    int m_range;
+};
+
 Q_DECLARE_OPERATORS_FOR_FLAGS(QVulkanRenderLoop::Flags)
 
 QT_END_NAMESPACE
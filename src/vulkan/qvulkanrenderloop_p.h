@@ -39,10 +39,14 @@
 
 #include "qvulkanrenderloop.h"
 #include <QObject>
-#include <QQueue>
 #include <QThread>
 #include <QMutex>
 #include <QWaitCondition>
+#include <QAtomicInt>
+#include <QElapsedTimer>
+#include <QVector>
+#include <QVarLengthArray>
+#include <QThreadPool>
 
 //
 //  W A R N I N G
@@ -58,22 +62,112 @@
 QT_BEGIN_NAMESPACE
 
 class QVulkanRenderThread;
+class QVulkanMemoryAllocator;
+class QVulkanPipelineBuilder;
+class QVulkanShaderRegistry;
+class QVulkanUploader;
+class QVulkanJobSystem;
+
+struct QVulkanRenderThreadEvent
+{
+    enum Type {
+        Expose = 1,
+        Obscure,
+        Resize,
+        Update,
+        FrameQueued,
+        Destroy,
+        Reconfigure
+    };
+
+    Type type;
+    bool sync;
+};
+
+// Collects image layout transitions and emits them with a single
+// vkCmdPipelineBarrier. Tracks the layout, pending access and stage of each
+// image so that the source side of the barriers is exact and transitions that
+// need no barrier at all are dropped.
+class QVulkanImageBarrierBatch
+{
+public:
+    struct Image {
+        VkImage image;
+        VkImageAspectFlags aspect;
+        QVulkanImageState state;
+        // The last write, and the dst scope of the barriers that followed
+        // it (or the last layout change). Reads within that scope are
+        // ordered already.
+        VkPipelineStageFlags writeStage;
+        VkAccessFlags writeAccess;
+        VkPipelineStageFlags readStages;
+        VkAccessFlags readAccess;
+    };
+
+    static void reset(Image *img, VkImage image, VkImageAspectFlags aspect);
+    static void setState(Image *img, const QVulkanImageState &state);
+
+    void transition(Image *img, const QVulkanImageState &state);
+    void record(QVulkanFunctions *f, VkCommandBuffer cb);
+    void clear();
+    bool isEmpty() const { return m_barriers.isEmpty(); }
+
+private:
+    VkImageMemoryBarrier *addBarrier(Image *img);
+
+    QVarLengthArray<VkImageMemoryBarrier, 4> m_barriers;
+    VkPipelineStageFlags m_srcStages = 0;
+    VkPipelineStageFlags m_dstStages = 0;
+};
+
+// Single writer (the render thread), any number of readers on any thread.
+// Each slot is guarded by a sequence number, readers never block the writer
+// and just retry when they raced with an update of the same slot.
+class QVulkanFrameTimingsRing
+{
+public:
+    static const int SIZE = 128;
+
+    void publish(const QVulkanFrameTimings &timings);
+    int read(QVulkanFrameTimings *dst, int maxCount) const; // newest first
+
+private:
+    struct Slot {
+        QAtomicInteger<uint> seq;
+        QVulkanFrameTimings timings;
+    };
+    Slot m_slots[SIZE];
+    QAtomicInteger<quint64> m_count;
+};
 
 class QVulkanRenderLoopPrivate : public QObject
 {
 public:
     QVulkanRenderLoopPrivate(QVulkanRenderLoop *q_ptr, QWindow *window);
+    QVulkanRenderLoopPrivate(QVulkanRenderLoop *q_ptr, const QSize &offscreenSize);
     ~QVulkanRenderLoopPrivate();
 
     bool eventFilter(QObject *watched, QEvent *event) override;
 
-    void postThreadEvent(QEvent *e, bool lock = true);
+    void postThreadEvent(QVulkanRenderThreadEvent::Type type, QElapsedTimer *lockedSince = nullptr);
+    void setWindowSize(const QSize &size);
+    void updateWindowSize();
 
+    void startOffscreen();
     void init();
     void cleanup();
     void recreateSwapChain();
+    void waitFrameFence(int frame);
     void ensureFrameCmdBuf(int frame, int subIndex);
-    void submitFrameCmdBuf(VkSemaphore waitSem, VkSemaphore signalSem, int subIndex, bool fence);
+    void abandonFrame();
+    struct ThreadCmdPool;
+    ThreadCmdPool *threadCmdPool(QVector<ThreadCmdPool> *pools, int index);
+    void resetThreadCmdPools(int frame);
+    void releaseThreadCmdPools(int frame);
+    void recordParallel(VkCommandBuffer primary, const VkCommandBufferInheritanceInfo &inheritance,
+                        int count, const QVulkanSecondaryRecorder &recorder);
+    void submitFrameCmdBuf(VkSemaphore waitSem, VkPipelineStageFlags waitStage, VkSemaphore signalSem,
+                           int subIndex, bool fence);
     bool beginFrame();
     void endFrame();
     void renderFrame();
@@ -82,27 +176,109 @@ public:
     void releaseDeviceAndSurface();
     void createSurface();
     void releaseSurface();
+    void resetFrameState();
+    void createSwapChain(VkExtent2D *bufferSize);
+    void createOffscreenImages(VkExtent2D *bufferSize);
+    void releaseOffscreenImages();
+    void waitOffscreenVSync();
+    void requestReconfigure();
+    void applyFramesInFlight();
+    uint32_t requestedBufferCount() const;
+    void paceFrame();
+    void vblankObserved(qint64 t, qint64 frameStart);
+    void recordFrameCost(qint64 cost);
+    qint64 predictedFrameCost() const;
+    void createDynamicBuffer();
+    void releaseDynamicBuffer();
+    bool allocateDynamic(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize *offset);
+    void flushDynamicData();
+    void createQueryPools();
+    void releaseQueryPools();
+    void readTimestamps(int frame);
+    void recordReadback(VkCommandBuffer cb, QVulkanImageBarrierBatch::Image *img);
+    void deliverReadbacks(int frame);
+    void releaseReadbacks();
+    void createPipelineCache();
+    void savePipelineCache(bool async);
+    void releasePipelineCache();
     bool physicalDeviceSupportsPresent(int queueFamilyIdx);
 
-    void transitionImage(VkCommandBuffer cmdBuf, VkImage image,
-                         VkImageLayout oldLayout, VkImageLayout newLayout,
-                         VkAccessFlags srcAccessMask, VkAccessFlags dstAccessMask, bool ds = false);
+    struct DeferredRelease {
+        enum Type {
+            SwapChain,
+            ImageView,
+            Image,
+            Memory,
+            Buffer,
+            Framebuffer,
+            CommandBuffer,
+            DescriptorSet,
+            Allocation
+        };
+        DeferredRelease() { }
+        DeferredRelease(Type t) : type(t) { }
+        Type type;
+        uint frameMask; // frame slots that still have to finish
+        union {
+            VkSwapchainKHR swapChain;
+            VkImageView imageView;
+            VkImage image;
+            VkDeviceMemory memory;
+            VkBuffer buffer;
+            VkFramebuffer framebuffer;
+            struct {
+                VkCommandPool pool;
+                VkCommandBuffer cb;
+            } commandBuffer;
+            struct {
+                VkDescriptorPool pool;
+                VkDescriptorSet set;
+            } descriptorSet;
+            QVulkanMemoryAllocation allocation;
+        };
+    };
+    void releaseLater(DeferredRelease r);
+    void releaseNow(const DeferredRelease &r);
+    void drainDeferredReleases();
+
+    QVulkanImageBarrierBatch::Image *trackedImage(QVulkanRenderLoop::TrackedImage image);
+    bool singleSubmit() const { return m_worker && m_flags.testFlag(QVulkanRenderLoop::SingleSubmit); }
 
     QVulkanRenderLoop *q;
     QVulkanRenderLoop::Flags m_flags = 0;
     int m_framesInFlight = 1;
+    int m_resizeDebounce = 0;
+    VkDeviceSize m_dynamicBufferSize = 1024 * 1024;
+    VkDeviceSize m_uploadStagingSize = 16 * 1024 * 1024;
     QVulkanRenderThread *m_thread = nullptr;
     QVulkanFrameWorker *m_worker = nullptr;
     QVulkanFunctions *f;
 
+    bool m_offscreen = false;
+    qint64 m_offscreenFrameInterval = 0; // ns, 0 for unthrottled
+    qint64 m_offscreenNextVSync = 0;
+    uint32_t m_offscreenNextImage;
+
     WId m_winId;
 #ifdef Q_OS_LINUX
     xcb_connection_t *m_xcbConnection;
     xcb_visualid_t m_xcbVisualId;
 #endif
     QSize m_windowSize;
+    QSize m_pendingWindowSize;
+    QMutex m_windowSizeMutex;
+    QAtomicInteger<qint64> m_guiStallTime;
     bool m_inited = false;
 
+    // Settings changeable while rendering, picked up by the next swapchain
+    // recreation.
+    mutable QMutex m_configMutex;
+    int m_requestedPresentMode = -1; // -1 to decide based on Unthrottled
+    int m_requestedBufferCount = 0; // 0 to decide based on TrippleBuffer
+    int m_requestedFramesInFlight = 0; // 0 when there is no change
+    VkPresentModeKHR m_presentMode = VK_PRESENT_MODE_FIFO_KHR;
+    QVector<VkPresentModeKHR> m_supportedPresentModes;
+
     PFN_vkCreateDebugReportCallbackEXT vkCreateDebugReportCallbackEXT;
     PFN_vkDestroyDebugReportCallbackEXT vkDestroyDebugReportCallbackEXT;
     PFN_vkDebugReportMessageEXT vkDebugReportMessageEXT;
@@ -116,7 +292,40 @@ public:
     VkDevice m_vkDev;
     VkQueue m_vkQueue;
     VkCommandPool m_vkCmdPool;
+    uint32_t m_gfxQueueFamilyIdx;
+
+    // Indexed by QVulkanRenderLoop::QueueType. Without a dedicated family
+    // the entry is the same as the graphics one.
+    struct Queue {
+        VkQueue queue;
+        uint32_t familyIndex;
+        VkCommandPool cmdPool;
+        bool dedicated;
+    };
+    Queue m_queues[3];
+
+    // Extra waits and signals for the current frame's last submission.
+    QMutex m_frameSemMutex;
+    QVarLengthArray<VkSemaphore, 4> m_frameWaitSems;
+    QVarLengthArray<VkPipelineStageFlags, 4> m_frameWaitStages;
+    QVarLengthArray<VkSemaphore, 4> m_frameSignalSems;
+    VkQueue m_uploadQueue; // a second one from the transfer family, or the graphics queue
+    uint32_t m_uploadQueueFamilyIdx;
+    QVulkanUploader *m_uploader = nullptr;
+    QVulkanJobSystem *m_jobSystem;
     uint32_t m_hostVisibleMemIndex;
+    QVulkanMemoryAllocator *m_memAllocator = nullptr;
+    QVulkanShaderRegistry *m_shaderRegistry;
+
+    VkBuffer m_dynamicBuf = VK_NULL_HANDLE;
+    QVulkanMemoryAllocation m_dynamicAlloc = {};
+    bool m_dynamicCoherent;
+    VkDeviceSize m_dynamicFrameSize;
+    int m_dynamicFrameCount; // regions in the buffer, may exceed m_framesInFlight
+    VkDeviceSize m_dynamicBase; // start of the current frame's region
+    QAtomicInteger<quint64> m_dynamicUsed; // bytes used in the current region
+    VkDeviceSize m_dynamicFlushed;
+    QMutex m_dynamicFlushMutex;
     bool m_hasDebug;
     VkDebugReportCallbackEXT m_debugCallback;
 
@@ -129,22 +338,110 @@ public:
 
     VkImage m_swapChainImages[MAX_SWAPCHAIN_BUFFERS];
     VkImageView m_swapChainImageViews[MAX_SWAPCHAIN_BUFFERS];
-    VkDeviceMemory m_dsMem = VK_NULL_HANDLE;
+    QVulkanMemoryAllocation m_offscreenAlloc[MAX_SWAPCHAIN_BUFFERS]; // backing the images in offscreen mode
+    QVulkanMemoryAllocation m_dsAlloc = {};
     VkImage m_ds;
     VkImageView m_dsView;
+    QVulkanImageBarrierBatch::Image m_swapChainImageTrack[MAX_SWAPCHAIN_BUFFERS];
+    QVulkanImageBarrierBatch::Image m_dsTrack;
+    QVulkanImageBarrierBatch m_imageBarriers;
+    VkPipelineStageFlags m_acquireWaitStage;
 
     bool m_frameActive;
     VkSemaphore m_acquireSem[MAX_FRAMES_IN_FLIGHT];
     VkSemaphore m_renderSem[MAX_FRAMES_IN_FLIGHT];
     VkSemaphore m_workerWaitSem[MAX_FRAMES_IN_FLIGHT];
     VkSemaphore m_workerSignalSem[MAX_FRAMES_IN_FLIGHT];
+    VkCommandPool m_frameCmdPool[MAX_FRAMES_IN_FLIGHT];
     VkCommandBuffer m_frameCmdBuf[MAX_FRAMES_IN_FLIGHT][2];
     bool m_frameCmdBufRecording[MAX_FRAMES_IN_FLIGHT];
     VkFence m_frameFence[MAX_FRAMES_IN_FLIGHT];
     bool m_frameFenceActive[MAX_FRAMES_IN_FLIGHT];
 
+    // Per frame slot pools for other threads, reset along with the slot's
+    // own pool. The secondaries are only used by recordParallel().
+    struct ThreadCmdPool {
+        VkCommandPool pool;
+        QVector<VkCommandBuffer> secondaries;
+        int secondariesUsed;
+    };
+    QMutex m_threadCmdPoolMutex;
+    QVector<ThreadCmdPool> m_threadCmdPools[MAX_FRAMES_IN_FLIGHT]; // threadCommandPool()
+    QVector<ThreadCmdPool> m_parallelCmdPools[MAX_FRAMES_IN_FLIGHT]; // recordParallel(), one per chunk
+    QThreadPool m_recordPool;
+
+    QMutex m_deferredReleaseMutex;
+    QVector<DeferredRelease> m_deferredReleaseQueue;
+
     uint32_t m_currentSwapChainBuffer;
     uint32_t m_currentFrame;
+    QAtomicInt m_cmdBufAllocCount;
+    QAtomicInteger<quint64> m_submitCount;
+
+    QElapsedTimer m_frameClock;
+    QVulkanFrameTimings m_frameTimings; // the frame being prepared
+    QVulkanFrameTimingsRing m_frameTimingsRing;
+    quint64 m_frameNumber = 0;
+    qint64 m_lastFrameStart = -1;
+    qint64 m_queueFrameStart;
+    qint64 m_queueFrameEnd;
+    bool m_inQueueFrame = false;
+
+    static const int PACING_HISTORY = 32;
+    static const qint64 VBLANK_WAIT_THRESHOLD = 500000; // ns
+    QAtomicInteger<qint64> m_targetLatency; // ns, 0 when pacing is off
+    QAtomicInteger<qint64> m_achievedLatency;
+    QAtomicInteger<qint64> m_refreshInterval; // ns, of the window's screen, set on the gui thread
+    qint64 m_lastVBlank = -1;
+    // queueFrame() start of the frame presented after each image, shown when
+    // that image is handed back by the acquire.
+    qint64 m_nextFrameStart[MAX_SWAPCHAIN_BUFFERS];
+    int m_lastPresentedImage = -1;
+    qint64 m_frameCosts[PACING_HISTORY];
+    int m_frameCostCount = 0;
+    qint64 m_latencies[PACING_HISTORY];
+    int m_latencyCount = 0;
+
+    // Query 0 and 1 are the frame start and end, followed by pairs for the worker's ranges.
+    static const int MAX_GPU_RANGES = 32;
+    bool m_gpuTimestamps = false;
+    quint64 m_timestampMask;
+    VkQueryPool m_queryPool[MAX_FRAMES_IN_FLIGHT];
+    bool m_queriesPending[MAX_FRAMES_IN_FLIGHT];
+    QAtomicInt m_gpuRangeCount[MAX_FRAMES_IN_FLIGHT];
+    const char *m_gpuRangeNames[MAX_FRAMES_IN_FLIGHT][MAX_GPU_RANGES];
+    mutable QMutex m_gpuTimingsMutex;
+    qint64 m_gpuFrameTime = 0;
+    QVector<QPair<QByteArray, qint64> > m_gpuRangeTimes;
+
+    static const int MAX_READBACKS = 8;
+    struct Readback {
+        VkBuffer buffer = VK_NULL_HANDLE;
+        QVulkanMemoryAllocation alloc = {};
+        QAtomicInt busy; // from recording until all callbacks have returned
+        int frame = -1; // slot whose fence covers the copy, -1 when not pending on the GPU
+        QVulkanReadbackResult result;
+        QVector<QVulkanReadbackCallback> callbacks;
+    };
+    Readback m_readbacks[MAX_READBACKS];
+    int m_readbackDepth = 2;
+    bool m_readbackTight = true;
+    bool m_readbackSupported;
+    int m_readbacksPending[MAX_FRAMES_IN_FLIGHT];
+    QMutex m_readbackMutex;
+    QVector<QVulkanReadbackCallback> m_readbackRequests;
+    QThreadPool m_readbackPool; // one thread, callbacks are invoked in frame order
+    VkExtent2D m_swapChainExtent;
+
+    VkPipelineCache m_pipelineCache = VK_NULL_HANDLE;
+    QString m_pipelineCacheFile;
+    bool m_pipelineCacheFileSet = false;
+    QByteArray m_pipelineCacheData; // as last loaded or saved, survives device loss
+    int m_pipelineCacheSaveInterval = 30000;
+    QElapsedTimer m_pipelineCacheSaveTimer;
+    QAtomicInt m_pipelineCacheSaveRequested;
+    QThreadPool m_pipelineCachePool; // one thread, writes the file in the background
+    QVulkanPipelineBuilder *m_pipelineBuilder = nullptr;
 
 #if defined(Q_OS_WIN)
     PFN_vkCreateWin32SurfaceKHR vkCreateWin32SurfaceKHR;
@@ -167,59 +464,34 @@ public:
     PFN_vkQueuePresentKHR vkQueuePresentKHR;
 };
 
-class QVulkanRenderThreadEventQueue : public QQueue<QEvent *>
-{
-public:
-    void addEvent(QEvent *e);
-    QEvent *takeEvent(bool wait);
-    bool hasMoreEvents();
-
-private:
-    QMutex m_mutex;
-    QWaitCondition m_condition;
-    bool m_waiting = false;
-};
-
-class QVulkanRenderThreadExposeEvent : public QEvent
+// Bounded multi-producer, single-consumer ring of POD event records. Posting
+// is lock-free; the mutex and the wait condition are only touched when the
+// render thread is (about to be) blocked waiting for events.
+class QVulkanRenderThreadEventQueue
 {
 public:
-    static const QEvent::Type Type = QEvent::Type(QEvent::User + 1);
-    QVulkanRenderThreadExposeEvent() : QEvent(Type) { }
-};
+    QVulkanRenderThreadEventQueue();
 
-class QVulkanRenderThreadObscureEvent : public QEvent
-{
-public:
-    static const QEvent::Type Type = QEvent::Type(QEvent::User + 2);
-    QVulkanRenderThreadObscureEvent() : QEvent(Type) { }
-};
+    void addEvent(const QVulkanRenderThreadEvent &e);
+    bool takeEvent(QVulkanRenderThreadEvent *e, unsigned long timeout);
 
-class QVulkanRenderThreadResizeEvent : public QEvent
-{
-public:
-    static const QEvent::Type Type = QEvent::Type(QEvent::User + 3);
-    QVulkanRenderThreadResizeEvent() : QEvent(Type) { }
-};
+private:
+    bool tryAddEvent(const QVulkanRenderThreadEvent &e);
+    bool tryTakeEvent(QVulkanRenderThreadEvent *e);
 
-class QVulkanRenderThreadUpdateEvent : public QEvent
-{
-public:
-    static const QEvent::Type Type = QEvent::Type(QEvent::User + 4);
-    QVulkanRenderThreadUpdateEvent() : QEvent(Type) { }
-};
+    static const uint CAPACITY = 64; // must be a power of two
 
-class QVulkanRenderThreadFrameQueuedEvent : public QEvent
-{
-public:
-    static const QEvent::Type Type = QEvent::Type(QEvent::User + 5);
-    QVulkanRenderThreadFrameQueuedEvent() : QEvent(Type) { }
-};
+    struct Cell {
+        QAtomicInteger<uint> seq;
+        QVulkanRenderThreadEvent event;
+    };
+    Cell m_cells[CAPACITY];
+    QAtomicInteger<uint> m_enqueuePos;
+    uint m_dequeuePos = 0;
 
-class QVulkanRenderThreadDestroyEvent : public QEvent
-{
-public:
-    static const QEvent::Type Type = QEvent::Type(QEvent::User + 6);
-    QVulkanRenderThreadDestroyEvent() : QEvent(Type) { }
+    QAtomicInt m_waiting;
+    QMutex m_mutex;
+    QWaitCondition m_condition;
 };
 
 class QVulkanRenderThread : public QThread
@@ -230,29 +502,37 @@ public:
     void run() override;
 
     void processEvents();
-    void processEventsAndWaitForMore();
-    void postEvent(QEvent *e);
+    void processEventsAndWaitForMore(unsigned long timeout = ULONG_MAX);
+    void postEvent(QVulkanRenderThreadEvent::Type type);
+    void sendEvent(QVulkanRenderThreadEvent::Type type);
 
     QMutex *mutex() { return &m_mutex; }
-    QWaitCondition *waitCondition() { return &m_condition; }
     void setActive() { m_active = true; }
     void setUpdatePending();
+    void setResizePending(bool immediate);
 
 private:
-    void processEvent(QEvent *e);
+    void processEvent(const QVulkanRenderThreadEvent &e);
     void obscure();
     void resize();
+    int resizeDelay() const;
 
     QVulkanRenderLoopPrivate *d;
     QVulkanRenderThreadEventQueue m_eventQueue;
     volatile bool m_active;
     QMutex m_mutex;
     QWaitCondition m_condition;
+    QElapsedTimer m_resizeTimer;
+    uint m_syncPosted = 0;
+    uint m_syncCompleted = 0;
+    QAtomicInt m_resizePosted;
+    QAtomicInt m_updatePosted;
     uint m_sleeping : 1;
     uint m_stopEventProcessing : 1;
     uint m_pendingUpdate : 1;
     uint m_pendingObscure : 1;
     uint m_pendingResize : 1;
+    uint m_forceResize : 1;
     uint m_pendingDestroy : 1;
 };
 
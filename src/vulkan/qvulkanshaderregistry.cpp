@@ -0,0 +1,188 @@
+/****************************************************************************
+**
+** Copyright (C) 2016 The Qt Company Ltd.
+** Contact: http://www.qt.io/licensing/
+**
+** This file is part of the QtVulkan module
+**
+** $QT_BEGIN_LICENSE:LGPL3$
+** Commercial License Usage
+** Licensees holding valid commercial Qt licenses may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement between you and The Qt Company. For licensing terms
+** and conditions see http://www.qt.io/terms-conditions. For further
+** information use the contact form at http://www.qt.io/contact-us.
+**
+** GNU Lesser General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU Lesser
+** General Public License version 3 as published by the Free Software
+** Foundation and appearing in the file LICENSE.LGPLv3 included in the
+** packaging of this file. Please review the following information to
+** ensure the GNU Lesser General Public License version 3 requirements
+** will be met: https://www.gnu.org/licenses/lgpl.html.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 2.0 or later as published by the Free
+** Software Foundation and appearing in the file LICENSE.GPL included in
+** the packaging of this file. Please review the following information to
+** ensure the GNU General Public License version 2.0 requirements will be
+** met: http://www.gnu.org/licenses/gpl-2.0.html.
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+#include "qvulkanshaderregistry_p.h"
+#include "qvulkantracer_p.h"
+#include <QVulkanFunctions>
+#include <QFile>
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QDebug>
+
+QT_BEGIN_NAMESPACE
+
+QVulkanShaderRegistry::QVulkanShaderRegistry(QVulkanFunctions *f)
+    : f(f)
+{
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+QVulkanShaderRegistry::~QVulkanShaderRegistry()
+{
+    releaseModules();
+    for (Shader *shader : qAsConst(m_ownedShaders)) {
+        delete shader->file; // unmaps
+        delete shader;
+    }
+}
+
+// Called with VK_NULL_HANDLE before the device is destroyed.
+void QVulkanShaderRegistry::setDevice(VkDevice dev)
+{
+    QMutexLocker lock(&m_mutex);
+    if (dev == m_dev)
+        return;
+    releaseModules();
+    m_dev = dev;
+}
+
+void QVulkanShaderRegistry::releaseModules()
+{
+    for (Shader *shader : qAsConst(m_ownedShaders)) {
+        if (shader->module != VK_NULL_HANDLE) {
+            f->vkDestroyShaderModule(m_dev, shader->module, nullptr);
+            shader->module = VK_NULL_HANDLE;
+            --m_stats.moduleCount;
+        }
+    }
+}
+
+QVulkanShaderRegistry::Shader *QVulkanShaderRegistry::load(const QString &fileName)
+{
+    QVK_TRACE_SCOPE("shader load");
+    QElapsedTimer t;
+    t.start();
+
+    QFile *file = new QFile(fileName);
+    if (!file->open(QIODevice::ReadOnly)) {
+        qWarning("Failed to read shader %s", qPrintable(fileName));
+        delete file;
+        return nullptr;
+    }
+
+    const qint64 size = file->size();
+    if (size <= 0 || size % 4) {
+        qWarning("Shader %s is not valid SPIR-V", qPrintable(fileName));
+        delete file;
+        return nullptr;
+    }
+
+    // Compressed resources cannot be mapped. SPIR-V needs 4 byte alignment,
+    // which resources do not guarantee.
+    QByteArray copy;
+    const uchar *p = file->map(0, size);
+    if (!p || quintptr(p) % 4) {
+        if (p)
+            file->unmap(const_cast<uchar *>(p));
+        copy = file->readAll();
+        delete file;
+        file = nullptr;
+        p = reinterpret_cast<const uchar *>(copy.constData());
+        m_stats.bytesCopied += size;
+    } else {
+        m_stats.bytesMapped += size;
+    }
+
+    const QByteArray hash = QCryptographicHash::hash(QByteArray::fromRawData(reinterpret_cast<const char *>(p), int(size)),
+                                                     QCryptographicHash::Sha1);
+    m_stats.loadTime += t.nsecsElapsed();
+    ++m_stats.fileCount;
+
+    Shader *shader = m_shaders.value(hash);
+    if (shader) {
+        ++m_stats.duplicateCount;
+        delete file;
+        return shader;
+    }
+
+    shader = new Shader;
+    shader->file = file;
+    shader->copy = copy;
+    shader->code = reinterpret_cast<const uint32_t *>(p);
+    shader->size = size_t(size);
+    shader->module = VK_NULL_HANDLE;
+    m_shaders.insert(hash, shader);
+    m_ownedShaders.append(shader);
+    return shader;
+}
+
+VkShaderModule QVulkanShaderRegistry::shaderModule(const QString &fileName)
+{
+    QMutexLocker lock(&m_mutex);
+    if (m_dev == VK_NULL_HANDLE) {
+        qWarning("QVulkanRenderLoop: shaderModule() called without a device");
+        return VK_NULL_HANDLE;
+    }
+
+    ++m_stats.requestCount;
+    Shader *shader = m_files.value(fileName);
+    if (!shader) {
+        shader = load(fileName);
+        if (!shader)
+            return VK_NULL_HANDLE;
+        m_files.insert(fileName, shader);
+    }
+
+    if (shader->module == VK_NULL_HANDLE) {
+        QVK_TRACE_SCOPE("shader module");
+        QElapsedTimer t;
+        t.start();
+        VkShaderModuleCreateInfo shaderInfo;
+        memset(&shaderInfo, 0, sizeof(shaderInfo));
+        shaderInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+        shaderInfo.codeSize = shader->size;
+        shaderInfo.pCode = shader->code;
+        VkResult err = f->vkCreateShaderModule(m_dev, &shaderInfo, nullptr, &shader->module);
+        if (err != VK_SUCCESS) {
+            qWarning("Failed to create shader module for %s: %d", qPrintable(fileName), err);
+            shader->module = VK_NULL_HANDLE;
+            return VK_NULL_HANDLE;
+        }
+        m_stats.createTime += t.nsecsElapsed();
+        ++m_stats.moduleCount;
+        ++m_stats.createCount;
+    }
+
+    return shader->module;
+}
+
+QVulkanShaderStats QVulkanShaderRegistry::stats() const
+{
+    QMutexLocker lock(&m_mutex);
+    return m_stats;
+}
+
+QT_END_NAMESPACE
@@ -0,0 +1,101 @@
+/****************************************************************************
+**
+** Copyright (C) 2016 The Qt Company Ltd.
+** Contact: http://www.qt.io/licensing/
+**
+** This file is part of the QtVulkan module
+**
+** $QT_BEGIN_LICENSE:LGPL3$
+** Commercial License Usage
+** Licensees holding valid commercial Qt licenses may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement between you and The Qt Company. For licensing terms
+** and conditions see http://www.qt.io/terms-conditions. For further
+** information use the contact form at http://www.qt.io/contact-us.
+**
+** GNU Lesser General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU Lesser
+** General Public License version 3 as published by the Free Software
+** Foundation and appearing in the file LICENSE.LGPLv3 included in the
+** packaging of this file. Please review the following information to
+** ensure the GNU Lesser General Public License version 3 requirements
+** will be met: https://www.gnu.org/licenses/lgpl.html.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 2.0 or later as published by the Free
+** Software Foundation and appearing in the file LICENSE.GPL included in
+** the packaging of this file. Please review the following information to
+** ensure the GNU General Public License version 2.0 requirements will be
+** met: http://www.gnu.org/licenses/gpl-2.0.html.
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+#ifndef QVULKANSHADERREGISTRY_P_H
+#define QVULKANSHADERREGISTRY_P_H
+
+#include "qvulkanrenderloop.h"
+#include <QMutex>
+#include <QHash>
+#include <QVector>
+#include <QString>
+#include <QByteArray>
+
+//
+//  W A R N I N G
+//  -------------
+//
+// This file is not part of the Qt API.  It exists for the convenience
+// of a number of Qt sources files.  This header file may change from
+// version to version without notice, or even be removed.
+//
+// We mean it.
+//
+
+QT_BEGIN_NAMESPACE
+
+class QVulkanFunctions;
+class QFile;
+
+// SPIR-V is memory mapped (uncompressed resources map directly into the
+// binary) and stays mapped for the registry's lifetime. Modules are keyed by
+// the SHA-1 of the code, so the same SPIR-V under different names gives the
+// same module. Modules live as long as the device; when it goes away, the
+// code is kept and the modules get recreated without touching the files.
+class QVulkanShaderRegistry
+{
+public:
+    QVulkanShaderRegistry(QVulkanFunctions *f);
+    ~QVulkanShaderRegistry();
+
+    void setDevice(VkDevice dev);
+    VkShaderModule shaderModule(const QString &fileName);
+    QVulkanShaderStats stats() const;
+
+private:
+    struct Shader {
+        QFile *file;
+        QByteArray copy; // when mapping was not possible
+        const uint32_t *code;
+        size_t size;
+        VkShaderModule module;
+    };
+
+    Shader *load(const QString &fileName);
+    void releaseModules();
+
+    QVulkanFunctions *f;
+    VkDevice m_dev = VK_NULL_HANDLE;
+    mutable QMutex m_mutex;
+    QHash<QString, Shader *> m_files;
+    QHash<QByteArray, Shader *> m_shaders; // by SHA-1
+    QVector<Shader *> m_ownedShaders;
+    QVulkanShaderStats m_stats;
+};
+
+QT_END_NAMESPACE
+
+#endif // QVULKANSHADERREGISTRY_P_H
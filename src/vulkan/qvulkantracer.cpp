@@ -0,0 +1,294 @@
+/****************************************************************************
+**
+** Copyright (C) 2016 The Qt Company Ltd.
+** Contact: http://www.qt.io/licensing/
+**
+** This file is part of the QtVulkan module
+**
+** $QT_BEGIN_LICENSE:LGPL3$
+** Commercial License Usage
+** Licensees holding valid commercial Qt licenses may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement between you and The Qt Company. For licensing terms
+** and conditions see http://www.qt.io/terms-conditions. For further
+** information use the contact form at http://www.qt.io/contact-us.
+**
+** GNU Lesser General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU Lesser
+** General Public License version 3 as published by the Free Software
+** Foundation and appearing in the file LICENSE.LGPLv3 included in the
+** packaging of this file. Please review the following information to
+** ensure the GNU Lesser General Public License version 3 requirements
+** will be met: https://www.gnu.org/licenses/lgpl.html.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 2.0 or later as published by the Free
+** Software Foundation and appearing in the file LICENSE.GPL included in
+** the packaging of this file. Please review the following information to
+** ensure the GNU General Public License version 2.0 requirements will be
+** met: http://www.gnu.org/licenses/gpl-2.0.html.
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+#include "qvulkantracer_p.h"
+#include <QThread>
+#include <QThreadStorage>
+#include <QMutex>
+#include <QVector>
+#include <QAtomicInt>
+#include <QElapsedTimer>
+#include <QSaveFile>
+#include <QCoreApplication>
+#include <QDebug>
+#include <atomic>
+
+QT_BEGIN_NAMESPACE
+
+struct QVulkanTraceEvent
+{
+    const char *name;
+    char phase;
+    qint64 ns;
+};
+
+// Single writer (the owning thread), any number of readers. A ring that
+// overwrites the oldest events once full, so the newest CAPACITY events are
+// always available. count is the number of events recorded, started the
+// number of events whose writing has begun.
+struct QVulkanTraceBuffer
+{
+    static const int CAPACITY = 65536; // must be a power of two
+
+    QVulkanTraceEvent events[CAPACITY];
+    QAtomicInteger<quint64> count;
+    QAtomicInteger<quint64> started;
+    quint64 tid;
+    QByteArray threadName;
+};
+
+struct QVulkanTraceRegistry
+{
+    // Buffers of exited threads are kept for the dump, but only the newest
+    // few, so that short-lived pool threads do not grow the trace forever.
+    static const int MAX_RETIRED_BUFFERS = 8;
+
+    QMutex mutex;
+    QVector<QVulkanTraceBuffer *> buffers;
+    QVector<QVulkanTraceBuffer *> retiredBuffers;
+    QElapsedTimer clock;
+
+    QVulkanTraceRegistry() { clock.start(); }
+};
+
+Q_GLOBAL_STATIC(QVulkanTraceRegistry, traceRegistry)
+
+static thread_local QVulkanTraceBuffer *traceBuffer = nullptr;
+
+// Deleted by QThreadStorage when the thread exits.
+struct QVulkanTraceBufferOwner
+{
+    QVulkanTraceBuffer *buf;
+
+    ~QVulkanTraceBufferOwner()
+    {
+        traceBuffer = nullptr;
+        if (traceRegistry.isDestroyed()) {
+            delete buf;
+            return;
+        }
+        QVulkanTraceRegistry *reg = traceRegistry();
+        QMutexLocker lock(&reg->mutex);
+        reg->buffers.removeOne(buf);
+        reg->retiredBuffers.append(buf);
+        if (reg->retiredBuffers.count() > QVulkanTraceRegistry::MAX_RETIRED_BUFFERS)
+            delete reg->retiredBuffers.takeFirst();
+    }
+};
+
+static QThreadStorage<QVulkanTraceBufferOwner *> traceBufferOwner;
+
+static QVulkanTraceBuffer *threadTraceBuffer()
+{
+    if (!traceBuffer) {
+        QVulkanTraceBuffer *buf = new QVulkanTraceBuffer;
+        buf->count.store(0);
+        buf->started.store(0);
+        buf->tid = quint64(quintptr(QThread::currentThreadId()));
+        QThread *t = QThread::currentThread();
+        buf->threadName = t ? t->objectName().toUtf8() : QByteArray();
+        if (buf->threadName.isEmpty())
+            buf->threadName = QByteArray("thread ") + QByteArray::number(buf->tid);
+        QVulkanTraceRegistry *reg = traceRegistry();
+        {
+            QMutexLocker lock(&reg->mutex);
+            reg->buffers.append(buf);
+        }
+        QVulkanTraceBufferOwner *owner = new QVulkanTraceBufferOwner;
+        owner->buf = buf;
+        traceBufferOwner.setLocalData(owner);
+        traceBuffer = buf;
+    }
+    return traceBuffer;
+}
+
+static inline void record(const char *name, char phase)
+{
+    QVulkanTraceBuffer *buf = threadTraceBuffer();
+    const quint64 idx = buf->count.load();
+    buf->started.store(idx + 1);
+    std::atomic_thread_fence(std::memory_order_release);
+    QVulkanTraceEvent &ev(buf->events[idx & (QVulkanTraceBuffer::CAPACITY - 1)]);
+    ev.name = name;
+    ev.phase = phase;
+    ev.ns = traceRegistry()->clock.nsecsElapsed();
+    buf->count.storeRelease(idx + 1);
+}
+
+// Copies the newest events of buf. Events the writer may have overwritten
+// while copying are left out, as are ends whose begin was overwritten, so the
+// result stays balanced.
+static QVector<QVulkanTraceEvent> traceEvents(const QVulkanTraceBuffer *buf)
+{
+    const quint64 cap = QVulkanTraceBuffer::CAPACITY;
+    const quint64 end = buf->count.loadAcquire();
+    const quint64 start = end > cap ? end - cap : 0;
+    QVector<QVulkanTraceEvent> copy;
+    copy.reserve(int(end - start));
+    for (quint64 i = start; i < end; ++i)
+        copy.append(buf->events[i & (cap - 1)]);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    const quint64 now = buf->started.load();
+    const quint64 valid = now > cap ? now - cap : 0;
+    const int skip = valid > start ? int(qMin(valid, end) - start) : 0;
+
+    QVector<QVulkanTraceEvent> events;
+    events.reserve(copy.count() - skip);
+    int depth = 0;
+    for (int i = skip; i < copy.count(); ++i) {
+        const QVulkanTraceEvent &ev(copy[i]);
+        if (ev.phase == 'B') {
+            ++depth;
+        } else if (ev.phase == 'E') {
+            if (!depth)
+                continue;
+            --depth;
+        }
+        events.append(ev);
+    }
+    return events;
+}
+
+QString QVulkanTracer::fileName()
+{
+    static QString name = QString::fromLocal8Bit(qgetenv("QVULKAN_TRACE"));
+    return name;
+}
+
+bool QVulkanTracer::isEnabled()
+{
+    static bool enabled = !fileName().isEmpty();
+    return enabled;
+}
+
+void QVulkanTracer::begin(const char *name)
+{
+    if (isEnabled())
+        record(name, 'B');
+}
+
+void QVulkanTracer::end(const char *name)
+{
+    if (isEnabled())
+        record(name, 'E');
+}
+
+void QVulkanTracer::instant(const char *name)
+{
+    if (isEnabled())
+        record(name, 'i');
+}
+
+static void appendJsonString(QByteArray *out, const char *s)
+{
+    out->append('"');
+    for (; *s; ++s) {
+        const char c = *s;
+        if (c == '"' || c == '\\') {
+            out->append('\\');
+            out->append(c);
+        } else if (uchar(c) < 0x20) {
+            out->append(' ');
+        } else {
+            out->append(c);
+        }
+    }
+    out->append('"');
+}
+
+bool QVulkanTracer::dump(const QString &fileName)
+{
+    if (!isEnabled())
+        return false;
+
+    const QByteArray pid = QByteArray::number(QCoreApplication::applicationPid());
+    QByteArray out;
+    out.append("{\"traceEvents\":[\n");
+    bool first = true;
+
+    QVulkanTraceRegistry *reg = traceRegistry();
+    QMutexLocker lock(&reg->mutex);
+    QVector<QVulkanTraceBuffer *> buffers = reg->retiredBuffers;
+    buffers.append(reg->buffers);
+    for (QVulkanTraceBuffer *buf : buffers) {
+        const QByteArray tid = QByteArray::number(buf->tid);
+        if (!first)
+            out.append(",\n");
+        first = false;
+        out.append("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":");
+        out.append(pid);
+        out.append(",\"tid\":");
+        out.append(tid);
+        out.append(",\"args\":{\"name\":");
+        appendJsonString(&out, buf->threadName.constData());
+        out.append("}}");
+
+        const QVector<QVulkanTraceEvent> events = traceEvents(buf);
+        for (const QVulkanTraceEvent &ev : events) {
+            out.append(",\n{\"name\":");
+            appendJsonString(&out, ev.name);
+            out.append(",\"ph\":\"");
+            out.append(ev.phase);
+            out.append("\",\"ts\":");
+            out.append(QByteArray::number(ev.ns / 1000.0, 'f', 3));
+            out.append(",\"pid\":");
+            out.append(pid);
+            out.append(",\"tid\":");
+            out.append(tid);
+            if (ev.phase == 'i')
+                out.append(",\"s\":\"t\"");
+            out.append('}');
+        }
+    }
+    lock.unlock();
+
+    out.append("\n]}\n");
+
+    QSaveFile f(fileName);
+    if (!f.open(QIODevice::WriteOnly)) {
+        qWarning("QVulkanTracer: Failed to open %s", qPrintable(fileName));
+        return false;
+    }
+    f.write(out);
+    if (!f.commit()) {
+        qWarning("QVulkanTracer: Failed to write %s", qPrintable(fileName));
+        return false;
+    }
+    return true;
+}
+
+QT_END_NAMESPACE
@@ -0,0 +1,102 @@
+/****************************************************************************
+**
+** Copyright (C) 2016 The Qt Company Ltd.
+** Contact: http://www.qt.io/licensing/
+**
+** This file is part of the QtVulkan module
+**
+** $QT_BEGIN_LICENSE:LGPL3$
+** Commercial License Usage
+** Licensees holding valid commercial Qt licenses may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement between you and The Qt Company. For licensing terms
+** and conditions see http://www.qt.io/terms-conditions. For further
+** information use the contact form at http://www.qt.io/contact-us.
+**
+** GNU Lesser General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU Lesser
+** General Public License version 3 as published by the Free Software
+** Foundation and appearing in the file LICENSE.LGPLv3 included in the
+** packaging of this file. Please review the following information to
+** ensure the GNU Lesser General Public License version 3 requirements
+** will be met: https://www.gnu.org/licenses/lgpl.html.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 2.0 or later as published by the Free
+** Software Foundation and appearing in the file LICENSE.GPL included in
+** the packaging of this file. Please review the following information to
+** ensure the GNU General Public License version 2.0 requirements will be
+** met: http://www.gnu.org/licenses/gpl-2.0.html.
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+#ifndef QVULKANTRACER_P_H
+#define QVULKANTRACER_P_H
+
+#include <QtVulkan/qtvulkanglobal.h>
+#include <QString>
+
+//
+//  W A R N I N G
+//  -------------
+//
+// This file is not part of the Qt API.  It exists for the convenience
+// of a number of Qt sources files.  This header file may change from
+// version to version without notice, or even be removed.
+//
+// We mean it.
+//
+
+QT_BEGIN_NAMESPACE
+
+// Records begin/end/instant events into per-thread ring buffers that are
+// only ever written by their owning thread, so recording takes no locks. Each
+// keeps the newest 65536 events. Names
+// must be string literals (or otherwise outlive the tracer). The result is
+// written as Chrome trace event JSON, loadable in chrome://tracing or the
+// Perfetto UI. Enabled by setting QVULKAN_TRACE to the output file name;
+// the trace collected so far is then written whenever a render loop is
+// destroyed. Only the buffers of the most recently exited threads are kept.
+class QVulkanTracer
+{
+public:
+    static bool isEnabled();
+    static QString fileName();
+
+    static void begin(const char *name);
+    static void end(const char *name);
+    static void instant(const char *name);
+
+    static bool dump(const QString &fileName);
+};
+
+class QVulkanTraceScope
+{
+public:
+    QVulkanTraceScope(const char *name) : m_name(QVulkanTracer::isEnabled() ? name : nullptr)
+    {
+        if (m_name)
+            QVulkanTracer::begin(m_name);
+    }
+    ~QVulkanTraceScope()
+    {
+        if (m_name)
+            QVulkanTracer::end(m_name);
+    }
+
+private:
+    Q_DISABLE_COPY(QVulkanTraceScope)
+    const char *m_name;
+};
+
+#define QVK_TRACE_CONCAT2(a, b) a ## b
+#define QVK_TRACE_CONCAT(a, b) QVK_TRACE_CONCAT2(a, b)
+#define QVK_TRACE_SCOPE(name) QVulkanTraceScope QVK_TRACE_CONCAT(qvkTraceScope, __LINE__)(name)
+
+QT_END_NAMESPACE
+
+#endif // QVULKANTRACER_P_H
@@ -0,0 +1,479 @@
+/****************************************************************************
+**
+** Copyright (C) 2016 The Qt Company Ltd.
+** Contact: http://www.qt.io/licensing/
+**
+** This file is part of the QtVulkan module
+**
+** $QT_BEGIN_LICENSE:LGPL3$
+** Commercial License Usage
+** Licensees holding valid commercial Qt licenses may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement between you and The Qt Company. For licensing terms
+** and conditions see http://www.qt.io/terms-conditions. For further
+** information use the contact form at http://www.qt.io/contact-us.
+**
+** GNU Lesser General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU Lesser
+** General Public License version 3 as published by the Free Software
+** Foundation and appearing in the file LICENSE.LGPLv3 included in the
+** packaging of this file. Please review the following information to
+** ensure the GNU Lesser General Public License version 3 requirements
+** will be met: https://www.gnu.org/licenses/lgpl.html.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 2.0 or later as published by the Free
+** Software Foundation and appearing in the file LICENSE.GPL included in
+** the packaging of this file. Please review the following information to
+** ensure the GNU General Public License version 2.0 requirements will be
+** met: http://www.gnu.org/licenses/gpl-2.0.html.
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+#include "qvulkanuploader_p.h"
+#include "qvulkanmemoryallocator_p.h"
+#include "qvulkantracer_p.h"
+#include <QVulkanFunctions>
+#include <QVarLengthArray>
+#include <QDebug>
+
+QT_BEGIN_NAMESPACE
+
+class QVulkanUploadTask : public QRunnable
+{
+public:
+    QVulkanUploadTask(QVulkanUploader *uploader, const QVulkanUploader::Request &request)
+        : m_uploader(uploader), m_request(request) { }
+    void run() override { m_uploader->process(m_request); }
+
+private:
+    QVulkanUploader *m_uploader;
+    QVulkanUploader::Request m_request;
+};
+
+static inline VkDeviceSize aligned(VkDeviceSize v, VkDeviceSize byteAlign)
+{
+    return (v + byteAlign - 1) & ~(byteAlign - 1);
+}
+
+QVulkanUploader::QVulkanUploader(QVulkanFunctions *f, VkDevice dev, QVulkanMemoryAllocator *allocator,
+                                 const VkPhysicalDeviceLimits &limits,
+                                 VkQueue queue, uint32_t queueFamilyIndex, uint32_t gfxQueueFamilyIndex,
+                                 VkDeviceSize stagingSize)
+    : f(f),
+      m_dev(dev),
+      m_allocator(allocator),
+      m_copyAlignment(qMax<VkDeviceSize>(16, limits.optimalBufferCopyOffsetAlignment)),
+      m_queue(queue),
+      m_queueFamilyIndex(queueFamilyIndex),
+      m_gfxQueueFamilyIndex(gfxQueueFamilyIndex),
+      m_ringSize(aligned(stagingSize, m_copyAlignment))
+{
+    m_pool.setMaxThreadCount(1);
+
+    VkCommandPoolCreateInfo poolInfo;
+    memset(&poolInfo, 0, sizeof(poolInfo));
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    poolInfo.queueFamilyIndex = m_queueFamilyIndex;
+    VkResult err = f->vkCreateCommandPool(m_dev, &poolInfo, nullptr, &m_cmdPool);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create upload command pool: %d", err);
+
+    VkBufferCreateInfo bufInfo;
+    memset(&bufInfo, 0, sizeof(bufInfo));
+    bufInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufInfo.size = m_ringSize;
+    bufInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+    err = f->vkCreateBuffer(m_dev, &bufInfo, nullptr, &m_ringBuf);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create upload staging buffer: %d", err);
+
+    // Host coherent memory is guaranteed to exist, so there is nothing to flush.
+    VkMemoryRequirements memReq;
+    f->vkGetBufferMemoryRequirements(m_dev, m_ringBuf, &memReq);
+    m_ringAlloc = m_allocator->allocate(memReq, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                        0, VK_IMAGE_TILING_LINEAR);
+    if (m_ringAlloc.memory == VK_NULL_HANDLE)
+        qFatal("Failed to allocate upload staging memory");
+    err = f->vkBindBufferMemory(m_dev, m_ringBuf, m_ringAlloc.memory, m_ringAlloc.offset);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to bind upload staging memory: %d", err);
+}
+
+QVulkanUploader::~QVulkanUploader()
+{
+    cancel();
+
+    for (Submission *s : qAsConst(m_submissions)) {
+        if (s->fence != VK_NULL_HANDLE)
+            f->vkDestroyFence(m_dev, s->fence, nullptr);
+        if (s->tempBuf != VK_NULL_HANDLE) {
+            f->vkDestroyBuffer(m_dev, s->tempBuf, nullptr);
+            m_allocator->free(s->tempAlloc);
+        }
+        delete s;
+    }
+    f->vkDestroyCommandPool(m_dev, m_cmdPool, nullptr);
+    f->vkDestroyBuffer(m_dev, m_ringBuf, nullptr);
+    m_allocator->free(m_ringAlloc);
+}
+
+QVulkanUploadToken QVulkanUploader::uploadBuffer(VkBuffer dst, VkDeviceSize dstOffset, const QByteArray &data)
+{
+    Request r;
+    memset(&r.region, 0, sizeof(r.region));
+    r.token = m_lastToken.fetchAndAddOrdered(1) + 1;
+    r.buffer = dst;
+    r.bufferOffset = dstOffset;
+    r.image = VK_NULL_HANDLE;
+    r.finalLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    r.data = data;
+    m_pool.start(new QVulkanUploadTask(this, r));
+    return r.token;
+}
+
+QVulkanUploadToken QVulkanUploader::uploadImage(VkImage dst, VkImageLayout finalLayout,
+                                                const VkBufferImageCopy &region, const QByteArray &data)
+{
+    Request r;
+    r.token = m_lastToken.fetchAndAddOrdered(1) + 1;
+    r.buffer = VK_NULL_HANDLE;
+    r.bufferOffset = 0;
+    r.image = dst;
+    r.finalLayout = finalLayout;
+    r.region = region;
+    r.data = data;
+    m_pool.start(new QVulkanUploadTask(this, r));
+    return r.token;
+}
+
+// Returns a ring position for size bytes, waiting for earlier submissions to
+// finish when the ring is full. Positions only ever grow, the offset in the
+// buffer is the position modulo the ring size.
+VkDeviceSize QVulkanUploader::reserve(VkDeviceSize size, VkDeviceSize alignment)
+{
+    Q_ASSERT(size <= m_ringSize);
+    VkDeviceSize pos = aligned(m_ringHead, alignment);
+    if (pos % m_ringSize + size > m_ringSize)
+        pos = (pos / m_ringSize + 1) * m_ringSize;
+
+    QMutexLocker lock(&m_mutex);
+    for ( ; ; ) {
+        retire();
+        if (m_inFlight.isEmpty() && m_pending.isEmpty()) {
+            m_ringTail = pos;
+            break;
+        }
+        if (pos + size - m_ringTail <= m_ringSize)
+            break;
+        QVK_TRACE_SCOPE("upload ring wait");
+        if (m_inFlight.isEmpty()) {
+            m_pendingSubmitted.wait(&m_mutex);
+        } else {
+            VkFence fence = m_inFlight.first()->fence;
+            lock.unlock();
+            f->vkWaitForFences(m_dev, 1, &fence, true, UINT64_MAX);
+            lock.relock();
+        }
+    }
+
+    m_ringHead = pos + size;
+    return pos;
+}
+
+QVulkanUploader::Submission *QVulkanUploader::beginSubmission()
+{
+    Submission *s;
+    m_mutex.lock();
+    if (!m_free.isEmpty()) {
+        s = m_free.last();
+        m_free.removeLast();
+    } else {
+        s = new Submission;
+        m_submissions.append(s);
+    }
+    m_mutex.unlock();
+
+    if (s->tempBuf != VK_NULL_HANDLE) {
+        f->vkDestroyBuffer(m_dev, s->tempBuf, nullptr);
+        m_allocator->free(s->tempAlloc);
+        s->tempBuf = VK_NULL_HANDLE;
+    }
+
+    VkResult err;
+    if (s->cb == VK_NULL_HANDLE) {
+        VkCommandBufferAllocateInfo cmdBufInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, nullptr, m_cmdPool, VK_COMMAND_BUFFER_LEVEL_PRIMARY, 1 };
+        err = f->vkAllocateCommandBuffers(m_dev, &cmdBufInfo, &s->cb);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to allocate upload command buffer: %d", err);
+    }
+    if (s->fence == VK_NULL_HANDLE) {
+        VkFenceCreateInfo fenceInfo = { VK_STRUCTURE_TYPE_FENCE_CREATE_INFO, nullptr, 0 };
+        err = f->vkCreateFence(m_dev, &fenceInfo, nullptr, &s->fence);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to create upload fence: %d", err);
+    } else {
+        f->vkResetFences(m_dev, 1, &s->fence);
+    }
+
+    s->token = 0;
+    s->bufferBarriers.clear();
+    s->imageBarriers.clear();
+
+    VkCommandBufferBeginInfo cmdBufBeginInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, nullptr,
+                                                 VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT, nullptr };
+    err = f->vkBeginCommandBuffer(s->cb, &cmdBufBeginInfo);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to begin upload command buffer: %d", err);
+
+    return s;
+}
+
+void QVulkanUploader::submit(Submission *s)
+{
+    VkResult err = f->vkEndCommandBuffer(s->cb);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to end upload command buffer: %d", err);
+
+    s->ringEnd = m_ringHead;
+
+    QMutexLocker lock(&m_mutex);
+    if (ownershipTransfer() || m_cancelling)
+        queueSubmit(s);
+    else
+        m_pending.append(s);
+}
+
+// Called with m_mutex locked.
+void QVulkanUploader::queueSubmit(Submission *s)
+{
+    VkSubmitInfo submitInfo;
+    memset(&submitInfo, 0, sizeof(submitInfo));
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &s->cb;
+    VkResult err = f->vkQueueSubmit(m_queue, 1, &submitInfo, s->fence);
+    if (err != VK_SUCCESS)
+        qWarning("Failed to submit upload: %d", err);
+    m_inFlight.append(s);
+}
+
+void QVulkanUploader::process(const Request &r)
+{
+    QVK_TRACE_SCOPE("upload");
+    const VkDeviceSize size = r.data.size();
+    quint8 *ring = static_cast<quint8 *>(m_ringAlloc.mapped);
+    const uint32_t srcFamily = ownershipTransfer() ? m_queueFamilyIndex : VK_QUEUE_FAMILY_IGNORED;
+    const uint32_t dstFamily = ownershipTransfer() ? m_gfxQueueFamilyIndex : VK_QUEUE_FAMILY_IGNORED;
+
+    // Half the ring at most, so that the next chunk can be copied while
+    // the previous one is being transferred.
+    const VkDeviceSize maxChunk = m_ringSize / 2;
+
+    if (r.buffer != VK_NULL_HANDLE) {
+        VkDeviceSize done = 0;
+        do {
+            const VkDeviceSize chunk = qMin(size - done, maxChunk);
+            const VkDeviceSize offset = reserve(chunk, m_copyAlignment) % m_ringSize;
+            memcpy(ring + offset, r.data.constData() + done, chunk);
+
+            Submission *s = beginSubmission();
+            if (chunk) {
+                VkBufferCopy copy = { offset, r.bufferOffset + done, chunk };
+                f->vkCmdCopyBuffer(s->cb, m_ringBuf, r.buffer, 1, &copy);
+            }
+            if (chunk && ownershipTransfer()) {
+                VkBufferMemoryBarrier barrier;
+                memset(&barrier, 0, sizeof(barrier));
+                barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+                barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+                barrier.srcQueueFamilyIndex = srcFamily;
+                barrier.dstQueueFamilyIndex = dstFamily;
+                barrier.buffer = r.buffer;
+                barrier.offset = r.bufferOffset + done;
+                barrier.size = chunk;
+                f->vkCmdPipelineBarrier(s->cb, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                                        0, 0, nullptr, 1, &barrier, 0, nullptr);
+                barrier.srcAccessMask = 0;
+                barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+                s->bufferBarriers.append(barrier);
+            }
+            done += chunk;
+            if (done == size)
+                s->token = r.token;
+            submit(s);
+        } while (done < size);
+        return;
+    }
+
+    // Images are not split, big ones get a staging buffer of their own.
+    Submission *s = beginSubmission();
+    VkBuffer srcBuf = m_ringBuf;
+    VkDeviceSize srcOffset = 0;
+    if (size <= maxChunk) {
+        srcOffset = reserve(size, m_copyAlignment) % m_ringSize;
+        memcpy(ring + srcOffset, r.data.constData(), size);
+    } else {
+        VkBufferCreateInfo bufInfo;
+        memset(&bufInfo, 0, sizeof(bufInfo));
+        bufInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        bufInfo.size = size;
+        bufInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+        VkResult err = f->vkCreateBuffer(m_dev, &bufInfo, nullptr, &s->tempBuf);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to create temporary staging buffer: %d", err);
+        VkMemoryRequirements memReq;
+        f->vkGetBufferMemoryRequirements(m_dev, s->tempBuf, &memReq);
+        s->tempAlloc = m_allocator->allocate(memReq, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                             0, VK_IMAGE_TILING_LINEAR);
+        if (s->tempAlloc.memory == VK_NULL_HANDLE)
+            qFatal("Failed to allocate temporary staging memory");
+        err = f->vkBindBufferMemory(m_dev, s->tempBuf, s->tempAlloc.memory, s->tempAlloc.offset);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to bind temporary staging memory: %d", err);
+        memcpy(s->tempAlloc.mapped, r.data.constData(), size);
+        srcBuf = s->tempBuf;
+    }
+
+    const VkImageSubresourceLayers &layers(r.region.imageSubresource);
+    VkImageMemoryBarrier barrier;
+    memset(&barrier, 0, sizeof(barrier));
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = r.image;
+    barrier.subresourceRange.aspectMask = layers.aspectMask;
+    barrier.subresourceRange.baseMipLevel = layers.mipLevel;
+    barrier.subresourceRange.levelCount = 1;
+    barrier.subresourceRange.baseArrayLayer = layers.baseArrayLayer;
+    barrier.subresourceRange.layerCount = layers.layerCount;
+    f->vkCmdPipelineBarrier(s->cb, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                            0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+    VkBufferImageCopy region = r.region;
+    region.bufferOffset += srcOffset;
+    f->vkCmdCopyBufferToImage(s->cb, srcBuf, r.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+    // With an ownership transfer the layout change is specified identically
+    // in the release and the acquire, and happens once. On the same queue the
+    // transition has to be in the first scope of the barrier recordAcquire()
+    // adds, which includes TRANSFER, hence ALL_COMMANDS here.
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = ownershipTransfer() ? 0 : VK_ACCESS_MEMORY_READ_BIT;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = r.finalLayout;
+    barrier.srcQueueFamilyIndex = srcFamily;
+    barrier.dstQueueFamilyIndex = dstFamily;
+    f->vkCmdPipelineBarrier(s->cb, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                            ownershipTransfer() ? VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT : VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                            0, 0, nullptr, 0, nullptr, 1, &barrier);
+    if (ownershipTransfer()) {
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+        s->imageBarriers.append(barrier);
+    }
+
+    s->token = r.token;
+    submit(s);
+}
+
+// Moves the finished submissions, in order, to m_done and frees their ring
+// space. Called with m_mutex locked.
+void QVulkanUploader::retire()
+{
+    while (!m_inFlight.isEmpty()) {
+        Submission *s = m_inFlight.first();
+        if (f->vkGetFenceStatus(m_dev, s->fence) != VK_SUCCESS)
+            break;
+        m_ringTail = s->ringEnd;
+        m_inFlight.removeFirst();
+        m_done.append(s);
+    }
+}
+
+// Called on the render thread with the frame's first command buffer, which
+// comes before any of the worker's commands, before it gets submitted.
+void QVulkanUploader::recordAcquire(VkCommandBuffer cb)
+{
+    QMutexLocker lock(&m_mutex);
+    retire();
+
+    QVarLengthArray<VkBufferMemoryBarrier, 16> bufferBarriers;
+    QVarLengthArray<VkImageMemoryBarrier, 16> imageBarriers;
+    QVulkanUploadToken ready = 0;
+    for (Submission *s : qAsConst(m_done)) {
+        bufferBarriers.append(s->bufferBarriers.constData(), s->bufferBarriers.count());
+        imageBarriers.append(s->imageBarriers.constData(), s->imageBarriers.count());
+        if (s->token)
+            ready = s->token;
+        m_free.append(s);
+    }
+    m_done.clear();
+
+    // On the graphics queue the uploads need not finish first, the barrier
+    // below orders the frame after them.
+    const bool submitted = !m_pending.isEmpty();
+    for (Submission *s : qAsConst(m_pending)) {
+        queueSubmit(s);
+        if (s->token)
+            ready = s->token;
+    }
+    m_pending.clear();
+    if (submitted)
+        m_pendingSubmitted.wakeAll();
+
+    if (ownershipTransfer()) {
+        if (!bufferBarriers.isEmpty() || !imageBarriers.isEmpty())
+            f->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0,
+                                    0, nullptr,
+                                    bufferBarriers.count(), bufferBarriers.constData(),
+                                    imageBarriers.count(), imageBarriers.constData());
+    } else if (submitted) {
+        // Same queue, submission order makes the copies part of the first scope.
+        VkMemoryBarrier barrier;
+        memset(&barrier, 0, sizeof(barrier));
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+        f->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0,
+                                1, &barrier, 0, nullptr, 0, nullptr);
+    }
+
+    if (ready)
+        m_readyToken.store(ready);
+}
+
+// Drops the uploads not started yet and waits for the rest to finish. Their
+// tokens never become ready. Nothing else may use the queue meanwhile.
+void QVulkanUploader::cancel()
+{
+    m_pool.clear();
+
+    m_mutex.lock();
+    m_cancelling = true;
+    for (Submission *s : qAsConst(m_pending))
+        queueSubmit(s);
+    m_pending.clear();
+    m_pendingSubmitted.wakeAll();
+    m_mutex.unlock();
+
+    m_pool.waitForDone();
+
+    QMutexLocker lock(&m_mutex);
+    for (Submission *s : qAsConst(m_inFlight))
+        f->vkWaitForFences(m_dev, 1, &s->fence, true, UINT64_MAX);
+    retire();
+    m_free.append(m_done);
+    m_done.clear();
+    m_cancelling = false;
+}
+
+QT_END_NAMESPACE
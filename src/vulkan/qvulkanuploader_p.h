@@ -0,0 +1,153 @@
+/****************************************************************************
+**
+** Copyright (C) 2016 The Qt Company Ltd.
+** Contact: http://www.qt.io/licensing/
+**
+** This file is part of the QtVulkan module
+**
+** $QT_BEGIN_LICENSE:LGPL3$
+** Commercial License Usage
+** Licensees holding valid commercial Qt licenses may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement between you and The Qt Company. For licensing terms
+** and conditions see http://www.qt.io/terms-conditions. For further
+** information use the contact form at http://www.qt.io/contact-us.
+**
+** GNU Lesser General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU Lesser
+** General Public License version 3 as published by the Free Software
+** Foundation and appearing in the file LICENSE.LGPLv3 included in the
+** packaging of this file. Please review the following information to
+** ensure the GNU Lesser General Public License version 3 requirements
+** will be met: https://www.gnu.org/licenses/lgpl.html.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 2.0 or later as published by the Free
+** Software Foundation and appearing in the file LICENSE.GPL included in
+** the packaging of this file. Please review the following information to
+** ensure the GNU General Public License version 2.0 requirements will be
+** met: http://www.gnu.org/licenses/gpl-2.0.html.
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+#ifndef QVULKANUPLOADER_P_H
+#define QVULKANUPLOADER_P_H
+
+#include "qvulkanrenderloop.h"
+#include <QMutex>
+#include <QWaitCondition>
+#include <QVector>
+#include <QThreadPool>
+#include <QAtomicInteger>
+
+//
+//  W A R N I N G
+//  -------------
+//
+// This file is not part of the Qt API.  It exists for the convenience
+// of a number of Qt sources files.  This header file may change from
+// version to version without notice, or even be removed.
+//
+// We mean it.
+//
+
+QT_BEGIN_NAMESPACE
+
+class QVulkanFunctions;
+class QVulkanMemoryAllocator;
+
+// Copies data into device local buffers and images on a background thread,
+// through a host visible staging ring. Data larger than the ring is split up
+// for buffers, images get a temporary staging buffer instead. With a queue
+// from another family than the graphics one, which must not be used by
+// anything else, the uploads are submitted right away. Ownership is released
+// after the copy and acquired in the frame command buffer passed to
+// recordAcquire(). Otherwise the queue is the graphics queue, which the render
+// thread and the worker submit to without any locking, so the uploads are
+// submitted from recordAcquire() instead. Either way a token becomes ready in
+// recordAcquire().
+class QVulkanUploader
+{
+public:
+    QVulkanUploader(QVulkanFunctions *f, VkDevice dev, QVulkanMemoryAllocator *allocator,
+                    const VkPhysicalDeviceLimits &limits,
+                    VkQueue queue, uint32_t queueFamilyIndex, uint32_t gfxQueueFamilyIndex,
+                    VkDeviceSize stagingSize);
+    ~QVulkanUploader();
+
+    QVulkanUploadToken uploadBuffer(VkBuffer dst, VkDeviceSize dstOffset, const QByteArray &data);
+    QVulkanUploadToken uploadImage(VkImage dst, VkImageLayout finalLayout,
+                                   const VkBufferImageCopy &region, const QByteArray &data);
+    bool isReady(QVulkanUploadToken token) const { return token <= m_readyToken.load(); }
+
+    void recordAcquire(VkCommandBuffer cb);
+    void cancel();
+
+private:
+    friend class QVulkanUploadTask;
+
+    struct Request {
+        QVulkanUploadToken token;
+        VkBuffer buffer;
+        VkDeviceSize bufferOffset;
+        VkImage image;
+        VkImageLayout finalLayout;
+        VkBufferImageCopy region;
+        QByteArray data;
+    };
+
+    struct Submission {
+        VkCommandBuffer cb = VK_NULL_HANDLE;
+        VkFence fence = VK_NULL_HANDLE;
+        VkDeviceSize ringEnd; // ring position to free up to once done
+        QVulkanUploadToken token; // set on the last submission of a request
+        QVector<VkBufferMemoryBarrier> bufferBarriers; // to acquire
+        QVector<VkImageMemoryBarrier> imageBarriers;
+        VkBuffer tempBuf = VK_NULL_HANDLE;
+        QVulkanMemoryAllocation tempAlloc;
+    };
+
+    void process(const Request &r);
+    VkDeviceSize reserve(VkDeviceSize size, VkDeviceSize alignment);
+    Submission *beginSubmission();
+    void submit(Submission *s);
+    void queueSubmit(Submission *s);
+    void retire();
+    bool ownershipTransfer() const { return m_queueFamilyIndex != m_gfxQueueFamilyIndex; }
+
+    QVulkanFunctions *f;
+    VkDevice m_dev;
+    QVulkanMemoryAllocator *m_allocator;
+    VkDeviceSize m_copyAlignment;
+    VkQueue m_queue;
+    uint32_t m_queueFamilyIndex;
+    uint32_t m_gfxQueueFamilyIndex;
+
+    VkCommandPool m_cmdPool = VK_NULL_HANDLE; // only used on the upload thread
+    VkBuffer m_ringBuf = VK_NULL_HANDLE;
+    QVulkanMemoryAllocation m_ringAlloc;
+    VkDeviceSize m_ringSize;
+    VkDeviceSize m_ringHead = 0; // ever increasing positions, modulo m_ringSize
+    VkDeviceSize m_ringTail = 0;
+
+    QThreadPool m_pool; // one thread
+    QAtomicInteger<quint64> m_lastToken;
+    QAtomicInteger<quint64> m_readyToken;
+
+    QMutex m_mutex;
+    QWaitCondition m_pendingSubmitted;
+    bool m_cancelling = false;
+    QVector<Submission *> m_pending; // waiting for recordAcquire() to submit
+    QVector<Submission *> m_inFlight; // in submission order
+    QVector<Submission *> m_done; // waiting for recordAcquire()
+    QVector<Submission *> m_free;
+    QVector<Submission *> m_submissions;
+};
+
+QT_END_NAMESPACE
+
+#endif // QVULKANUPLOADER_P_H
@@ -7,12 +7,24 @@ load(qt_module)
 DEFINES += QTVULKAN_BUILD_DLL
 
 SOURCES += $$PWD/qvulkanfunctions.cpp \
-           $$PWD/qvulkanrenderloop.cpp
+           $$PWD/qvulkanrenderloop.cpp \
+           $$PWD/qvulkanmemoryallocator.cpp \
+           $$PWD/qvulkantracer.cpp \
+           $$PWD/qvulkanpipelinebuilder.cpp \
+           $$PWD/qvulkanshaderregistry.cpp \
+           $$PWD/qvulkanuploader.cpp \
+           $$PWD/qvulkanjobsystem.cpp
 
 HEADERS += $$PWD/qtvulkanglobal.h \
            $$PWD/qvulkan.h \
            $$PWD/qvulkanfunctions.h \
            $$PWD/qvulkanrenderloop.h \
-           $$PWD/qvulkanrenderloop_p.h
+           $$PWD/qvulkanrenderloop_p.h \
+           $$PWD/qvulkanmemoryallocator_p.h \
+           $$PWD/qvulkantracer_p.h \
+           $$PWD/qvulkanpipelinebuilder_p.h \
+           $$PWD/qvulkanshaderregistry_p.h \
+           $$PWD/qvulkanuploader_p.h \
+           $$PWD/qvulkanjobsystem_p.h
 
 INCLUDEPATH += $$VULKAN_INCLUDE_PATH